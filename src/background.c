@@ -19,42 +19,221 @@
 
 #include "background.h"
 
+static int findTileSlot(int tile);
+static void uploadTile(int tile, int slot);
+
 static int backgroundY;
-static SDL_Texture *background;
+static int scrollTimer;
+static SDL_Surface *image;
+static SDL_Texture *tiles;
+static TileSlot slots[MAX_BACKGROUND_SLOTS];
+static int numSlots;
+static int numTiles;
+static int period;
+static float scaleY;
+static int frame;
+static int generation;
 
+// Initialize the background.
+// The background image is split in horizontal tiles, which are uploaded to a small
+// texture of tile slots only when they become visible. The least recently used slot
+// is reused, so the texture size doesn't depend on the background height.
+// An image as tall as wide covers the screen, taller images scroll longer.
 void initBackground(void)
-{       
-        background = loadTexture("gfx/background.png");
-        backgroundY = 0;
+{
+	int i, w, h, opaque, visible;
+
+	image = decodeImage("gfx/background.png", &w, &h, &opaque, NULL);
+
+	if (image == NULL)
+	{
+		SDL_LogMessage(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_WARN, "Couldn't load the background: %s", SDL_GetError());
+		return;
+	}
+
+	period = SCREEN_HEIGHT * h / w;
+	scaleY = (float)period / image->h;
+	numTiles = (image->h + BACKGROUND_TILE_HEIGHT - 1) / BACKGROUND_TILE_HEIGHT;
+
+	// A tile more than the screen height, to scroll without uploading every frame
+	visible = SCREEN_HEIGHT / (BACKGROUND_TILE_HEIGHT * scaleY) + 2;
+	numSlots = MIN(MIN(visible + 1, numTiles), MAX_BACKGROUND_SLOTS);
+
+	// Every slot has a row of the neighbour tiles above and below, so the
+	// linear filter never blends a tile with the next slot.
+	tiles = SDL_CreateTexture(app.renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, image->w, numSlots * (BACKGROUND_TILE_HEIGHT + 2));
+	SDL_SetTextureBlendMode(tiles, SDL_BLENDMODE_NONE);
+
+	for (i = 0 ; i < numSlots ; i++)
+	{
+		slots[i].tile = -1;
+	}
+
+	generation = app.layerGeneration;
+
+	backgroundY = 0;
 }
 
 void doBackground(void)
 {
+        int rate;
+
+        // Slow down the background on attract screens.
+        // Move the background only every app.attractScrollRate frames when nobody is playing,
+        // or when the quality is lowered.
+        rate = MAX(app.attract ? app.attractScrollRate : 1, getQuality()->scrollRate);
+
+        if (++scrollTimer < rate)
+        {
+                return;
+        }
+
+        scrollTimer = 0;
+
         // Update the background.
         // Move the background from top to bottom screen and repeat.
-        if (--backgroundY < -SCREEN_HEIGHT)
+        if (--backgroundY < -period)
         {
                 backgroundY = 0;
         }
+
+        app.redraw = TRUE;
 }
 
+// Display the background.
+// Draw a quad for every tile intersecting the screen, with the texture coordinates
+// of its slot, then draw them all with a single geometry call. The tiles wrap
+// around the end of the image, so the background repeats without disruption.
 void drawBackground(void)
 {
-        SDL_Rect dest;
-        int y;
+        SDL_Vertex vertices[(MAX_BACKGROUND_SLOTS + 1) * 4];
+        int indices[(MAX_BACKGROUND_SLOTS + 1) * 6];
+        SDL_Vertex *v;
+        float y, h, top, bottom, texH;
+        int i, n, tile, slot, rows;
+
+        if (tiles == NULL)
+        {
+                return;
+        }
+
+        // The slots content is lost with the render targets
+        if (generation != app.layerGeneration)
+        {
+                for (i = 0 ; i < numSlots ; i++)
+                {
+                        slots[i].tile = -1;
+                }
+
+                generation = app.layerGeneration;
+        }
+
+        frame++;
+
+        texH = numSlots * (BACKGROUND_TILE_HEIGHT + 2);
+
+        // Image row at the top of the screen, and the first visible tile
+        tile = (-backgroundY / scaleY) / BACKGROUND_TILE_HEIGHT;
+        y = tile * BACKGROUND_TILE_HEIGHT * scaleY + backgroundY;
+
+        for (n = 0 ; y < SCREEN_HEIGHT && n <= MAX_BACKGROUND_SLOTS ; n++, tile++)
+        {
+                slot = findTileSlot(tile % numTiles);
+
+                if (slot < 0)
+                {
+                        break;
+                }
+
+                rows = MIN(BACKGROUND_TILE_HEIGHT, image->h - (tile % numTiles) * BACKGROUND_TILE_HEIGHT);
+                h = rows * scaleY;
+
+                top = (slot * (BACKGROUND_TILE_HEIGHT + 2) + 1) / texH;
+                bottom = top + rows / texH;
+
+                v = &vertices[n * 4];
+
+                for (i = 0 ; i < 4 ; i++)
+                {
+                        v[i].position.x = (i & 1) ? SCREEN_WIDTH : 0;
+                        v[i].position.y = (i & 2) ? y + h : y;
+                        v[i].color.r = v[i].color.g = v[i].color.b = v[i].color.a = 255;
+                        v[i].tex_coord.x = (i & 1) ? 1 : 0;
+                        v[i].tex_coord.y = (i & 2) ? bottom : top;
+                }
+
+                indices[n * 6 + 0] = n * 4 + 0;
+                indices[n * 6 + 1] = n * 4 + 1;
+                indices[n * 6 + 2] = n * 4 + 2;
+                indices[n * 6 + 3] = n * 4 + 1;
+                indices[n * 6 + 4] = n * 4 + 3;
+                indices[n * 6 + 5] = n * 4 + 2;
+
+                y += h;
+        }
+
+        SDL_RenderGeometry(app.renderer, tiles, vertices, n * 4, indices, n * 6);
+}
+
+// Find the slot of a tile.
+// Upload the tile in a free slot, or in the least recently used one which isn't
+// drawn in this frame. Return -1 when every slot is used by this frame.
+static int findTileSlot(int tile)
+{
+        int i, slot;
+
+        slot = -1;
 
-        // Display the background.
-        // Draw the background without dispruption on the screen.
-        for (y = backgroundY; y < SCREEN_HEIGHT; y += SCREEN_HEIGHT)
+        for (i = 0 ; i < numSlots ; i++)
         {
-                dest.x = 0;
-                dest.y = y;
-                dest.w = SCREEN_WIDTH;
-                dest.h = SCREEN_HEIGHT;
+                if (slots[i].tile == tile)
+                {
+                        slots[i].lastUsed = frame;
+                        return i;
+                }
 
-                SDL_RenderCopy(app.renderer, background, NULL, &dest);
+                if (slots[i].lastUsed != frame && (slot < 0 || slots[i].tile < 0
+                    || (slots[slot].tile >= 0 && slots[i].lastUsed < slots[slot].lastUsed)))
+                {
+                        slot = i;
+                }
         }
+
+        if (slot >= 0)
+        {
+                uploadTile(tile, slot);
+
+                slots[slot].tile = tile;
+                slots[slot].lastUsed = frame;
+        }
+
+        return slot;
 }
 
+// Upload a tile in its slot, with the last row of the previous tile above it and
+// the first row of the next tile below it.
+static void uploadTile(int tile, int slot)
+{
+        SDL_Rect r;
+        Uint8 *pixels;
+        int i, row, pitch;
+
+        r.x = 0;
+        r.y = slot * (BACKGROUND_TILE_HEIGHT + 2);
+        r.w = image->w;
+        r.h = BACKGROUND_TILE_HEIGHT + 2;
 
+        if (SDL_LockTexture(tiles, &r, (void **)&pixels, &pitch) < 0)
+        {
+                return;
+        }
+
+        for (i = 0 ; i < r.h ; i++)
+        {
+                row = (tile * BACKGROUND_TILE_HEIGHT + i - 1 + image->h) % image->h;
 
+                memcpy(pixels + i * pitch, (Uint8 *)image->pixels + row * image->pitch, image->w * 4);
+        }
+
+        SDL_UnlockTexture(tiles);
+}
@@ -19,6 +19,7 @@
 
 #include "common.h"
 
-extern SDL_Texture *loadTexture(char *filename);
+extern SDL_Surface *decodeImage(char *filename, int *w, int *h, int *opaque, Mask **mask);
+extern Quality *getQuality(void);
 
 extern App app;
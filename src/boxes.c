@@ -0,0 +1,289 @@
+/*
+    Copyright (C) 2021 Vincent Radé
+    Copyright (C) 2015-2018 Parallel Realities
+
+    Nature Invaders is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Nature Invaders is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Nature Invaders. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include "boxes.h"
+
+static int collideScalar(Boxes *boxes, int start, float x, float y, float w, float h, Uint32 *hits);
+#ifdef __SSE2__
+static int collideSSE2(Boxes *boxes, int start, float x, float y, float w, float h, Uint32 *hits);
+#endif
+#ifdef BOXES_AVX2
+static int collideAVX2(Boxes *boxes, int start, float x, float y, float w, float h, Uint32 *hits);
+#endif
+
+// Collision kernel, selected at initialization according to the CPU features.
+// Test a box against the boxes from 'start'. Without 'hits', return the index of
+// the first box hit, or -1. Otherwise set the bit of every box hit in 'hits', which
+// is cleared by the caller, and return the number of boxes hit. Boxes collide when
+// they overlap, touching edges don't collide. Every kernel gives the same result.
+static int (*collide)(Boxes *boxes, int start, float x, float y, float w, float h, Uint32 *hits);
+
+void initBoxes(void)
+{
+	collide = collideScalar;
+
+#ifdef __SSE2__
+	if (SDL_HasSSE2())
+	{
+		collide = collideSSE2;
+	}
+#endif
+
+#ifdef BOXES_AVX2
+	if (SDL_HasAVX2())
+	{
+		collide = collideAVX2;
+	}
+#endif
+}
+
+// Add a box to a packed array of boxes, and return its index.
+// The arrays grow by doubling, and are kept for the next frames.
+int addBox(Boxes *boxes, float x, float y, float w, float h)
+{
+	if (boxes->count == boxes->capacity)
+	{
+		boxes->capacity = MAX(boxes->capacity * 2, 64);
+		boxes->x = realloc(boxes->x, boxes->capacity * sizeof(float));
+		boxes->y = realloc(boxes->y, boxes->capacity * sizeof(float));
+		boxes->w = realloc(boxes->w, boxes->capacity * sizeof(float));
+		boxes->h = realloc(boxes->h, boxes->capacity * sizeof(float));
+		boxes->hits = realloc(boxes->hits, boxes->capacity / 32 * sizeof(Uint32));
+	}
+
+	boxes->x[boxes->count] = x;
+	boxes->y[boxes->count] = y;
+	boxes->w[boxes->count] = w;
+	boxes->h[boxes->count] = h;
+
+	return boxes->count++;
+}
+
+// Find the first box hit by a box, from the 'start' index. Return -1 when none is hit.
+int findCollision(Boxes *boxes, int start, float x, float y, float w, float h)
+{
+	return collide(boxes, start, x, y, w, h, NULL);
+}
+
+// Find every box hit by a box.
+// Set the bit of each box hit in the 'hits' bitmask of the boxes, the box i in
+// bit i % 32 of the word i / 32, and return the number of boxes hit.
+int findCollisions(Boxes *boxes, float x, float y, float w, float h)
+{
+	if (boxes->count == 0)
+	{
+		return 0;
+	}
+
+	memset(boxes->hits, 0, (boxes->count + 31) / 32 * sizeof(Uint32));
+
+	return collide(boxes, 0, x, y, w, h, boxes->hits);
+}
+
+// Find every pair of colliding boxes between two arrays.
+// 'hits' holds a bitmask of (b->count + 31) / 32 words for each box of 'a', set
+// like the one of findCollisions. Return the number of pairs hit.
+int findPairCollisions(Boxes *a, Boxes *b, Uint32 *hits)
+{
+	int i, n, words;
+
+	words = (b->count + 31) / 32;
+
+	memset(hits, 0, a->count * words * sizeof(Uint32));
+
+	n = 0;
+
+	for (i = 0 ; i < a->count && b->count > 0 ; i++)
+	{
+		n += collide(b, 0, a->x[i], a->y[i], a->w[i], a->h[i], &hits[i * words]);
+	}
+
+	return n;
+}
+
+// Sweep a moving box against a box.
+// The box at (x, y) moves by (dx, dy) during the tick. Return the fraction of the
+// move when the boxes start to overlap, and set 'exit' to the fraction when they
+// stop to, both clamped to the tick. Return -1 when they don't overlap during the tick.
+float sweepBox(float x, float y, float w, float h, float dx, float dy, float bx, float by, float bw, float bh, float *exit)
+{
+	float enter, leave, t1, t2;
+
+	enter = 0;
+	leave = 1;
+
+	// Time interval where the boxes overlap on the horizontal axis
+	if (dx == 0)
+	{
+		if (!(bx < x + w && x < bx + bw))
+		{
+			return -1;
+		}
+	}
+	else
+	{
+		t1 = (bx - x - w) / dx;
+		t2 = (bx + bw - x) / dx;
+
+		enter = MAX(enter, MIN(t1, t2));
+		leave = MIN(leave, MAX(t1, t2));
+	}
+
+	// And on the vertical axis
+	if (dy == 0)
+	{
+		if (!(by < y + h && y < by + bh))
+		{
+			return -1;
+		}
+	}
+	else
+	{
+		t1 = (by - y - h) / dy;
+		t2 = (by + bh - y) / dy;
+
+		enter = MAX(enter, MIN(t1, t2));
+		leave = MIN(leave, MAX(t1, t2));
+	}
+
+	if (enter >= leave)
+	{
+		return -1;
+	}
+
+	*exit = leave;
+
+	return enter;
+}
+
+static int collideScalar(Boxes *boxes, int start, float x, float y, float w, float h, Uint32 *hits)
+{
+	int i, n;
+
+	n = 0;
+
+	// The four tests are combined without branch, hits are rare
+	for (i = start ; i < boxes->count ; i++)
+	{
+		if ((boxes->x[i] < x + w) & (x < boxes->x[i] + boxes->w[i])
+		    & (boxes->y[i] < y + h) & (y < boxes->y[i] + boxes->h[i]))
+		{
+			if (hits == NULL)
+			{
+				return i;
+			}
+
+			hits[i / 32] |= 1u << (i % 32);
+			n++;
+		}
+	}
+
+	return (hits == NULL) ? -1 : n;
+}
+
+#ifdef __SSE2__
+// Test 4 boxes at once, the compare masks give 4 bits of the bitmask.
+// The bitmask is only filled from the start, so 4 bits never cross a word.
+static int collideSSE2(Boxes *boxes, int start, float x, float y, float w, float h, Uint32 *hits)
+{
+	__m128 left, top, right, bottom, bx, by, m;
+	int i, n, bits;
+
+	left = _mm_set1_ps(x);
+	top = _mm_set1_ps(y);
+	right = _mm_set1_ps(x + w);
+	bottom = _mm_set1_ps(y + h);
+
+	n = 0;
+
+	for (i = start ; i + 4 <= boxes->count ; i += 4)
+	{
+		bx = _mm_loadu_ps(&boxes->x[i]);
+		by = _mm_loadu_ps(&boxes->y[i]);
+
+		m = _mm_and_ps(_mm_cmplt_ps(bx, right), _mm_cmplt_ps(left, _mm_add_ps(bx, _mm_loadu_ps(&boxes->w[i]))));
+		m = _mm_and_ps(m, _mm_cmplt_ps(by, bottom));
+		m = _mm_and_ps(m, _mm_cmplt_ps(top, _mm_add_ps(by, _mm_loadu_ps(&boxes->h[i]))));
+
+		bits = _mm_movemask_ps(m);
+
+		if (bits == 0)
+		{
+			continue;
+		}
+
+		if (hits == NULL)
+		{
+			return i + __builtin_ctz(bits);
+		}
+
+		hits[i / 32] |= (Uint32)bits << (i % 32);
+		n += __builtin_popcount(bits);
+	}
+
+	return (hits == NULL) ? collideScalar(boxes, i, x, y, w, h, NULL) : n + collideScalar(boxes, i, x, y, w, h, hits);
+}
+#endif
+
+#ifdef BOXES_AVX2
+// Test 8 boxes at once, like the SSE2 kernel.
+__attribute__((target("avx2")))
+static int collideAVX2(Boxes *boxes, int start, float x, float y, float w, float h, Uint32 *hits)
+{
+	__m256 left, top, right, bottom, bx, by, m;
+	int i, n, bits;
+
+	left = _mm256_set1_ps(x);
+	top = _mm256_set1_ps(y);
+	right = _mm256_set1_ps(x + w);
+	bottom = _mm256_set1_ps(y + h);
+
+	n = 0;
+
+	for (i = start ; i + 8 <= boxes->count ; i += 8)
+	{
+		bx = _mm256_loadu_ps(&boxes->x[i]);
+		by = _mm256_loadu_ps(&boxes->y[i]);
+
+		m = _mm256_and_ps(_mm256_cmp_ps(bx, right, _CMP_LT_OQ), _mm256_cmp_ps(left, _mm256_add_ps(bx, _mm256_loadu_ps(&boxes->w[i])), _CMP_LT_OQ));
+		m = _mm256_and_ps(m, _mm256_cmp_ps(by, bottom, _CMP_LT_OQ));
+		m = _mm256_and_ps(m, _mm256_cmp_ps(top, _mm256_add_ps(by, _mm256_loadu_ps(&boxes->h[i])), _CMP_LT_OQ));
+
+		bits = _mm256_movemask_ps(m);
+
+		if (bits == 0)
+		{
+			continue;
+		}
+
+		if (hits == NULL)
+		{
+			_mm256_zeroupper();
+			return i + __builtin_ctz(bits);
+		}
+
+		hits[i / 32] |= (Uint32)bits << (i % 32);
+		n += __builtin_popcount(bits);
+	}
+
+	_mm256_zeroupper();
+
+	return (hits == NULL) ? collideScalar(boxes, i, x, y, w, h, NULL) : n + collideScalar(boxes, i, x, y, w, h, hits);
+}
+#endif
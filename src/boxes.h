@@ -0,0 +1,30 @@
+/*
+    Copyright (C) 2021 Vincent Radé
+    Copyright (C) 2015-2018 Parallel Realities
+
+    Nature Invaders is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Nature Invaders is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Nature Invaders. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include "common.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// AVX2 kernels are built for x86 with GCC target attributes and selected at runtime
+#if defined(__SSE2__) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BOXES_AVX2
+#include <immintrin.h>
+#endif
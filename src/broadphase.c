@@ -0,0 +1,458 @@
+/*
+    Copyright (C) 2021 Vincent Radé
+    Copyright (C) 2015-2018 Parallel Realities
+
+    Nature Invaders is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Nature Invaders is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Nature Invaders. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include "broadphase.h"
+
+static float getLeft(Collider *c);
+static void sortAdded(int n);
+static void sortColliders(void);
+static void updateActive(int k, float left);
+
+// Colliders, indexed by their id, and their ids sorted by the left of their bounds.
+// The order is kept from a tick to the next, where the colliders only moved a
+// little, so the insertion sort has almost nothing to move.
+static Collider *colliders;
+static int *order;
+static int *added;
+static Uint32 *addedKeys;
+static int *sortIds;
+static Uint32 *sortKeys;
+static int numColliders;
+static int numOrder;
+static int numAdded;
+static int first;
+static int capacity;
+static int freeColliders;
+static int removedColliders;
+
+// Bounds, layers and masks of the colliders in the sorted order
+static float *sortedLeft;
+static float *sortedTop;
+static float *sortedWidth;
+static float *sortedHeight;
+static int *sortedLayers;
+static int *sortedMasks;
+
+// Colliders of each layer which may overlap the next ones during the sweep, as
+// indexes in the sorted order. The ones tested are packed as boxes, tested at once
+// by the kernels of the boxes module. The colliders swept since the last test are
+// only packed when they don't end before the sweep, and the packed ones are only
+// pruned once they have doubled since the last pruning, the kernels rejecting them.
+static int *active[MAX_COLLIDE_LAYERS];
+static int numActive[MAX_COLLIDE_LAYERS];
+static Boxes activeBoxes[MAX_COLLIDE_LAYERS];
+static int pruneCount[MAX_COLLIDE_LAYERS];
+
+// Add a collider to the broadphase, and return its id, which is never 0.
+// 'layer' is the single COLLIDE_ bit of the collider, and 'mask' the bits of the layers
+// it collides with. The collider doesn't collide until it is moved.
+int addCollider(int layer, int mask, int owner)
+{
+	Collider *c;
+	int i, id;
+
+	if (freeColliders != 0)
+	{
+		id = freeColliders;
+		freeColliders = colliders[id].next;
+	}
+	else
+	{
+		if (numColliders + 1 >= capacity)
+		{
+			capacity = MAX(capacity * 2, 256);
+			colliders = realloc(colliders, capacity * sizeof(Collider));
+			order = realloc(order, capacity * sizeof(int));
+			added = realloc(added, capacity * sizeof(int));
+			addedKeys = realloc(addedKeys, capacity * sizeof(Uint32));
+			sortIds = realloc(sortIds, capacity * sizeof(int));
+			sortKeys = realloc(sortKeys, capacity * sizeof(Uint32));
+			sortedLeft = realloc(sortedLeft, capacity * sizeof(float));
+			sortedTop = realloc(sortedTop, capacity * sizeof(float));
+			sortedWidth = realloc(sortedWidth, capacity * sizeof(float));
+			sortedHeight = realloc(sortedHeight, capacity * sizeof(float));
+			sortedLayers = realloc(sortedLayers, capacity * sizeof(int));
+			sortedMasks = realloc(sortedMasks, capacity * sizeof(int));
+
+			for (i = 0 ; i < MAX_COLLIDE_LAYERS ; i++)
+			{
+				active[i] = realloc(active[i], capacity * sizeof(int));
+			}
+		}
+
+		// The id 0 is never used, so a zeroed entity has no collider
+		id = ++numColliders;
+	}
+
+	c = &colliders[id];
+	memset(c, 0, sizeof(Collider));
+	c->layer = layer;
+	c->mask = mask;
+	c->owner = owner;
+	c->w = -1;
+
+	// New colliders are sorted apart, then merged with the others on the next sweep
+	added[numAdded++] = id;
+
+	return id;
+}
+
+// Set the bounds of a collider for this tick.
+void moveCollider(int id, float x, float y, float w, float h)
+{
+	colliders[id].x = x;
+	colliders[id].y = y;
+	colliders[id].w = w;
+	colliders[id].h = h;
+}
+
+// Get a collider from its id.
+Collider *getCollider(int id)
+{
+	return &colliders[id];
+}
+
+// Remove a collider. It leaves the order on the next sweep, and its id is
+// only reused after that, so the order never holds an id twice.
+void removeCollider(int id)
+{
+	colliders[id].layer = 0;
+	colliders[id].mask = 0;
+	colliders[id].owner = 0;
+	colliders[id].next = removedColliders;
+	removedColliders = id;
+}
+
+// Remove every collider.
+void clearColliders(void)
+{
+	numColliders = 0;
+	numOrder = 0;
+	numAdded = 0;
+	freeColliders = 0;
+	removedColliders = 0;
+}
+
+// Find the pairs of colliders whose bounds overlap, and whose layers collide.
+// Sort the colliders by their left, then sweep them from left to right. Every
+// layer has the list of the colliders already swept, which may still overlap the
+// next ones. A collider is only tested against the lists of the layers it collides
+// with, several boxes at once, and the boxes hit are taken in the list order.
+// So bullets which don't collide with each other are never compared. Layers are
+// single bits. Each pair is given once to 'pair', the collider of the lowest layer first.
+// Return the number of pairs.
+int findColliderPairs(void (*pair)(Collider *a, Collider *b, void *data), void *data)
+{
+	Collider *a, *b;
+	int masks[MAX_COLLIDE_LAYERS], interests[MAX_COLLIDE_LAYERS];
+	int i, j, k, h, l, n, layers;
+
+	sortColliders();
+
+	// Layers to compare each layer with, in both directions
+	memset(masks, 0, sizeof(masks));
+
+	for (i = first ; i < numOrder ; i++)
+	{
+		masks[__builtin_ctz(sortedLayers[i])] |= sortedMasks[i];
+	}
+
+	for (l = 0 ; l < MAX_COLLIDE_LAYERS ; l++)
+	{
+		interests[l] = masks[l];
+
+		for (k = 0 ; k < MAX_COLLIDE_LAYERS ; k++)
+		{
+			if (masks[k] & (1 << l))
+			{
+				interests[l] |= 1 << k;
+			}
+		}
+
+		numActive[l] = 0;
+		activeBoxes[l].count = 0;
+		pruneCount[l] = PRUNE_ACTIVE;
+	}
+
+	n = 0;
+
+	for (i = first ; i < numOrder ; i++)
+	{
+		l = __builtin_ctz(sortedLayers[i]);
+
+		for (k = 0, layers = interests[l] ; layers != 0 ; k++, layers >>= 1)
+		{
+			if (!(layers & 1) || numActive[k] == 0)
+			{
+				continue;
+			}
+
+			updateActive(k, sortedLeft[i]);
+
+			// Hits are rare, the boxes are tested from the last one hit until none is left
+			for (h = findCollision(&activeBoxes[k], 0, sortedLeft[i], sortedTop[i], sortedWidth[i], sortedHeight[i]) ; h >= 0 ;
+			     h = findCollision(&activeBoxes[k], h + 1, sortedLeft[i], sortedTop[i], sortedWidth[i], sortedHeight[i]))
+			{
+				j = active[k][h];
+
+				if (!((sortedLayers[i] & sortedMasks[j]) || (sortedLayers[j] & sortedMasks[i])))
+				{
+					continue;
+				}
+
+				a = &colliders[order[j]];
+				b = &colliders[order[i]];
+
+				if (a->layer <= b->layer)
+				{
+					pair(a, b, data);
+				}
+				else
+				{
+					pair(b, a, data);
+				}
+
+				n++;
+			}
+		}
+
+		active[l][numActive[l]++] = i;
+	}
+
+	return n;
+}
+
+// Pack the colliders swept since the last test of an active list, and prune the
+// list when it has doubled since its last pruning. The colliders ending before
+// 'left' are dropped, they end before the next colliders of the sweep too. The list
+// keeps its order.
+static void updateActive(int k, float left)
+{
+	Boxes *boxes;
+	int i, j, m;
+
+	boxes = &activeBoxes[k];
+
+	for (i = boxes->count, m = boxes->count ; i < numActive[k] ; i++)
+	{
+		j = active[k][i];
+
+		if (sortedLeft[j] + sortedWidth[j] > left)
+		{
+			active[k][m++] = j;
+			addBox(boxes, sortedLeft[j], sortedTop[j], sortedWidth[j], sortedHeight[j]);
+		}
+	}
+
+	numActive[k] = m;
+
+	if (boxes->count < pruneCount[k])
+	{
+		return;
+	}
+
+	for (i = 0, m = 0 ; i < boxes->count ; i++)
+	{
+		if (boxes->x[i] + boxes->w[i] > left)
+		{
+			boxes->x[m] = boxes->x[i];
+			boxes->y[m] = boxes->y[i];
+			boxes->w[m] = boxes->w[i];
+			boxes->h[m] = boxes->h[i];
+			active[k][m++] = active[k][i];
+		}
+	}
+
+	numActive[k] = m;
+	boxes->count = m;
+	pruneCount[k] = MAX(m * 2, PRUNE_ACTIVE);
+}
+
+// Sort the colliders by their left.
+// Drop the removed colliders from the order, sort the order of the last tick by
+// insertion, which is linear when the colliders only moved a little, then merge
+// the colliders added since, sorted apart. Colliders never moved are kept first,
+// with no bounds. Then pack the bounds in the sorted order for the sweep.
+static void sortColliders(void)
+{
+	Collider *c;
+	float x;
+	int i, j, k, n, id;
+
+	n = 0;
+
+	for (i = 0 ; i < numOrder ; i++)
+	{
+		if (colliders[order[i]].owner != 0)
+		{
+			order[n++] = order[i];
+		}
+	}
+
+	numOrder = n;
+
+	while (removedColliders != 0)
+	{
+		id = removedColliders;
+		removedColliders = colliders[id].next;
+		colliders[id].next = freeColliders;
+		freeColliders = id;
+	}
+
+	for (i = 0 ; i < numOrder ; i++)
+	{
+		sortedLeft[i] = getLeft(&colliders[order[i]]);
+	}
+
+	for (i = 1 ; i < numOrder ; i++)
+	{
+		id = order[i];
+		x = sortedLeft[i];
+
+		for (j = i - 1 ; j >= 0 && sortedLeft[j] > x ; j--)
+		{
+			order[j + 1] = order[j];
+			sortedLeft[j + 1] = sortedLeft[j];
+		}
+
+		order[j + 1] = id;
+		sortedLeft[j + 1] = x;
+	}
+
+	// Merge the added colliders, from the end
+	n = 0;
+
+	for (i = 0 ; i < numAdded ; i++)
+	{
+		if (colliders[added[i]].owner != 0)
+		{
+			added[n++] = added[i];
+		}
+	}
+
+	sortAdded(n);
+
+	i = numOrder - 1;
+	j = n - 1;
+
+	for (k = numOrder + n - 1 ; j >= 0 ; k--)
+	{
+		x = getLeft(&colliders[added[j]]);
+
+		if (i >= 0 && sortedLeft[i] > x)
+		{
+			order[k] = order[i];
+			sortedLeft[k] = sortedLeft[i--];
+		}
+		else
+		{
+			order[k] = added[j--];
+			sortedLeft[k] = x;
+		}
+	}
+
+	numOrder += n;
+	numAdded = 0;
+
+	// Pack the bounds, and skip the colliders without bounds
+	first = numOrder;
+
+	for (i = numOrder - 1 ; i >= 0 ; i--)
+	{
+		c = &colliders[order[i]];
+
+		if (c->w < 0)
+		{
+			break;
+		}
+
+		sortedTop[i] = c->y;
+		sortedWidth[i] = c->w;
+		sortedHeight[i] = c->h;
+		sortedLayers[i] = c->layer;
+		sortedMasks[i] = c->mask;
+
+		first = i;
+	}
+}
+
+// Left of a collider for the sort, colliders without bounds first.
+static float getLeft(Collider *c)
+{
+	return (c->w < 0) ? -FLT_MAX : c->x;
+}
+
+// Sort the added colliders by their left, with a radix sort of the bits of the
+// floats. A restored snapshot adds all its colliders at once, and sorting them
+// with qsort took a third of a rollback on the stress stage.
+static void sortAdded(int n)
+{
+	int count[256];
+	Uint32 *keys, *nextKeys, *swapKeys;
+	int *ids, *nextIds, *swapIds;
+	Uint32 u;
+	float x;
+	int i, b, total, shift;
+
+	for (i = 0 ; i < n ; i++)
+	{
+		x = getLeft(&colliders[added[i]]);
+		memcpy(&u, &x, 4);
+
+		// The negative floats sort the other way, so all their bits are flipped
+		addedKeys[i] = (u & 0x80000000) ? ~u : u | 0x80000000;
+	}
+
+	keys = addedKeys;
+	ids = added;
+	nextKeys = sortKeys;
+	nextIds = sortIds;
+
+	// An even number of passes, so the result ends in the added colliders
+	for (shift = 0 ; shift < 32 ; shift += 8)
+	{
+		memset(count, 0, sizeof(count));
+
+		for (i = 0 ; i < n ; i++)
+		{
+			count[(keys[i] >> shift) & 0xFF]++;
+		}
+
+		for (b = 0, total = 0 ; b < 256 ; b++)
+		{
+			total += count[b];
+			count[b] = total - count[b];
+		}
+
+		for (i = 0 ; i < n ; i++)
+		{
+			b = count[(keys[i] >> shift) & 0xFF]++;
+			nextKeys[b] = keys[i];
+			nextIds[b] = ids[i];
+		}
+
+		swapKeys = keys;
+		keys = nextKeys;
+		nextKeys = swapKeys;
+
+		swapIds = ids;
+		ids = nextIds;
+		nextIds = swapIds;
+	}
+}
@@ -30,27 +30,203 @@
 
 #define FPS 60
 
+#define BACKGROUND_TILE_HEIGHT 128
+#define MAX_BACKGROUND_SLOTS   16
+
+// Most frames between two background steps on attract screens, see -attractscroll
+#define MAX_ATTRACT_SCROLL_RATE 8
+
+#define QUALITY_LEVELS  5
+#define QUALITY_WINDOW  30           // Frames averaged by the quality governor
+#define QUALITY_HOLD    FPS          // Frames to wait after a quality change
+#define QUALITY_RECOVER (FPS * 3)    // Frames under budget before raising the quality
+#define QUALITY_OVER    0.9          // Fraction of the frame budget which lowers the quality
+#define QUALITY_UNDER   0.5          // Fraction of the frame budget which raises the quality
+
 #define PLAYER_SPEED        4
 #define PLAYER_BULLET_SPEED 5
 #define ENEMY_BULLET_SPEED  5
 
 #define MAX_KEYBOARD_KEYS  350
 
+// Players of a co-op game, and the bits of their inputs for a tick
+#define MAX_PLAYERS 2
+#define INPUT_LEFT  1
+#define INPUT_RIGHT 2
+#define INPUT_FIRE  4
+
+// Default size of the enemy formation, which can be changed on the command line
 #define ENEMY_ROW 5
 #define ENEMY_COL 11
+#define MAX_FORMATION_ROWS 50
+#define MAX_FORMATION_COLS 100
+
+// Area the formation is fitted in, enemies are shrunk in larger formations
+#define FORMATION_WIDTH  600
+#define FORMATION_HEIGHT 300
 
 #define MAX_ENEMY_STEP 5
 
 #define HORIZONTAL_POSITION  50
 #define VERTICAL_POSITION    200
 
-#define SIDE_PLAYER 0
-#define SIDE_ENEMY  1
+// Components of the world entities
+#define COMPONENT_POSITION 1
+#define COMPONENT_VELOCITY 2
+#define COMPONENT_SPRITE   4
+#define COMPONENT_HEALTH   8
+#define COMPONENT_WEAPON   16
+#define COMPONENT_SCORE    32
+#define COMPONENT_COLLIDER 64
+
+// An entity id holds its index in the low bits, and the generation of the index above
+#define ENTITY_INDEX_BITS     20
+#define MAX_ENTITY_GENERATION 2047
+#define ENTITY_INDEX(id)      ((id) & ((1 << ENTITY_INDEX_BITS) - 1))
+
+// Positions and velocities of the entities are 16 bits fixed point numbers.
+// Positions are in 1/16 of a pixel, from -2048 to 2048 pixels. Velocities are in
+// 1/4096 of a pixel per tick, from -8 to 8 pixels, and the moves keep the bits of
+// the velocity below the position in a fraction byte on each axis, so a rounded
+// velocity drifts by half a velocity step per tick, not by half a position step.
+// Built with FLOAT_POSITIONS, they are floats in pixels as before, to compare the
+// stage with the float one, and the fractions stay 0.
+// FIXED_WORD and VELOCITY_WORD give the 16 bits in fixed point in both builds.
+#define FIXED_BITS    4
+#define VELOCITY_BITS 12
+#define FRACTION_BITS (VELOCITY_BITS - FIXED_BITS)
+
+#ifdef FLOAT_POSITIONS
+#define FIXED_ONE           1
+#define TO_FIXED(v)         ((float)(v))
+#define FROM_FIXED(v)       ((float)(v))
+#define TO_VELOCITY(v)      ((float)(v))
+#define FROM_VELOCITY(v)    ((float)(v))
+#define FROM_PRECISE(v, f)  ((float)(v))
+#define FIXED_WORD(v)       ((Uint16)lrintf((v) * (1 << FIXED_BITS)))
+#define VELOCITY_WORD(v)    ((Uint16)lrintf((v) * (1 << VELOCITY_BITS)))
+#else
+#define FIXED_ONE           (1 << FIXED_BITS)
+#define TO_FIXED(v)         ((Sint16)lrintf((v) * FIXED_ONE))
+#define FROM_FIXED(v)       ((float)(v) / FIXED_ONE)
+#define TO_VELOCITY(v)      ((Sint16)lrintf((v) * (1 << VELOCITY_BITS)))
+#define FROM_VELOCITY(v)    ((float)(v) / (1 << VELOCITY_BITS))
+#define FROM_PRECISE(v, f)  ((float)((v) * (1 << FRACTION_BITS) + (f)) / (1 << VELOCITY_BITS))
+#define FIXED_WORD(v)       ((Uint16)(v))
+#define VELOCITY_WORD(v)    ((Uint16)(v))
+#endif
+
+// Collision layers of the broadphase colliders
+#define COLLIDE_PLAYER        1
+#define COLLIDE_ENEMY         2
+#define COLLIDE_PLAYER_BULLET 4
+#define COLLIDE_ENEMY_BULLET  8
+#define COLLIDE_SHIELD        16
+#define COLLIDE_BULLETS       (COLLIDE_PLAYER_BULLET | COLLIDE_ENEMY_BULLET)
+#define MAX_COLLIDE_LAYERS    8
+
+// Fewest colliders of an active list of the broadphase sweep before it is pruned
+#define PRUNE_ACTIVE          64
+
+#define NUM_SHIELDS       4
+#define SHIELD_ROWS       6
+#define SHIELD_COLS       8
+#define SHIELD_BLOCK_SIZE 8
+#define SHIELD_Y          700
+#define MAX_SHIELD_BLOCKS (NUM_SHIELDS * SHIELD_ROWS * SHIELD_COLS)
+
+// Stress stage: every enemy fires a fan of bullets
+#define STRESS_SPREAD    16          // Bullets of a fan
+#define STRESS_ANGLE     60          // Half angle of a fan, in degrees
+#define STRESS_RELOAD    4           // Frames between the fans of an enemy
+#define STRESS_POOL_SIZE 32768
+#define STRESS_BULLETS   20000       // Bullets from which the frames are summed up
 
 #define MAX_SND_CHANNELS 8
 
+#define MIXER_FREQUENCY 44100
+#define MIXER_CHANNELS  2
+#define MIXER_SAMPLES   1024
+
+#define MIN_MIXER_SAMPLES 128
+#define MAX_MIXER_SAMPLES 4096
+#define MAX_VOICES        16
+#define MIXER_RING_SIZE   64
+#define MIXER_GAIN_SHIFT  14
+#define MAX_SOUND_BOOST   2
+
+#define PACK_FILENAME         "natureinvader.pak"
+#define PACK_MAGIC            "NIPK"
+#define PACK_VERSION          1
+#define PACK_ALIGN            64
+#define MAX_PACK_NAME_LENGTH  64
+
+#define ENTITY_POOL_SIZE    384
+#define DEBRIS_POOL_SIZE    256
+
+#define MASK_ALPHA 128
+
+#define MAX_PARTICLES  8192
+#define PARTICLE_LANES 4
+
+#define MAX_LOADS          32
+#define MAX_LOADER_THREADS 8
+
 #define NUM_HIGHSCORES 8
 
+#define RANDOM_SEED 0x2545F491
+
+// Snapshots of version 3 hold the positions as floats, the later ones in fixed point
+#define SNAPSHOT_MAGIC         "NISS"
+#define SNAPSHOT_FLOAT_VERSION 3
+#define SNAPSHOT_FIXED_VERSION 4
+
+#ifdef FLOAT_POSITIONS
+#define SNAPSHOT_VERSION       SNAPSHOT_FLOAT_VERSION
+#else
+#define SNAPSHOT_VERSION       SNAPSHOT_FIXED_VERSION
+#endif
+
+// Textures of the stage, saved as their index in snapshots
+#define MAX_STAGE_TEXTURES 8
+
+// Parts of the state hashed every frame, to find where a replay diverges
+#define HASH_PLAYER    0
+#define HASH_FORMATION 1
+#define HASH_BULLETS   2
+#define HASH_SHIELDS   3
+#define HASH_STAGE     4
+#define HASH_RANDOM    5
+#define NUM_HASHES     6
+
+#define REPLAY_MAGIC   "NIRP"
+#define REPLAY_VERSION 2
+
+// Largest difference, on each axis, between the position of an entity in the fixed
+// point stage and in the float one, checked by tools/replaycmp: one position step.
+// A velocity is rounded by half a velocity step at most, and the fraction carries
+// the rest of each move, so a stress bullet, which crosses the screen in less than
+// 250 ticks at 5 pixels per tick, drifts by 250 / 8192 of a pixel at most. The
+// rounding of the float positions adds less than 0.01 of a pixel over that time.
+#define REPLAY_TOLERANCE (1.0f / (1 << FIXED_BITS))
+
+// Network co-op. The remote inputs are predicted, and the stage is rolled back
+// to a snapshot and simulated again when they are late.
+#define NET_MAGIC             "NINP"
+#define NET_MAX_ROLLBACK      8      // Frames simulated ahead of the remote inputs before waiting
+#define NET_ROLLBACK_BUDGET   16.7   // Milliseconds a rollback may take in a frame, one frame at 60 fps
+#define NET_TICK_AVERAGE      8      // Frames averaged to estimate the time to simulate one
+#define NET_SNAPSHOTS         (NET_MAX_ROLLBACK + 1)
+#define NET_INPUT_RING        128    // Inputs kept, indexed by frame
+#define NET_MAX_PACKET_INPUTS 32     // Inputs sent again in a packet until they are acknowledged
+#define NET_MAX_PACKET        64
+#define NET_QUEUE_SIZE        1024   // Packets delayed by the artificial latency
+#define NET_MAX_TICKS         2      // Ticks per frame to catch up with the remote side
+#define NET_TIMEOUT           30000  // Milliseconds to wait for the other player
+#define NET_HELLO             1      // Packet of a player joining the game
+#define NET_WELCOME           2      // Packet of the host, with the settings of the game
+#define NET_INPUTS            3      // Packet of the inputs not acknowledged yet
+
 #define GLYPH_HEIGHT 28
 #define GLYPH_WIDTH  18
 
@@ -84,3 +260,38 @@ enum
 	TEXT_CENTER,
 	TEXT_RIGHT
 };
+
+enum
+{
+	PACK_IMAGE,
+	PACK_SOUND,
+	PACK_MUSIC
+};
+
+enum
+{
+	MIXER_PLAY,
+	MIXER_STOP
+};
+
+enum
+{
+	LOAD_TEXTURE,
+	LOAD_SOUND
+};
+
+enum
+{
+	LOAD_QUEUED,
+	LOAD_DECODED,
+	LOAD_READY,
+	LOAD_FAILED
+};
+
+enum
+{
+	BLEND_NONE,
+	BLEND_ALPHA,
+	BLEND_ADD,
+	BLEND_PREMULTIPLIED
+};
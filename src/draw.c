@@ -19,17 +19,109 @@
 
 #include "draw.h"
 
+static Texture *addTextureToCache(char *name, SDL_Texture *sdlTexture);
+static int scale(int v);
+static void scaleRect(SDL_Rect *src, SDL_Rect *dest);
+static void setRenderTarget(SDL_Texture *texture);
+static void softwareCopy(SDL_Texture *texture, SDL_Rect *src, int x, int y);
+static SDL_Surface *stretchSurface(SDL_Surface *image, int w, int h);
+
+static SDL_BlendMode layerBlendMode;
+static int missingSurface;
+static int originX;
+static int originY;
+
+// Initialize the scene.
+// When the internal resolution is lower than the window one, create the offscreen
+// target where the scene is composed before it is upscaled to the window.
+// The quality governor may compose the scene in a part of it only.
+void initScene(void)
+{
+	if (app.scene != NULL || app.software || (app.renderScale >= 1 && app.sceneScale >= 1))
+	{
+		return;
+	}
+
+	app.scene = SDL_CreateTexture(app.renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, scale(SCREEN_WIDTH), scale(SCREEN_HEIGHT));
+
+	if (!app.scene)
+	{
+		printf("Failed to create %d x %d scene: %s\n", scale(SCREEN_WIDTH), scale(SCREEN_HEIGHT), SDL_GetError());
+		exit(1);
+	}
+
+	SDL_SetTextureScaleMode(app.scene, app.sceneFilter);
+}
+
 void prepareScene(void)
 {
+	if (app.software)
+	{
+		fillFramebuffer(NULL, 32, 32, 32, 255);
+		return;
+	}
+
+	setRenderTarget(NULL);
+
 	SDL_SetRenderDrawColor(app.renderer, 32, 32, 32, 255);
 	SDL_RenderClear(app.renderer);
 }
 
+// Present the scene.
+// Upscale the scene to the window when it is composed at a lower resolution,
+// from the part of the scene used at the current quality level.
+// The software framebuffer stays in memory, there is no window to update.
 void presentScene(void)
 {
+	SDL_Rect r;
+
+	if (app.software)
+	{
+		return;
+	}
+
+	if (app.scene)
+	{
+		r.x = 0;
+		r.y = 0;
+		r.w = scale(SCREEN_WIDTH) * app.sceneScale;
+		r.h = scale(SCREEN_HEIGHT) * app.sceneScale;
+
+		SDL_SetRenderTarget(app.renderer, NULL);
+		SDL_RenderSetScale(app.renderer, 1, 1);
+		SDL_RenderCopy(app.renderer, app.scene, &r, NULL);
+	}
+
 	SDL_RenderPresent(app.renderer);
 }
 
+// Redirect the drawing to a texture, or to the scene when it is NULL.
+// SDL resets the render scale with the target, so it is set again.
+// Layers keep the internal resolution whatever the quality level.
+static void setRenderTarget(SDL_Texture *texture)
+{
+	float s;
+
+	s = (texture != NULL) ? app.renderScale : app.renderScale * app.sceneScale;
+
+	SDL_SetRenderTarget(app.renderer, (texture != NULL) ? texture : app.scene);
+	SDL_RenderSetScale(app.renderer, s, s);
+}
+
+// Scale a screen coordinate or size to the internal resolution.
+static int scale(int v)
+{
+	return (int)floorf(v * app.renderScale + 0.5f);
+}
+
+static void scaleRect(SDL_Rect *src, SDL_Rect *dest)
+{
+	dest->x = scale(src->x);
+	dest->y = scale(src->y);
+	dest->w = scale(src->w);
+	dest->h = scale(src->h);
+}
+
 static SDL_Texture *getTexture(char *name)
 {
 	Texture *t;
@@ -48,7 +140,7 @@ static SDL_Texture *getTexture(char *name)
 	return NULL;
 }
 
-static void addTextureToCache(char *name, SDL_Texture *sdlTexture)
+static Texture *addTextureToCache(char *name, SDL_Texture *sdlTexture)
 {
 	Texture *texture;
 
@@ -62,11 +154,145 @@ static void addTextureToCache(char *name, SDL_Texture *sdlTexture)
 
 	STRNCPY(texture->name, name, MAX_NAME_LENGTH);
 	texture->texture = sdlTexture;
+
+	SDL_SetTextureUserData(sdlTexture, texture);
+
+	return texture;
+}
+
+// Get the size of a texture in screen coordinates,
+// which does not depend on the internal resolution.
+void getTextureSize(SDL_Texture *texture, int *w, int *h)
+{
+	Texture *t;
+
+	t = SDL_GetTextureUserData(texture);
+
+	if (t != NULL)
+	{
+		*w = t->w;
+		*h = t->h;
+	}
+	else
+	{
+		SDL_QueryTexture(texture, NULL, NULL, w, h);
+	}
+}
+
+// Get the collision mask of a texture, NULL when it has none.
+Mask *getTextureMask(SDL_Texture *texture)
+{
+	Texture *t;
+
+	t = SDL_GetTextureUserData(texture);
+
+	return (t != NULL) ? t->mask : NULL;
+}
+
+// Decode an image.
+// Use the ARGB8888 pixels mapped from the asset pack without copy, or decode the image file.
+// Create the collision mask from the full size image, when 'mask' is given.
+// Downscale the image to the internal resolution once, so sprites are drawn
+// without scaling. The renderer is not used, so images can be decoded on any thread.
+SDL_Surface *decodeImage(char *filename, int *w, int *h, int *opaque, Mask **mask)
+{
+	SDL_Surface *image, *surface;
+	PackEntry *entry;
+	Uint32 *pixels;
+	int i;
+
+	entry = findPackEntry(filename, PACK_IMAGE);
+
+	if (entry != NULL)
+	{
+		surface = SDL_CreateRGBSurfaceWithFormatFrom(getPackData(entry), entry->w, entry->h, 32, entry->w * 4, SDL_PIXELFORMAT_ARGB8888);
+		*opaque = entry->opaque;
+	}
+	else
+	{
+		image = IMG_Load(filename);
+
+		if (image == NULL)
+		{
+			return NULL;
+		}
+
+		surface = SDL_ConvertSurfaceFormat(image, SDL_PIXELFORMAT_ARGB8888, 0);
+		SDL_FreeSurface(image);
+
+		*opaque = TRUE;
+		pixels = surface->pixels;
+
+		for (i = 0 ; i < surface->w * surface->h && *opaque ; i++)
+		{
+			*opaque = (pixels[i] >> 24) == SDL_ALPHA_OPAQUE;
+		}
+	}
+
+	*w = surface->w;
+	*h = surface->h;
+
+	if (mask != NULL)
+	{
+		*mask = createMask(surface);
+	}
+
+	if (app.renderScale < 1)
+	{
+		surface = stretchSurface(surface, MAX(1, scale(*w)), MAX(1, scale(*h)));
+	}
+
+	return surface;
+}
+
+// Stretch an image to a new size, and free it.
+static SDL_Surface *stretchSurface(SDL_Surface *image, int w, int h)
+{
+	SDL_Surface *surface;
+
+	surface = SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_ARGB8888);
+	SDL_SoftStretchLinear(image, NULL, surface, NULL);
+	SDL_FreeSurface(image);
+
+	return surface;
+}
+
+// Upload a decoded image to a texture, and add it to the cache.
+// For the software framebuffer, keep the pixels in the cache next to the texture.
+// Opaque images are copied without blending. Must be called on the render thread.
+SDL_Texture *uploadTexture(char *filename, SDL_Surface *surface, int w, int h, int opaque, Mask *mask)
+{
+	SDL_Texture *texture;
+	Texture *t;
+
+	texture = SDL_CreateTexture(app.renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC, surface->w, surface->h);
+	SDL_UpdateTexture(texture, NULL, surface->pixels, surface->pitch);
+	SDL_SetTextureBlendMode(texture, opaque ? SDL_BLENDMODE_NONE : SDL_BLENDMODE_BLEND);
+
+	t = addTextureToCache(filename, texture);
+	t->w = w;
+	t->h = h;
+	t->opaque = opaque;
+	t->mask = mask;
+
+	if (!app.software)
+	{
+		SDL_FreeSurface(surface);
+		return texture;
+	}
+
+	t->surface = surface;
+
+	return texture;
 }
 
 SDL_Texture *loadTexture(char *filename)
 {
+	SDL_Surface *surface;
 	SDL_Texture *texture;
+	Texture *t;
+	Mask *mask;
+	int w, h, opaque;
 
 	texture = getTexture(filename);
 
@@ -76,39 +302,388 @@ SDL_Texture *loadTexture(char *filename)
 	if (texture == NULL)
 	{
 		SDL_LogMessage(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO, "Loading %s", filename);
+
+		if (app.software || app.renderScale < 1 || findPackEntry(filename, PACK_IMAGE) != NULL)
+		{
+			surface = decodeImage(filename, &w, &h, &opaque, &mask);
+
+			return (surface != NULL) ? uploadTexture(filename, surface, w, h, opaque, mask) : NULL;
+		}
+
 		texture = IMG_LoadTexture(app.renderer, filename);
-		addTextureToCache(filename, texture);
+		t = addTextureToCache(filename, texture);
+		SDL_QueryTexture(texture, NULL, NULL, &t->w, &t->h);
 	}
 
 	return texture;
 }
 
+// Load a texture resized to 'w' x 'h' screen coordinates.
+// The image is resized once, with its collision mask, and cached under its name
+// followed by its size. Used to fit large enemy formations on the screen.
+SDL_Texture *loadScaledTexture(char *filename, int w, int h)
+{
+	char name[MAX_NAME_LENGTH];
+	SDL_Surface *surface;
+	SDL_Texture *texture;
+	Mask *mask;
+	int imageW, imageH, opaque;
+
+	snprintf(name, MAX_NAME_LENGTH, "%s@%dx%d", filename, w, h);
+
+	texture = getTexture(name);
+
+	if (texture == NULL)
+	{
+		SDL_LogMessage(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO, "Loading %s", name);
+
+		surface = decodeImage(filename, &imageW, &imageH, &opaque, NULL);
+
+		if (surface == NULL)
+		{
+			return NULL;
+		}
+
+		surface = stretchSurface(surface, w, h);
+		mask = createMask(surface);
+
+		if (app.renderScale < 1)
+		{
+			surface = stretchSurface(surface, MAX(1, scale(w)), MAX(1, scale(h)));
+		}
+
+		texture = uploadTexture(name, surface, w, h, opaque, mask);
+	}
+
+	return texture;
+}
+
+// Copy a texture in the software framebuffer.
+// Use the color, alpha and blend modes set on the texture.
+static void softwareCopy(SDL_Texture *texture, SDL_Rect *src, int x, int y)
+{
+	SDL_BlendMode blendMode;
+	SDL_Rect s;
+	Uint8 r, g, b, a;
+	Texture *t;
+	int mode;
+
+	t = SDL_GetTextureUserData(texture);
+
+	// A texture which wasn't loaded through the texture cache has no pixels to copy
+	if (t == NULL || t->surface == NULL)
+	{
+		if (!missingSurface)
+		{
+			SDL_LogMessage(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_WARN, "Texture without software surface, not drawn");
+			missingSurface = TRUE;
+		}
+
+		return;
+	}
+
+	SDL_GetTextureColorMod(texture, &r, &g, &b);
+	SDL_GetTextureAlphaMod(texture, &a);
+	SDL_GetTextureBlendMode(texture, &blendMode);
+
+	switch (blendMode)
+	{
+	case SDL_BLENDMODE_NONE:
+		mode = BLEND_NONE;
+		break;
+	case SDL_BLENDMODE_ADD:
+		mode = BLEND_ADD;
+		break;
+	default:
+		mode = BLEND_ALPHA;
+		break;
+	}
+
+	// Draw after the pending SDL software renderer commands
+	SDL_RenderFlush(app.renderer);
+
+	if (src != NULL && app.renderScale < 1)
+	{
+		scaleRect(src, &s);
+		src = &s;
+	}
+
+	blitFramebuffer(t->surface, src, scale(x), scale(y), ((Uint32)a << 24) | (r << 16) | (g << 8) | b, mode, t->opaque);
+}
+
 void blit(SDL_Texture *texture, int x, int y)
 {
 	SDL_Rect dest;
 
         // Draw the texture
         // Draw the given texture on the screen according to the given positions x and y
-	dest.x = x;
-	dest.y = y;
-	SDL_QueryTexture(texture, NULL, NULL, &dest.w, &dest.h);
+	if (app.software)
+	{
+		softwareCopy(texture, NULL, x - originX, y - originY);
+		return;
+	}
+
+	dest.x = x - originX;
+	dest.y = y - originY;
+	getTextureSize(texture, &dest.w, &dest.h);
 	SDL_RenderCopy(app.renderer, texture, NULL, &dest);
 }
 
 void blitRect(SDL_Texture *texture, SDL_Rect *src, int x, int y)
 {
-	SDL_Rect dest;
+	SDL_Rect dest, s;
 
         // Draw a part of the texture
         // Draw a part of the given texture, define by its width and its height, 
         // on the screen according to the given positions x and y
-	dest.x = x;
-	dest.y = y;
+	if (app.software)
+	{
+		softwareCopy(texture, src, x - originX, y - originY);
+		return;
+	}
+
+	dest.x = x - originX;
+	dest.y = y - originY;
 	dest.w = src->w;
 	dest.h = src->h;
 
+        // The texture is downscaled to the internal resolution
+	if (app.renderScale < 1)
+	{
+		scaleRect(src, &s);
+		src = &s;
+	}
+
 	SDL_RenderCopy(app.renderer, texture, src, &dest);
 }
 
+// Draw a texture at many positions.
+// The sprites are given to the renderer as a single batch of quads, so thousands
+// of bullets cost one draw call, without a texture query per sprite.
+void blitSprites(SDL_Texture *texture, SDL_FPoint *points, int n)
+{
+	static SDL_Vertex *vertices;
+	static int *indices;
+	static int capacity;
+	SDL_Vertex *v;
+	int i, j, w, h;
+
+	if (n == 0)
+	{
+		return;
+	}
+
+	if (app.software)
+	{
+		for (i = 0 ; i < n ; i++)
+		{
+			softwareCopy(texture, NULL, points[i].x - originX, points[i].y - originY);
+		}
+
+		return;
+	}
+
+	if (n > capacity)
+	{
+		capacity = MAX(n, capacity * 2);
+		vertices = realloc(vertices, capacity * 4 * sizeof(SDL_Vertex));
+		indices = realloc(indices, capacity * 6 * sizeof(int));
+	}
+
+	getTextureSize(texture, &w, &h);
+
+	for (i = 0 ; i < n ; i++)
+	{
+		v = &vertices[i * 4];
+
+		for (j = 0 ; j < 4 ; j++)
+		{
+			v[j].position.x = (int)points[i].x - originX + ((j & 1) ? w : 0);
+			v[j].position.y = (int)points[i].y - originY + ((j & 2) ? h : 0);
+			v[j].color.r = v[j].color.g = v[j].color.b = v[j].color.a = 255;
+			v[j].tex_coord.x = (j & 1) ? 1 : 0;
+			v[j].tex_coord.y = (j & 2) ? 1 : 0;
+		}
+
+		indices[i * 6 + 0] = i * 4 + 0;
+		indices[i * 6 + 1] = i * 4 + 1;
+		indices[i * 6 + 2] = i * 4 + 2;
+		indices[i * 6 + 3] = i * 4 + 1;
+		indices[i * 6 + 4] = i * 4 + 3;
+		indices[i * 6 + 5] = i * 4 + 2;
+	}
+
+	SDL_RenderGeometry(app.renderer, texture, vertices, n * 4, indices, n * 6);
+}
+
+// Fill a rectangle of the screen with an opaque color.
+void fillRect(SDL_Rect *rect, int r, int g, int b)
+{
+	SDL_Rect s;
 
+	if (app.software)
+	{
+		// Fill after the pending SDL software renderer commands
+		SDL_RenderFlush(app.renderer);
 
+		scaleRect(rect, &s);
+		fillFramebuffer(&s, r, g, b, 255);
+		return;
+	}
+
+	SDL_SetRenderDrawBlendMode(app.renderer, SDL_BLENDMODE_NONE);
+	SDL_SetRenderDrawColor(app.renderer, r, g, b, 255);
+	SDL_RenderFillRect(app.renderer, rect);
+}
+
+// Initialize a layer.
+// Create the render target texture which caches the layer content at the given
+// position and size on the screen, at the internal resolution. The content is composed with straight alpha
+// over a transparent target, so the result is premultiplied and is drawn with
+// a premultiplied blend mode when the renderer supports it.
+void initLayer(Layer *layer, int x, int y, int w, int h)
+{
+	memset(layer, 0, sizeof(Layer));
+
+	layer->x = x;
+	layer->y = y;
+	layer->w = w;
+	layer->h = h;
+	layer->dirty = TRUE;
+
+	// The software framebuffer composes layers in its own surfaces
+	if (app.software)
+	{
+		layer->surface = SDL_CreateRGBSurfaceWithFormat(0, scale(w), scale(h), 32, SDL_PIXELFORMAT_ARGB8888);
+		return;
+	}
+
+	layer->texture = SDL_CreateTexture(app.renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, scale(w), scale(h));
+
+	if (!layer->texture)
+	{
+		printf("Failed to create %d x %d layer: %s\n", w, h, SDL_GetError());
+		exit(1);
+	}
+
+	if (layerBlendMode == SDL_BLENDMODE_NONE)
+	{
+		layerBlendMode = SDL_ComposeCustomBlendMode(SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA, SDL_BLENDOPERATION_ADD,
+							    SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA, SDL_BLENDOPERATION_ADD);
+	}
+
+	if (SDL_SetTextureBlendMode(layer->texture, layerBlendMode) < 0)
+	{
+		layerBlendMode = SDL_BLENDMODE_BLEND;
+
+		SDL_SetTextureBlendMode(layer->texture, layerBlendMode);
+	}
+}
+
+// Begin to compose a layer.
+// Check if the layer is dirty or if its content has been lost with the render targets, then
+// redirect drawing to the layer texture, clear it, and return TRUE.
+// Blit functions keep using screen positions while the layer is composed.
+// Return FALSE when the cached content is still valid.
+int beginLayer(Layer *layer)
+{
+	if (!layer->dirty && layer->generation == app.layerGeneration)
+	{
+		return FALSE;
+	}
+
+	if (app.software)
+	{
+		setFramebufferTarget(layer->surface);
+		fillFramebuffer(NULL, 0, 0, 0, 0);
+	}
+	else
+	{
+		setRenderTarget(layer->texture);
+		SDL_SetRenderDrawColor(app.renderer, 0, 0, 0, 0);
+		SDL_RenderClear(app.renderer);
+	}
+
+	originX = layer->x;
+	originY = layer->y;
+
+	layer->dirty = FALSE;
+	layer->generation = app.layerGeneration;
+
+	return TRUE;
+}
+
+// End to compose a layer, and restore drawing to the screen.
+void endLayer(void)
+{
+	originX = 0;
+	originY = 0;
+
+	if (app.software)
+	{
+		setFramebufferTarget(NULL);
+		return;
+	}
+
+	setRenderTarget(NULL);
+}
+
+// Clear a part of a layer.
+// Erase the given screen area from the cached layer content, so a small change
+// does not require to compose the whole layer again.
+void clearLayer(Layer *layer, SDL_Rect *rect)
+{
+	SDL_BlendMode blendMode;
+	SDL_Rect r;
+
+	// The whole layer will be composed again anyway
+	if (layer->dirty || layer->generation != app.layerGeneration)
+	{
+		return;
+	}
+
+	r.x = rect->x - layer->x;
+	r.y = rect->y - layer->y;
+	r.w = rect->w;
+	r.h = rect->h;
+
+	if (app.software)
+	{
+		scaleRect(&r, &r);
+		setFramebufferTarget(layer->surface);
+		fillFramebuffer(&r, 0, 0, 0, 0);
+		setFramebufferTarget(NULL);
+		return;
+	}
+
+	// Write the transparent pixels as they are, then give the next draws their blend mode back
+	SDL_GetRenderDrawBlendMode(app.renderer, &blendMode);
+
+	setRenderTarget(layer->texture);
+	SDL_SetRenderDrawBlendMode(app.renderer, SDL_BLENDMODE_NONE);
+	SDL_SetRenderDrawColor(app.renderer, 0, 0, 0, 0);
+	SDL_RenderFillRect(app.renderer, &r);
+	setRenderTarget(NULL);
+
+	SDL_SetRenderDrawBlendMode(app.renderer, blendMode);
+}
+
+// Draw a layer.
+// Copy the cached layer content on the screen at the layer position.
+void drawLayer(Layer *layer)
+{
+	SDL_Rect dest;
+
+	if (app.software)
+	{
+		blitFramebuffer(layer->surface, NULL, scale(layer->x), scale(layer->y), 0xFFFFFFFF, BLEND_PREMULTIPLIED, FALSE);
+		return;
+	}
+
+	dest.x = layer->x;
+	dest.y = layer->y;
+	dest.w = layer->w;
+	dest.h = layer->h;
+
+	SDL_RenderCopy(app.renderer, layer->texture, NULL, &dest);
+}
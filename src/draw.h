@@ -21,4 +21,11 @@
 
 #include <SDL2/SDL_image.h>
 
+extern void blitFramebuffer(SDL_Surface *src, SDL_Rect *srcRect, int x, int y, Uint32 mod, int mode, int opaque);
+extern Mask *createMask(SDL_Surface *surface);
+extern void fillFramebuffer(SDL_Rect *rect, Uint8 r, Uint8 g, Uint8 b, Uint8 a);
+extern PackEntry *findPackEntry(char *name, int type);
+extern void *getPackData(PackEntry *entry);
+extern void setFramebufferTarget(SDL_Surface *surface);
+
 extern App app;
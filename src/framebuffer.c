@@ -0,0 +1,524 @@
+/*
+    Copyright (C) 2021 Vincent Radé
+    Copyright (C) 2015-2018 Parallel Realities
+
+    Nature Invaders is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Nature Invaders is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Nature Invaders. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include "framebuffer.h"
+
+static void addRowScalar(Uint32 *dst, const Uint32 *src, int n, Uint32 mod);
+static void blendRowScalar(Uint32 *dst, const Uint32 *src, int n, Uint32 mod);
+static void premultipliedRowScalar(Uint32 *dst, const Uint32 *src, int n, Uint32 mod);
+#ifdef __SSE2__
+static void addRowSSE2(Uint32 *dst, const Uint32 *src, int n, Uint32 mod);
+static void blendRowSSE2(Uint32 *dst, const Uint32 *src, int n, Uint32 mod);
+static void premultipliedRowSSE2(Uint32 *dst, const Uint32 *src, int n, Uint32 mod);
+#endif
+#ifdef FRAMEBUFFER_AVX2
+static void addRowAVX2(Uint32 *dst, const Uint32 *src, int n, Uint32 mod);
+static void blendRowAVX2(Uint32 *dst, const Uint32 *src, int n, Uint32 mod);
+static void premultipliedRowAVX2(Uint32 *dst, const Uint32 *src, int n, Uint32 mod);
+#endif
+
+// Row kernels, selected at initialization according to the CPU features.
+// Each kernel composites 'n' ARGB8888 pixels of 'src' on 'dst', the source is
+// multiplied by the 'mod' color first, except for premultiplied rows.
+static void (*addRow)(Uint32 *dst, const Uint32 *src, int n, Uint32 mod);
+static void (*blendRow)(Uint32 *dst, const Uint32 *src, int n, Uint32 mod);
+static void (*premultipliedRow)(Uint32 *dst, const Uint32 *src, int n, Uint32 mod);
+
+static SDL_Surface *target;
+
+// Initialize the framebuffer.
+// Create the in-memory ARGB8888 framebuffer, and select the fastest kernels
+// supported by the CPU: AVX2, SSE2, or portable C.
+SDL_Surface *initFramebuffer(int w, int h)
+{
+	addRow = addRowScalar;
+	blendRow = blendRowScalar;
+	premultipliedRow = premultipliedRowScalar;
+
+#ifdef __SSE2__
+	if (SDL_HasSSE2())
+	{
+		addRow = addRowSSE2;
+		blendRow = blendRowSSE2;
+		premultipliedRow = premultipliedRowSSE2;
+	}
+#endif
+
+#ifdef FRAMEBUFFER_AVX2
+	if (SDL_HasAVX2())
+	{
+		addRow = addRowAVX2;
+		blendRow = blendRowAVX2;
+		premultipliedRow = premultipliedRowAVX2;
+	}
+#endif
+
+	app.framebuffer = SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_ARGB8888);
+
+	target = app.framebuffer;
+
+	return app.framebuffer;
+}
+
+// Redirect the drawing to a surface, or to the framebuffer when it is NULL.
+void setFramebufferTarget(SDL_Surface *surface)
+{
+	target = (surface != NULL) ? surface : app.framebuffer;
+}
+
+// Fill a rectangle of the target, or the whole target when it is NULL,
+// by replacing its pixels with the given color.
+void fillFramebuffer(SDL_Rect *rect, Uint8 r, Uint8 g, Uint8 b, Uint8 a)
+{
+	SDL_Rect area, bounds;
+	Uint32 color, *row;
+	int x, y;
+
+	bounds.x = 0;
+	bounds.y = 0;
+	bounds.w = target->w;
+	bounds.h = target->h;
+
+	if (rect == NULL)
+	{
+		area = bounds;
+	}
+	else if (!SDL_IntersectRect(rect, &bounds, &area))
+	{
+		return;
+	}
+
+	color = ((Uint32)a << 24) | ((Uint32)r << 16) | ((Uint32)g << 8) | b;
+
+	for (y = area.y ; y < area.y + area.h ; y++)
+	{
+		row = (Uint32 *)((Uint8 *)target->pixels + y * target->pitch) + area.x;
+
+		for (x = 0 ; x < area.w ; x++)
+		{
+			row[x] = color;
+		}
+	}
+}
+
+// Blit a part of a surface on the target at the given position, without scaling.
+// The source is clipped to the target, then each row is composited by the kernel
+// of the blend mode. Opaque sources without color modulation are copied directly.
+void blitFramebuffer(SDL_Surface *src, SDL_Rect *srcRect, int x, int y, Uint32 mod, int mode, int opaque)
+{
+	SDL_Rect s;
+	Uint8 *srcRow, *dstRow;
+	int i;
+
+	if (srcRect != NULL)
+	{
+		s = *srcRect;
+	}
+	else
+	{
+		s.x = 0;
+		s.y = 0;
+		s.w = src->w;
+		s.h = src->h;
+	}
+
+	// Clip the source rectangle with the target bounds
+	if (x < 0)
+	{
+		s.x -= x;
+		s.w += x;
+		x = 0;
+	}
+
+	if (y < 0)
+	{
+		s.y -= y;
+		s.h += y;
+		y = 0;
+	}
+
+	s.w = MIN(s.w, target->w - x);
+	s.h = MIN(s.h, target->h - y);
+
+	if (s.w <= 0 || s.h <= 0 || (mod >> 24) == 0)
+	{
+		return;
+	}
+
+	if (opaque && mod == 0xFFFFFFFF && mode == BLEND_ALPHA)
+	{
+		mode = BLEND_NONE;
+	}
+
+	srcRow = (Uint8 *)src->pixels + s.y * src->pitch + s.x * 4;
+	dstRow = (Uint8 *)target->pixels + y * target->pitch + x * 4;
+
+	for (i = 0 ; i < s.h ; i++)
+	{
+		switch (mode)
+		{
+		case BLEND_NONE:
+			memcpy(dstRow, srcRow, s.w * 4);
+			break;
+		case BLEND_ADD:
+			addRow((Uint32 *)dstRow, (Uint32 *)srcRow, s.w, mod);
+			break;
+		case BLEND_PREMULTIPLIED:
+			premultipliedRow((Uint32 *)dstRow, (Uint32 *)srcRow, s.w, mod);
+			break;
+		default:
+			blendRow((Uint32 *)dstRow, (Uint32 *)srcRow, s.w, mod);
+			break;
+		}
+
+		srcRow += src->pitch;
+		dstRow += target->pitch;
+	}
+}
+
+// Divide by 255 with the rounding of SDL blitters, for values up to 255 * 255
+#define DIV255(x) (((x) + 1 + ((x) >> 8)) >> 8)
+
+// Modulate and premultiply a source pixel, and return its alpha.
+static Uint32 premultiply(Uint32 s, Uint32 mod, Uint32 *r, Uint32 *g, Uint32 *b)
+{
+	Uint32 a;
+
+	a = DIV255((s >> 24) * (mod >> 24));
+	*r = DIV255(DIV255(((s >> 16) & 0xFF) * ((mod >> 16) & 0xFF)) * a);
+	*g = DIV255(DIV255(((s >> 8) & 0xFF) * ((mod >> 8) & 0xFF)) * a);
+	*b = DIV255(DIV255((s & 0xFF) * (mod & 0xFF)) * a);
+
+	return a;
+}
+
+static void blendRowScalar(Uint32 *dst, const Uint32 *src, int n, Uint32 mod)
+{
+	Uint32 d, a, r, g, b, inv;
+	int i;
+
+	for (i = 0 ; i < n ; i++)
+	{
+		a = premultiply(src[i], mod, &r, &g, &b);
+		inv = 255 - a;
+		d = dst[i];
+
+		dst[i] = ((a + DIV255((d >> 24) * inv)) << 24)
+			| ((r + DIV255(((d >> 16) & 0xFF) * inv)) << 16)
+			| ((g + DIV255(((d >> 8) & 0xFF) * inv)) << 8)
+			| (b + DIV255((d & 0xFF) * inv));
+	}
+}
+
+static void addRowScalar(Uint32 *dst, const Uint32 *src, int n, Uint32 mod)
+{
+	Uint32 d, r, g, b;
+	int i;
+
+	for (i = 0 ; i < n ; i++)
+	{
+		premultiply(src[i], mod, &r, &g, &b);
+		d = dst[i];
+
+		r = MIN(255, r + ((d >> 16) & 0xFF));
+		g = MIN(255, g + ((d >> 8) & 0xFF));
+		b = MIN(255, b + (d & 0xFF));
+
+		dst[i] = (d & 0xFF000000) | (r << 16) | (g << 8) | b;
+	}
+}
+
+static void premultipliedRowScalar(Uint32 *dst, const Uint32 *src, int n, Uint32 mod)
+{
+	Uint32 s, d, inv;
+	int i;
+
+	for (i = 0 ; i < n ; i++)
+	{
+		s = src[i];
+		d = dst[i];
+		inv = 255 - (s >> 24);
+
+		dst[i] = (((s >> 24) + DIV255((d >> 24) * inv)) << 24)
+			| ((((s >> 16) & 0xFF) + DIV255(((d >> 16) & 0xFF) * inv)) << 16)
+			| ((((s >> 8) & 0xFF) + DIV255(((d >> 8) & 0xFF) * inv)) << 8)
+			| ((s & 0xFF) + DIV255((d & 0xFF) * inv));
+	}
+}
+
+#ifdef __SSE2__
+
+// Divide 16 bits lanes by 255, see DIV255
+static inline __m128i div255SSE2(__m128i x)
+{
+	return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(x, _mm_set1_epi16(1)), _mm_srli_epi16(x, 8)), 8);
+}
+
+// Modulate and premultiply two pixels unpacked in 16 bits lanes.
+// When 'keepAlpha' is set the alpha lane is kept, otherwise it is cleared.
+static inline __m128i premultiplySSE2(__m128i s, __m128i mod, __m128i *alpha, int keepAlpha)
+{
+	__m128i a, f;
+
+	s = div255SSE2(_mm_mullo_epi16(s, mod));
+
+	a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+	f = _mm_and_si128(a, _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1));
+
+	if (keepAlpha)
+	{
+		f = _mm_or_si128(f, _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0));
+	}
+
+	*alpha = a;
+
+	return div255SSE2(_mm_mullo_epi16(s, f));
+}
+
+static inline __m128i unpackMod(Uint32 mod)
+{
+	return _mm_unpacklo_epi8(_mm_cvtsi32_si128(mod), _mm_setzero_si128());
+}
+
+static void blendRowSSE2(Uint32 *dst, const Uint32 *src, int n, Uint32 mod)
+{
+	__m128i zero, c255, m, s, d, sl, sh, dl, dh, al, ah;
+	int i, alphas;
+
+	zero = _mm_setzero_si128();
+	c255 = _mm_set1_epi16(255);
+	m = unpackMod(mod);
+	m = _mm_unpacklo_epi64(m, m);
+
+	for (i = 0 ; i + 4 <= n ; i += 4)
+	{
+		s = _mm_loadu_si128((const __m128i *)(src + i));
+
+		// Skip fully transparent pixels, and copy opaque pixels without modulation
+		alphas = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_srli_epi32(s, 24), zero)) & 0x1111;
+
+		if (alphas == 0x1111)
+		{
+			continue;
+		}
+
+		if (mod == 0xFFFFFFFF && (_mm_movemask_epi8(_mm_cmpeq_epi8(s, _mm_or_si128(s, _mm_set1_epi32(0xFF000000)))) & 0x8888) == 0x8888)
+		{
+			_mm_storeu_si128((__m128i *)(dst + i), s);
+			continue;
+		}
+
+		d = _mm_loadu_si128((const __m128i *)(dst + i));
+
+		sl = premultiplySSE2(_mm_unpacklo_epi8(s, zero), m, &al, TRUE);
+		sh = premultiplySSE2(_mm_unpackhi_epi8(s, zero), m, &ah, TRUE);
+
+		dl = div255SSE2(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(c255, al)));
+		dh = div255SSE2(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(c255, ah)));
+
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(_mm_add_epi16(sl, dl), _mm_add_epi16(sh, dh)));
+	}
+
+	blendRowScalar(dst + i, src + i, n - i, mod);
+}
+
+static void addRowSSE2(Uint32 *dst, const Uint32 *src, int n, Uint32 mod)
+{
+	__m128i zero, m, s, d, sl, sh, al, ah;
+	int i;
+
+	zero = _mm_setzero_si128();
+	m = unpackMod(mod);
+	m = _mm_unpacklo_epi64(m, m);
+
+	for (i = 0 ; i + 4 <= n ; i += 4)
+	{
+		s = _mm_loadu_si128((const __m128i *)(src + i));
+		d = _mm_loadu_si128((const __m128i *)(dst + i));
+
+		sl = premultiplySSE2(_mm_unpacklo_epi8(s, zero), m, &al, FALSE);
+		sh = premultiplySSE2(_mm_unpackhi_epi8(s, zero), m, &ah, FALSE);
+
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_adds_epu8(_mm_packus_epi16(sl, sh), d));
+	}
+
+	addRowScalar(dst + i, src + i, n - i, mod);
+}
+
+static void premultipliedRowSSE2(Uint32 *dst, const Uint32 *src, int n, Uint32 mod)
+{
+	__m128i zero, c255, s, d, sl, sh, al, ah;
+	int i;
+
+	zero = _mm_setzero_si128();
+	c255 = _mm_set1_epi16(255);
+
+	for (i = 0 ; i + 4 <= n ; i += 4)
+	{
+		s = _mm_loadu_si128((const __m128i *)(src + i));
+		d = _mm_loadu_si128((const __m128i *)(dst + i));
+
+		sl = _mm_unpacklo_epi8(s, zero);
+		sh = _mm_unpackhi_epi8(s, zero);
+		al = _mm_shufflehi_epi16(_mm_shufflelo_epi16(sl, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+		ah = _mm_shufflehi_epi16(_mm_shufflelo_epi16(sh, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+
+		sl = _mm_add_epi16(sl, div255SSE2(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(c255, al))));
+		sh = _mm_add_epi16(sh, div255SSE2(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(c255, ah))));
+
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(sl, sh));
+	}
+
+	premultipliedRowScalar(dst + i, src + i, n - i, mod);
+}
+
+#endif
+
+#ifdef FRAMEBUFFER_AVX2
+
+// AVX2 kernels work like the SSE2 ones on 8 pixels. Unpack and pack instructions
+// work inside 128 bits lanes, so the pixels order is kept.
+
+__attribute__((target("avx2")))
+static inline __m256i div255AVX2(__m256i x)
+{
+	return _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(x, _mm256_set1_epi16(1)), _mm256_srli_epi16(x, 8)), 8);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i premultiplyAVX2(__m256i s, __m256i mod, __m256i *alpha, int keepAlpha)
+{
+	__m256i a, f;
+
+	s = div255AVX2(_mm256_mullo_epi16(s, mod));
+
+	a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+	f = _mm256_and_si256(a, _mm256_set_epi16(0, -1, -1, -1, 0, -1, -1, -1, 0, -1, -1, -1, 0, -1, -1, -1));
+
+	if (keepAlpha)
+	{
+		f = _mm256_or_si256(f, _mm256_set_epi16(255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0));
+	}
+
+	*alpha = a;
+
+	return div255AVX2(_mm256_mullo_epi16(s, f));
+}
+
+__attribute__((target("avx2")))
+static void blendRowAVX2(Uint32 *dst, const Uint32 *src, int n, Uint32 mod)
+{
+	__m256i zero, c255, m, s, d, sl, sh, dl, dh, al, ah;
+	int i;
+
+	zero = _mm256_setzero_si256();
+	c255 = _mm256_set1_epi16(255);
+	m = _mm256_broadcastq_epi64(_mm_unpacklo_epi8(_mm_cvtsi32_si128(mod), _mm_setzero_si128()));
+
+	for (i = 0 ; i + 8 <= n ; i += 8)
+	{
+		s = _mm256_loadu_si256((const __m256i *)(src + i));
+
+		// Skip fully transparent pixels, and copy opaque pixels without modulation
+		if (_mm256_testz_si256(s, _mm256_set1_epi32(0xFF000000)))
+		{
+			continue;
+		}
+
+		if (mod == 0xFFFFFFFF && _mm256_testc_si256(s, _mm256_set1_epi32(0xFF000000)))
+		{
+			_mm256_storeu_si256((__m256i *)(dst + i), s);
+			continue;
+		}
+
+		d = _mm256_loadu_si256((const __m256i *)(dst + i));
+
+		sl = premultiplyAVX2(_mm256_unpacklo_epi8(s, zero), m, &al, TRUE);
+		sh = premultiplyAVX2(_mm256_unpackhi_epi8(s, zero), m, &ah, TRUE);
+
+		dl = div255AVX2(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), _mm256_sub_epi16(c255, al)));
+		dh = div255AVX2(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), _mm256_sub_epi16(c255, ah)));
+
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_packus_epi16(_mm256_add_epi16(sl, dl), _mm256_add_epi16(sh, dh)));
+	}
+
+	// Leave the AVX state before running SSE2 code on the last pixels
+	_mm256_zeroupper();
+
+	blendRowSSE2(dst + i, src + i, n - i, mod);
+}
+
+__attribute__((target("avx2")))
+static void addRowAVX2(Uint32 *dst, const Uint32 *src, int n, Uint32 mod)
+{
+	__m256i zero, m, s, d, sl, sh, al, ah;
+	int i;
+
+	zero = _mm256_setzero_si256();
+	m = _mm256_broadcastq_epi64(_mm_unpacklo_epi8(_mm_cvtsi32_si128(mod), _mm_setzero_si128()));
+
+	for (i = 0 ; i + 8 <= n ; i += 8)
+	{
+		s = _mm256_loadu_si256((const __m256i *)(src + i));
+		d = _mm256_loadu_si256((const __m256i *)(dst + i));
+
+		sl = premultiplyAVX2(_mm256_unpacklo_epi8(s, zero), m, &al, FALSE);
+		sh = premultiplyAVX2(_mm256_unpackhi_epi8(s, zero), m, &ah, FALSE);
+
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_adds_epu8(_mm256_packus_epi16(sl, sh), d));
+	}
+
+	// Leave the AVX state before running SSE2 code on the last pixels
+	_mm256_zeroupper();
+
+	addRowSSE2(dst + i, src + i, n - i, mod);
+}
+
+__attribute__((target("avx2")))
+static void premultipliedRowAVX2(Uint32 *dst, const Uint32 *src, int n, Uint32 mod)
+{
+	__m256i zero, c255, s, d, sl, sh, al, ah;
+	int i;
+
+	zero = _mm256_setzero_si256();
+	c255 = _mm256_set1_epi16(255);
+
+	for (i = 0 ; i + 8 <= n ; i += 8)
+	{
+		s = _mm256_loadu_si256((const __m256i *)(src + i));
+		d = _mm256_loadu_si256((const __m256i *)(dst + i));
+
+		sl = _mm256_unpacklo_epi8(s, zero);
+		sh = _mm256_unpackhi_epi8(s, zero);
+		al = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(sl, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+		ah = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(sh, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+
+		sl = _mm256_add_epi16(sl, div255AVX2(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), _mm256_sub_epi16(c255, al))));
+		sh = _mm256_add_epi16(sh, div255AVX2(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), _mm256_sub_epi16(c255, ah))));
+
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_packus_epi16(sl, sh));
+	}
+
+	// Leave the AVX state before running SSE2 code on the last pixels
+	_mm256_zeroupper();
+
+	premultipliedRowSSE2(dst + i, src + i, n - i, mod);
+}
+
+#endif
@@ -27,6 +27,8 @@ static int highscoreComparator(const void *a, const void *b);
 static void logic(void);
 
 static Highscore *newHighscore;
+static Layer highscoresLayer;
+static int blink;
 static int cursorBlink;
 static int timeout;
 
@@ -47,6 +49,9 @@ void initHighscoreTable(void)
 	newHighscore = NULL;
 	
 	cursorBlink = 0;
+
+        // The highscores layer holds the highscore table and the blinking text
+        initLayer(&highscoresLayer, 0, 70, SCREEN_WIDTH, 600 + GLYPH_HEIGHT - 70);
 }
 
 void initHighscores(void)
@@ -54,16 +59,23 @@ void initHighscores(void)
         // Add highscore logic and draw functions to delegate pattern.
 	app.delegate.logic = logic;
 	app.delegate.draw = draw;
+
+        app.attract = TRUE;
+        app.redraw = TRUE;
 	
 	memset(app.keyboard, 0, sizeof(int) * MAX_KEYBOARD_KEYS);
 	
 	timeout = FPS * 5;
+
+        highscoresLayer.dirty = TRUE;
 }
 
 static void logic(void)
 {
 	doBackground();
 
+        prepareStage();
+
         // Apply highscore logic
         // Check if a new score must be add to the table, then handle the new name input.
         // Else display title screen and then highscore table screen
@@ -84,12 +96,25 @@ static void logic(void)
 		{
 			initStage();
 		}
+
+                // Swap the text blink phase every 20 frames
+                if ((timeout % 40 < 20) != blink)
+                {
+                        blink = !blink;
+                        highscoresLayer.dirty = TRUE;
+                }
 	}
         
 	if (++cursorBlink >= FPS)
 	{
 		cursorBlink = 0;
 	}
+
+        // The name input is redrawn every frame while the user types
+        if (newHighscore != NULL || highscoresLayer.dirty)
+        {
+                app.redraw = TRUE;
+        }
 }
 
 static void doNameInput(void)
@@ -140,6 +165,8 @@ static void doNameInput(void)
 		}
 		
 		newHighscore = NULL;
+
+                highscoresLayer.dirty = TRUE;
 	}
 }
 
@@ -156,12 +183,20 @@ static void draw(void)
 	}
 	else
 	{
-		drawHighscores();
-		
-		if (timeout % 40 < 20)
-		{
-			drawText(SCREEN_WIDTH / 2, 600, 255, 255, 255, TEXT_CENTER, "PRESS FIRE TO PLAY!");
-		}
+                // Compose the highscores layer only when the table or the blink phase changed
+                if (beginLayer(&highscoresLayer))
+                {
+                        drawHighscores();
+
+                        if (blink)
+                        {
+                                drawText(SCREEN_WIDTH / 2, 600, 255, 255, 255, TEXT_CENTER, "PRESS FIRE TO PLAY!");
+                        }
+
+                        endLayer();
+                }
+
+                drawLayer(&highscoresLayer);
 	}
 }
 
@@ -258,6 +293,8 @@ void addHighscore(int score)
 			newHighscore = &highscores.highscore[i];
 		}
 	}
+
+        highscoresLayer.dirty = TRUE;
 }
 
 static int highscoreComparator(const void *a, const void *b)
@@ -19,11 +19,16 @@
 
 #include "common.h"
 
+extern int beginLayer(Layer *layer);
 extern void doBackground(void);
 extern void drawBackground(void);
+extern void drawLayer(Layer *layer);
 extern void drawText(int x, int y, int r, int g, int b, int align, char *format, ...);
+extern void endLayer(void);
+extern void initLayer(Layer *layer, int x, int y, int w, int h);
 extern void initStage(void);
 extern void initTitle(void);
+extern void prepareStage(void);
 
 extern App app;
 extern Highscores highscores;
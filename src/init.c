@@ -19,32 +19,63 @@
 
 #include "init.h"
 
+static void drawProgress(float progress);
+static void loadAssets(void);
+
 void initSDL(void)
 {
 	int rendererFlags, windowFlags;
+	Uint64 start;
 
-	rendererFlags = SDL_RENDERER_ACCELERATED;
+	rendererFlags = SDL_RENDERER_ACCELERATED | SDL_RENDERER_TARGETTEXTURE;
 
 	windowFlags = 0;
 
+        // Run headless with the dummy drivers when drawing in the software framebuffer,
+        // unless other drivers are chosen in the environment.
+        if (app.software)
+        {
+                SDL_setenv("SDL_VIDEODRIVER", "dummy", 0);
+                SDL_setenv("SDL_AUDIODRIVER", "dummy", 0);
+        }
+
+        start = SDL_GetPerformanceCounter();
+
         // Initialize the SDL library with the video subsystem
+        // The audio is initialized later on a background thread, see initSounds().
 	if (SDL_Init(SDL_INIT_VIDEO) < 0)
 	{
 		printf("Couldn't initialize SDl: %s\n", SDL_GetError());
 		exit(1);
 	}
 
-        // Initialize audio
-        // Set up audio with SDL mixer, with the following settings
-        // Use CD quality frequency, default format, stereo, and 1024 bytes per output sample. 
-        // See: https://www.libsdl.org/projects/SDL_mixer/docs/SDL_mixer_11.html 
-        if (Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 1024) == -1)
+        logStartupPhase("SDL_Init", start);
+
+        start = SDL_GetPerformanceCounter();
+
+	IMG_Init(IMG_INIT_PNG|IMG_INIT_JPG);
+
+        logStartupPhase("IMG_Init", start);
+
+        start = SDL_GetPerformanceCounter();
+
+        // Draw in an in-memory framebuffer, without window
+        if (app.software)
         {
-                printf("Couldn't initialize SDL Mixer\n");
-		exit(1);
-        }
+                app.renderer = SDL_CreateSoftwareRenderer(initFramebuffer(SCREEN_WIDTH * app.renderScale, SCREEN_HEIGHT * app.renderScale));
+
+                if(!app.renderer)
+                {
+                        printf("Failed to create software renderer: %s\n", SDL_GetError());
+                        exit(1);
+                }
 
-        Mix_AllocateChannels(MAX_SND_CHANNELS);
+                SDL_RenderSetScale(app.renderer, app.renderScale, app.renderScale);
+
+                logStartupPhase("renderer", start);
+
+                return;
+        }
 
 	app.window = SDL_CreateWindow("Nature Invader", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, SCREEN_WIDTH, SCREEN_HEIGHT, windowFlags);
 
@@ -64,32 +95,114 @@ void initSDL(void)
        	        exit(1);
 	}
 
-	IMG_Init(IMG_INIT_PNG|IMG_INIT_JPG);
+        initScene();
 
 	SDL_ShowCursor(0);
+
+        logStartupPhase("renderer", start);
 }
 
+// Initialize the game.
+// Only what the first title frame needs is loaded here. The audio starts on a
+// background thread, and the stage textures are loaded when the first stage starts.
 void initGame(void)
 {
-        initBackground();
+        Uint64 start;
+
+        start = SDL_GetPerformanceCounter();
+
+        openPack(PACK_FILENAME);
+
+        logStartupPhase("asset pack", start);
 
         initSounds();
 
+        start = SDL_GetPerformanceCounter();
+
+        loadAssets();
+
+        logStartupPhase("title textures", start);
+
+        start = SDL_GetPerformanceCounter();
+
+        initBackground();
+
         initFonts();
 
         initHighscoreTable();
 
-        loadMusic("music/music.ogg");
+        initParticles();
 
-        playMusic(1);
+        initBoxes();
+
+        logStartupPhase("views", start);
 }
 
 void cleanup(void)
 {
+        closeReplay();
+
+        closeNet();
+
+        destroySounds();
+
+        closePack();
+
 	SDL_DestroyRenderer(app.renderer);
 
-	SDL_DestroyWindow(app.window);
+        if (app.window)
+        {
+                SDL_DestroyWindow(app.window);
+        }
 
 	SDL_Quit();
 }
 
+// Load the assets.
+// Decode the textures of the title screen on the loader threads, and upload them
+// on this thread as they become ready, while a progress bar is drawn. The views
+// then find them in the texture cache. The sounds are queued behind them, and
+// uploaded by the following calls to pumpLoader().
+static void loadAssets(void)
+{
+        Load *font, *title;
+        float progress;
+
+        font = queueTexture("gfx/font.png");
+        title = queueTexture("gfx/title.png");
+
+        queueSounds();
+
+        startLoader();
+
+        progress = -1;
+
+        while (!isLoaded(font) || !isLoaded(title))
+        {
+                pumpLoader(16);
+
+                if ((isLoaded(font) + isLoaded(title)) / 2.0f != progress)
+                {
+                        progress = (isLoaded(font) + isLoaded(title)) / 2.0f;
+
+                        drawProgress(progress);
+                }
+        }
+}
+
+static void drawProgress(float progress)
+{
+        SDL_Rect r;
+
+        prepareScene();
+
+        r.x = SCREEN_WIDTH / 4;
+        r.y = SCREEN_HEIGHT / 2 - 4;
+        r.w = SCREEN_WIDTH / 2 * progress;
+        r.h = 8;
+
+        SDL_SetRenderDrawColor(app.renderer, 255, 255, 255, 255);
+        SDL_RenderFillRect(app.renderer, &r);
+
+        presentScene();
+}
@@ -22,12 +22,27 @@
 #include "SDL2/SDL_image.h"
 #include "SDL2/SDL_mixer.h"
 
+extern void closeNet(void);
+extern void closePack(void);
+extern void closeReplay(void);
+extern void destroySounds(void);
 extern void initBackground(void);
+extern void initBoxes(void);
 extern void initFonts(void);
+extern SDL_Surface *initFramebuffer(int w, int h);
 extern void initHighscoreTable(void);
+extern void initParticles(void);
+extern void initScene(void);
 extern void initSounds(void);
-extern void loadMusic(char *filename);
-extern void playMusic(int loop);
+extern int isLoaded(Load *load);
+extern void logStartupPhase(char *name, Uint64 start);
+extern int openPack(char *filename);
+extern void prepareScene(void);
+extern void presentScene(void);
+extern int pumpLoader(Uint32 timeout);
+extern void queueSounds(void);
+extern Load *queueTexture(char *filename);
+extern void startLoader(void);
 
 extern App app;
 extern Stage stage;
@@ -33,14 +33,22 @@ void doKeyDown(SDL_KeyboardEvent *event)
 	{
 		app.keyboard[event->keysym.scancode] = 1;
 	}
+
+	// Toggle the debug overlay
+	if (event->repeat == 0 && event->keysym.scancode == SDL_SCANCODE_F3)
+	{
+		app.overlay = !app.overlay;
+		app.redraw = TRUE;
+	}
 }
 
+// Handle pending events.
+// This can be called several times in a frame while waiting for the next one,
+// so text input is appended until the frame logic consumed it.
 void doInput(void)
 {
 	SDL_Event event;
 
-        memset(app.inputText, '\0', MAX_LINE_LENGTH);
-
 	while (SDL_PollEvent(&event))
 	{
 		switch (event.type)
@@ -58,7 +66,18 @@ void doInput(void)
 				break;
 
                         case SDL_TEXTINPUT:
-                                STRNCPY(app.inputText, event.text.text, MAX_LINE_LENGTH);
+                                strncat(app.inputText, event.text.text, MAX_LINE_LENGTH - strlen(app.inputText) - 1);
+                                break;
+
+                        // The window content may have been damaged
+                        case SDL_WINDOWEVENT:
+                                app.redraw = TRUE;
+                                break;
+
+                        // Render target textures content is lost, layers must be composed again
+                        case SDL_RENDER_TARGETS_RESET:
+                                app.layerGeneration++;
+                                app.redraw = TRUE;
                                 break;
 
 		        default:
@@ -66,3 +85,17 @@ void doInput(void)
 		}
 	}
 }
+
+// Get the INPUT_ bits of the keys held, for the player on this keyboard.
+int getKeyboardInput(void)
+{
+        return (app.keyboard[SDL_SCANCODE_LEFT] ? INPUT_LEFT : 0)
+               | (app.keyboard[SDL_SCANCODE_RIGHT] ? INPUT_RIGHT : 0)
+               | (app.keyboard[SDL_SCANCODE_LCTRL] ? INPUT_FIRE : 0);
+}
+
+// Clear the text input once the frame logic used it.
+void clearInput(void)
+{
+        memset(app.inputText, '\0', MAX_LINE_LENGTH);
+}
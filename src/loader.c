@@ -0,0 +1,241 @@
+/*
+    Copyright (C) 2021 Vincent Radé
+    Copyright (C) 2015-2018 Parallel Realities
+
+    Nature Invaders is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Nature Invaders is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Nature Invaders. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include "loader.h"
+
+static int decode(void *data);
+static void decodeLoad(Load *load);
+static Load *queueLoad(char *filename, int type);
+static void uploadLoad(Load *load);
+
+static Load loads[MAX_LOADS];
+static int numLoads;
+static int numDone;
+static SDL_atomic_t nextLoad;
+static SDL_sem *decoded;
+static SDL_Thread *threads[MAX_LOADER_THREADS];
+static int numThreads;
+
+// Queue a texture to load.
+// The returned load holds the texture handle once it is ready.
+Load *queueTexture(char *filename)
+{
+	return queueLoad(filename, LOAD_TEXTURE);
+}
+
+// Queue a sound to load.
+// The returned load holds the sound handle once it is ready. Its decoding waits
+// for the audio device, opened on the audio thread, since it gives the mixer format.
+Load *queueSound(char *filename)
+{
+	return queueLoad(filename, LOAD_SOUND);
+}
+
+static Load *queueLoad(char *filename, int type)
+{
+	Load *load;
+
+	if (numLoads == MAX_LOADS)
+	{
+		SDL_LogMessage(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_WARN, "Too many loads, %s is loaded later", filename);
+		return NULL;
+	}
+
+	load = &loads[numLoads++];
+	memset(load, 0, sizeof(Load));
+	STRNCPY(load->filename, filename, MAX_PACK_NAME_LENGTH);
+	load->type = type;
+
+	return load;
+}
+
+// Start the loader.
+// Decode the queued assets on a pool of threads, one per core. The threads take
+// the next queued asset until none is left, so the startup time scales with the cores.
+// If no thread can be created, the assets are decoded on the calling thread.
+// The loader can be started again once the previous assets are ready.
+void startLoader(void)
+{
+	int i, n;
+
+	decoded = SDL_CreateSemaphore(0);
+
+	SDL_AtomicSet(&nextLoad, numDone);
+
+	n = MIN(MIN(SDL_GetCPUCount(), MAX_LOADER_THREADS), numLoads - numDone);
+
+	for (i = 0 ; i < n ; i++)
+	{
+		threads[numThreads] = SDL_CreateThread(decode, "loader", NULL);
+
+		if (threads[numThreads] != NULL)
+		{
+			numThreads++;
+		}
+	}
+
+	SDL_LogMessage(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO, "Loading %d assets on %d threads", numLoads, numThreads);
+
+	if (numThreads == 0)
+	{
+		decode(NULL);
+	}
+}
+
+// Upload the decoded assets.
+// Wait at most timeout milliseconds for an asset to be decoded, then create the
+// textures and the sounds of every decoded asset on the render thread.
+// Return TRUE when every asset is ready, and stop the loader threads.
+int pumpLoader(Uint32 timeout)
+{
+	int i, state;
+
+	if (numDone == numLoads)
+	{
+		return TRUE;
+	}
+
+	if (SDL_SemWaitTimeout(decoded, timeout) == 0)
+	{
+		while (SDL_SemTryWait(decoded) == 0);
+	}
+
+	numDone = 0;
+
+	for (i = 0 ; i < numLoads ; i++)
+	{
+		state = SDL_AtomicGet(&loads[i].state);
+
+		if (state == LOAD_DECODED)
+		{
+			uploadLoad(&loads[i]);
+			state = LOAD_READY;
+		}
+
+		numDone += state != LOAD_QUEUED;
+	}
+
+	if (numDone < numLoads)
+	{
+		return FALSE;
+	}
+
+	for (i = 0 ; i < numThreads ; i++)
+	{
+		SDL_WaitThread(threads[i], NULL);
+	}
+
+	numThreads = 0;
+
+	SDL_DestroySemaphore(decoded);
+	decoded = NULL;
+
+	return TRUE;
+}
+
+// Return TRUE when a load is ready or has failed, once uploaded by pumpLoader.
+int isLoaded(Load *load)
+{
+	int state;
+
+	state = SDL_AtomicGet(&load->state);
+
+	return state == LOAD_READY || state == LOAD_FAILED;
+}
+
+static int decode(void *data)
+{
+	int i;
+
+	while ((i = SDL_AtomicAdd(&nextLoad, 1)) < numLoads)
+	{
+		decodeLoad(&loads[i]);
+
+		SDL_SemPost(decoded);
+	}
+
+	return 0;
+}
+
+// Decode an asset.
+// Runs on a loader thread: only decode in memory, never use the renderer.
+static void decodeLoad(Load *load)
+{
+	PackEntry *entry;
+	Mix_Chunk *chunk;
+
+	if (load->type == LOAD_TEXTURE)
+	{
+		load->surface = decodeImage(load->filename, &load->w, &load->h, &load->opaque, &load->mask);
+
+		SDL_AtomicSet(&load->state, (load->surface != NULL) ? LOAD_DECODED : LOAD_FAILED);
+
+		return;
+	}
+
+	// Sounds are converted to the format of the device, without device no sound is played
+	if (!waitAudioDevice())
+	{
+		SDL_AtomicSet(&load->state, LOAD_FAILED);
+
+		return;
+	}
+
+	entry = findPackSound(load->filename);
+
+	if (entry != NULL)
+	{
+		load->samples = getPackData(entry);
+		load->length = entry->size;
+		load->packed = TRUE;
+	}
+	else if ((chunk = Mix_LoadWAV(load->filename)) != NULL)
+	{
+		// Keep the converted samples, and free only the chunk
+		load->samples = chunk->abuf;
+		load->length = chunk->alen;
+		chunk->allocated = 0;
+		Mix_FreeChunk(chunk);
+	}
+
+	SDL_AtomicSet(&load->state, (load->samples != NULL) ? LOAD_DECODED : LOAD_FAILED);
+}
+
+// Upload a decoded asset.
+// Runs on the render thread, which owns the renderer and the texture cache.
+static void uploadLoad(Load *load)
+{
+	if (load->type == LOAD_TEXTURE)
+	{
+		load->texture = uploadTexture(load->filename, load->surface, load->w, load->h, load->opaque, load->mask);
+		load->surface = NULL;
+	}
+	else
+	{
+		load->sound = Mix_QuickLoad_RAW(load->samples, load->length);
+
+		// The chunk owns the decoded samples, but not the mapped ones
+		if (load->sound != NULL)
+		{
+			load->sound->allocated = !load->packed;
+		}
+	}
+
+	SDL_AtomicSet(&load->state, LOAD_READY);
+}
@@ -0,0 +1,30 @@
+/*
+    Copyright (C) 2021 Vincent Radé
+    Copyright (C) 2015-2018 Parallel Realities
+
+    Nature Invaders is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Nature Invaders is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Nature Invaders. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include "common.h"
+
+#include "SDL2/SDL_mixer.h"
+
+extern SDL_Surface *decodeImage(char *filename, int *w, int *h, int *opaque, Mask **mask);
+extern PackEntry *findPackSound(char *name);
+extern void *getPackData(PackEntry *entry);
+extern SDL_Texture *uploadTexture(char *filename, SDL_Surface *surface, int w, int h, int opaque, Mask *mask);
+extern int waitAudioDevice(void);
+
+extern App app;
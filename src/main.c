@@ -20,48 +20,364 @@
 #include "main.h"
 
 static void capFrameRate(long *then, float *remainder);
+static void countFrame(int drawn);
+static double frameTime(Uint64 start);
+static void handleCommandLine(int args, char *argv[]);
+static void printStress(double logicTime, double drawTime);
+static void printStressSummary(void);
+static void traceFrame(Uint64 start, double logicTime, double drawTime, int transition);
+static void waitFrame(long wait);
+
+static int maxFrames;
+static FILE *traceFile;
+static int stressFrames;
+static double stressLogic, stressDraw, stressMaxLogic;
 
 int main(int args, char *argv[])
 {
 	long then;
 	float remainder;
+	Uint64 start, drawStart;
+	double logicTime, drawTime;
+	int firstFrame;
+	void (*logic)(void);
         
 	memset(&app, 0, sizeof(App));
+
+        app.startTime = SDL_GetPerformanceCounter();
 	
 	app.textureTail = &app.textureHead;
+        app.renderScale = 1;
+        app.sceneFilter = SDL_ScaleModeLinear;
+        app.audioSamples = MIXER_SAMPLES;
+        app.sceneScale = 1;
+        app.formationRows = ENEMY_ROW;
+        app.formationCols = ENEMY_COL;
+        app.numPlayers = 1;
+        app.attractScrollRate = 1;
+
+        handleCommandLine(args, argv);
         
 	initSDL();
 
+        setQuality(app.quality);
+
         // Call 'cleanup' function when the program terminates
 	atexit(cleanup);
 
 	initGame();
+
+        start = SDL_GetPerformanceCounter();
   
 	initTitle();
+
+        logStartupPhase("title", start);
+
+        // The stress stage starts without waiting on the title screen
+        if (app.stress)
+        {
+                initStage();
+        }
+
+        // A replay or a network game starts on its stage
+        startReplay();
+
+        startNet();
 	
 	then = SDL_GetTicks();
 
+        firstFrame = TRUE;
+
 	remainder = 0;
 
-        // Main loop that stop when the user quit the game
+        // Main loop that stop when the user quit the game.
+        // The logic runs every frame, but the scene is drawn only when a view
+        // declared that its visual state changed.
 	while(1)
 	{
-		prepareScene();
+                start = SDL_GetPerformanceCounter();
+
+                logic = app.delegate.logic;
 
                 doInput(); 
 
 		app.delegate.logic();
 
-		app.delegate.draw();
-                
-		presentScene();
-		
-		capFrameRate(&then, & remainder);
+                flushSounds();
+
+                clearInput();
+
+                logicTime = frameTime(start);
+
+                // Nothing is drawn when only the logic is measured
+                if (app.noDraw)
+                {
+                        app.redraw = FALSE;
+                }
+
+                countFrame(app.redraw);
+
+                drawStart = SDL_GetPerformanceCounter();
+
+                if (app.redraw)
+                {
+                        prepareScene();
+
+                        app.delegate.draw();
+
+                        drawQualityOverlay();
+
+                        presentScene();
+
+                        app.redraw = FALSE;
+
+                        // Report when the title screen appears
+                        if (firstFrame)
+                        {
+                                logStartupPhase("first frame", start);
+                                firstFrame = FALSE;
+                        }
+                }
+
+                drawTime = frameTime(drawStart);
+
+                traceFrame(start, logicTime, drawTime, app.delegate.logic != logic);
+
+                printStress(logicTime, drawTime);
+
+                // Lower the cosmetic load when the frames get too long
+                updateQuality(frameTime(start));
+
+                // The software framebuffer renders offscreen as fast as possible
+                if (!app.software)
+                {
+                        capFrameRate(&then, & remainder);
+                }
 	}
   
 	return 0;
 }
 
+// Handle command line options.
+// -software     draw headless in the software framebuffer
+// -frames <n>   quit after n frames, and print the frame rate
+// -scale <f>    compose the scene at a fraction of the screen resolution, between 0.1 and 1
+// -filter <f>   upscale the scene with a 'nearest' or 'linear' filter
+// -trace <file> write the time of every frame in a file
+// -audiobuffer <n> audio buffer size in sample frames, between 128 and 4096
+// -quality <n>  fix the quality level, from 0 (full) to 4, instead of following the frame time
+// -stress       play the bullet stress stage, and print the counts and timings of every frame
+// -nodraw       run the logic only, without drawing
+// -formation <rows>x<cols> size of the enemy formation, up to 50x100
+// -record <file> record the inputs and the state hashes of the first stage in a replay file
+// -replay <file> play a replay back, and report the first frame where the state diverges
+// -dump <file>  write the position of every entity every frame of the replay in a file
+// -host <port>  host a two players network game on a UDP port
+// -join <address:port> join the network game of a host
+// -netlatency <ms> delay the network packets sent, to test the rollbacks
+// -netloss <percent> drop a part of the network packets sent
+// -attractscroll <n> move the background every n frames on attract screens, from 1 to 8
+static void handleCommandLine(int args, char *argv[])
+{
+	float scale;
+	int i, n, rows, cols;
+
+	for (i = 1 ; i < args ; i++)
+	{
+		if (strcmp(argv[i], "-software") == 0)
+		{
+			app.software = TRUE;
+		}
+		else if (strcmp(argv[i], "-frames") == 0 && i + 1 < args)
+		{
+			maxFrames = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-scale") == 0 && i + 1 < args)
+		{
+			scale = atof(argv[++i]);
+			app.renderScale = MIN(MAX(scale, 0.1), 1);
+		}
+		else if (strcmp(argv[i], "-filter") == 0 && i + 1 < args)
+		{
+			app.sceneFilter = (strcmp(argv[++i], "nearest") == 0) ? SDL_ScaleModeNearest : SDL_ScaleModeLinear;
+		}
+		else if (strcmp(argv[i], "-audiobuffer") == 0 && i + 1 < args)
+		{
+			n = atoi(argv[++i]);
+			app.audioSamples = MIN(MAX(n, MIN_MIXER_SAMPLES), MAX_MIXER_SAMPLES);
+		}
+		else if (strcmp(argv[i], "-trace") == 0 && i + 1 < args)
+		{
+			traceFile = fopen(argv[++i], "w");
+		}
+		else if (strcmp(argv[i], "-quality") == 0 && i + 1 < args)
+		{
+			n = atoi(argv[++i]);
+			app.quality = MIN(MAX(n, 0), QUALITY_LEVELS - 1);
+			app.fixedQuality = TRUE;
+		}
+		else if (strcmp(argv[i], "-stress") == 0)
+		{
+			app.stress = TRUE;
+		}
+		else if (strcmp(argv[i], "-nodraw") == 0)
+		{
+			app.noDraw = TRUE;
+		}
+		else if (strcmp(argv[i], "-formation") == 0 && i + 1 < args)
+		{
+			if (sscanf(argv[++i], "%dx%d", &rows, &cols) == 2)
+			{
+				app.formationRows = MIN(MAX(rows, 1), MAX_FORMATION_ROWS);
+				app.formationCols = MIN(MAX(cols, 1), MAX_FORMATION_COLS);
+			}
+		}
+		else if (strcmp(argv[i], "-record") == 0 && i + 1 < args)
+		{
+			recordReplay(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-replay") == 0 && i + 1 < args)
+		{
+			if (!openReplay(argv[++i]))
+			{
+				printf("Couldn't open replay %s\n", argv[i]);
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-dump") == 0 && i + 1 < args)
+		{
+			dumpReplay(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-host") == 0 && i + 1 < args)
+		{
+			hostGame(atoi(argv[++i]));
+		}
+		else if (strcmp(argv[i], "-join") == 0 && i + 1 < args)
+		{
+			joinGame(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-netlatency") == 0 && i + 1 < args)
+		{
+			n = atoi(argv[++i]);
+			app.netLatency = MAX(n, 0);
+		}
+		else if (strcmp(argv[i], "-netloss") == 0 && i + 1 < args)
+		{
+			n = atoi(argv[++i]);
+			app.netLoss = MIN(MAX(n, 0), 100);
+		}
+		else if (strcmp(argv[i], "-attractscroll") == 0 && i + 1 < args)
+		{
+			n = atoi(argv[++i]);
+			app.attractScrollRate = MIN(MAX(n, 1), MAX_ATTRACT_SCROLL_RATE);
+		}
+	}
+}
+
+// Count frames.
+// When a number of frames is given on the command line, quit after the last one
+// and print how many frames were run and drawn per second.
+static void countFrame(int drawn)
+{
+	static Uint64 start;
+	static int frames, drawnFrames;
+	double seconds;
+
+	if (maxFrames <= 0)
+	{
+		return;
+	}
+
+	if (frames == 0)
+	{
+		start = SDL_GetPerformanceCounter();
+	}
+
+	if (frames == maxFrames)
+	{
+		seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+		// The stress stage CSV takes the standard output
+		fprintf(app.stress ? stderr : stdout, "%d frames, %d drawn, in %.3f s: %.1f frames per second\n", maxFrames, drawnFrames, seconds, maxFrames / seconds);
+
+		printStressSummary();
+
+		exit(0);
+	}
+
+	frames++;
+	drawnFrames += drawn;
+}
+
+// Trace the frame time.
+// Write the time spent on the input, the logic and the drawing of every frame, then
+// the logic and the drawing apart, and mark the frames where the view changed,
+// to find spikes on scene transitions.
+static void traceFrame(Uint64 start, double logicTime, double drawTime, int transition)
+{
+	static int frame;
+
+	if (traceFile == NULL)
+	{
+		return;
+	}
+
+	if (frame == 0)
+	{
+		fprintf(traceFile, "frame,ms,logic_ms,draw_ms,transition\n");
+	}
+
+	fprintf(traceFile, "%d,%.3f,%.3f,%.3f,%d\n", frame++, frameTime(start), logicTime, drawTime, transition);
+}
+
+// Print the stress stage counts.
+// Write a CSV line on the standard output for every frame, with the numbers of
+// live bullets, enemies and particles, and the time spent on the logic and the drawing.
+static void printStress(double logicTime, double drawTime)
+{
+	static int frame;
+
+	if (!app.stress)
+	{
+		return;
+	}
+
+	if (frame == 0)
+	{
+		printf("frame,bullets,enemies,particles,logic_ms,draw_ms\n");
+	}
+
+	printf("%d,%d,%d,%d,%.3f,%.3f\n", frame++, stage.numBullets, stage.numEnemies, getParticleCount(), logicTime, drawTime);
+
+	// Sum the frames at the target load, for the summary
+	if (stage.numBullets >= STRESS_BULLETS)
+	{
+		stressFrames++;
+		stressLogic += logicTime;
+		stressDraw += drawTime;
+		stressMaxLogic = MAX(stressMaxLogic, logicTime);
+	}
+}
+
+// Print the average times of the stress stage frames with STRESS_BULLETS or more.
+// On the error output, so the standard output only holds the CSV lines.
+static void printStressSummary(void)
+{
+	if (!app.stress || stressFrames == 0)
+	{
+		return;
+	}
+
+	fprintf(stderr, "%d frames with %d bullets or more: logic %.3f ms (max %.3f ms), draw %.3f ms per frame\n",
+	       stressFrames, STRESS_BULLETS, stressLogic / stressFrames, stressMaxLogic, stressDraw / stressFrames);
+}
+
+// Time spent on the frame since 'start', in milliseconds.
+static double frameTime(Uint64 start)
+{
+	return (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+}
+
 // Keep the frame rate to 60Hz - 16.667ms
 static void capFrameRate(long *then, float *remainder)
 {
@@ -79,9 +395,29 @@ static void capFrameRate(long *then, float *remainder)
 		wait = 1;
 	}
 
-	SDL_Delay(wait);
+	waitFrame(wait);
 
 	*remainder += 0.667;
 
 	*then = SDL_GetTicks();
 }
+
+// Wait for the next frame.
+// Sleep until an event arrives or the frame time is over, so the input
+// is handled as soon as possible and no CPU is used between frames.
+static void waitFrame(long wait)
+{
+	long deadline;
+
+	deadline = SDL_GetTicks() + wait;
+
+	while (wait > 0)
+	{
+		if (SDL_WaitEventTimeout(NULL, wait))
+		{
+			doInput();
+		}
+
+		wait = deadline - (long)SDL_GetTicks();
+	}
+}
@@ -20,13 +20,29 @@
 #include "common.h"
 
 extern void cleanup(void);
+extern void clearInput(void);
 extern void doInput(void);
+extern void drawQualityOverlay(void);
+extern void dumpReplay(char *file);
+extern void flushSounds(void);
+extern int getParticleCount(void);
+extern void hostGame(int port);
 extern void initGame(void);
 extern void initSDL(void);
+extern void initStage(void);
 extern void initTitle(void);
+extern void joinGame(char *address);
+extern void logStartupPhase(char *name, Uint64 start);
+extern int openReplay(char *file);
 extern void prepareScene(void);
 extern void presentScene(void);
+extern void recordReplay(char *file);
+extern void setQuality(int level);
+extern void startNet(void);
+extern void startReplay(void);
+extern void updateQuality(double ms);
 
 App app;
 Highscores highscores;
 Stage stage;
+World world;
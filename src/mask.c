@@ -0,0 +1,109 @@
+/*
+    Copyright (C) 2021 Vincent Radé
+    Copyright (C) 2015-2018 Parallel Realities
+
+    Nature Invaders is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Nature Invaders is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Nature Invaders. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include "mask.h"
+
+static Uint64 getBits(Mask *mask, int y, int start);
+
+// Create the collision mask of an ARGB8888 image.
+// A pixel is solid when its alpha is at least MASK_ALPHA. Every row of the
+// mask is packed in 64 bits words, the leftmost pixel in the lowest bit.
+// Uses no renderer, so masks can be created on the loader threads.
+Mask *createMask(SDL_Surface *surface)
+{
+	Mask *mask;
+	Uint32 *pixels;
+	Uint64 *row;
+	int x, y;
+
+	mask = malloc(sizeof(Mask));
+	mask->w = surface->w;
+	mask->h = surface->h;
+	mask->words = (surface->w + 63) / 64;
+	mask->rows = calloc(mask->h * mask->words, sizeof(Uint64));
+
+	for (y = 0 ; y < mask->h ; y++)
+	{
+		pixels = (Uint32 *)((Uint8 *)surface->pixels + y * surface->pitch);
+		row = &mask->rows[y * mask->words];
+
+		for (x = 0 ; x < mask->w ; x++)
+		{
+			if ((pixels[x] >> 24) >= MASK_ALPHA)
+			{
+				row[x / 64] |= (Uint64)1 << (x % 64);
+			}
+		}
+	}
+
+	return mask;
+}
+
+// Detect a collision between two masks at the given screen positions.
+// Call it once the bounds of both sprites are colliding. For every row where
+// the sprites overlap, the bits of the second mask are shifted in front of the
+// words of the first one and both are ANDed, so a row costs a few word operations.
+// A sprite without mask is tested by its bounds only.
+int maskCollision(Mask *m1, int x1, int y1, Mask *m2, int x2, int y2)
+{
+	int x, y, top, bottom, left, right;
+
+	if (m1 == NULL || m2 == NULL)
+	{
+		return TRUE;
+	}
+
+	top = MAX(y1, y2);
+	bottom = MIN(y1 + m1->h, y2 + m2->h);
+
+	// Words of the first mask crossing the overlap
+	left = (MAX(x1, x2) - x1) / 64;
+	right = (MIN(x1 + m1->w, x2 + m2->w) - x1 - 1) / 64;
+
+	for (y = top ; y < bottom ; y++)
+	{
+		for (x = left ; x <= right ; x++)
+		{
+			if (m1->rows[(y - y1) * m1->words + x] & getBits(m2, y - y2, x * 64 + x1 - x2))
+			{
+				return TRUE;
+			}
+		}
+	}
+
+	return FALSE;
+}
+
+// Get the 64 bits of a mask row from the 'start' pixel, which can be out of the mask.
+static Uint64 getBits(Mask *mask, int y, int start)
+{
+	Uint64 *row, lo, hi;
+	int w, b;
+
+	row = &mask->rows[y * mask->words];
+
+	// Floor division, start can be negative
+	w = (start >= 0) ? start / 64 : -((63 - start) / 64);
+	b = start - w * 64;
+
+	lo = (w >= 0 && w < mask->words) ? row[w] : 0;
+	hi = (w + 1 >= 0 && w + 1 < mask->words) ? row[w + 1] : 0;
+
+	return (b == 0) ? lo : (lo >> b) | (hi << (64 - b));
+}
@@ -0,0 +1,421 @@
+/*
+    Copyright (C) 2021 Vincent Radé
+    Copyright (C) 2015-2018 Parallel Realities
+
+    Nature Invaders is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Nature Invaders is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Nature Invaders. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include "mixer.h"
+
+static Voice *findVoice(MixerCommand *command);
+static void mixAudio(void *data, Uint8 *stream, int len);
+static void mixVoiceScalar(Sint32 *acc, const Sint16 *src, int n, Sint16 left, Sint16 right);
+static void processCommands(void);
+static void resolveMixScalar(Sint16 *dst, const Sint32 *acc, int n);
+#ifdef __SSE2__
+static void mixVoiceSSE2(Sint32 *acc, const Sint16 *src, int n, Sint16 left, Sint16 right);
+static void resolveMixSSE2(Sint16 *dst, const Sint32 *acc, int n);
+#endif
+#ifdef MIXER_AVX2
+static void mixVoiceAVX2(Sint32 *acc, const Sint16 *src, int n, Sint16 left, Sint16 right);
+static void resolveMixAVX2(Sint16 *dst, const Sint32 *acc, int n);
+#endif
+
+// Mixing kernels, selected at initialization according to the CPU features.
+// mixVoice accumulates 'n' interleaved stereo samples of 'src', multiplied by the
+// left and right gains, in 32 bits: every voice can be at full scale without overflow.
+// resolveMix adds the accumulated voices to the output samples, with saturation.
+static void (*mixVoice)(Sint32 *acc, const Sint16 *src, int n, Sint16 left, Sint16 right);
+static void (*resolveMix)(Sint16 *dst, const Sint32 *acc, int n);
+
+// Commands ring, written by the game thread and read by the audio thread.
+// Each side only writes its own index, so neither takes a lock.
+static MixerCommand commands[MIXER_RING_SIZE];
+static SDL_atomic_t commandHead;
+static SDL_atomic_t commandTail;
+
+// Owned by the audio thread
+static Voice voices[MAX_VOICES];
+static Sint32 accumulator[MAX_MIXER_SAMPLES * 2];
+
+// Initialize the mixer.
+// The sounds are mixed in the audio callback, after the music played by SDL Mixer.
+// The mixer needs a 16 bits stereo device, otherwise FALSE is returned and the
+// sounds must be played by SDL Mixer.
+int initMixer(void)
+{
+	int frequency, channels;
+	Uint16 format;
+
+	if (!Mix_QuerySpec(&frequency, &format, &channels) || format != AUDIO_S16SYS || channels != 2)
+	{
+		return FALSE;
+	}
+
+	mixVoice = mixVoiceScalar;
+	resolveMix = resolveMixScalar;
+
+#ifdef __SSE2__
+	if (SDL_HasSSE2())
+	{
+		mixVoice = mixVoiceSSE2;
+		resolveMix = resolveMixSSE2;
+	}
+#endif
+
+#ifdef MIXER_AVX2
+	if (SDL_HasAVX2())
+	{
+		mixVoice = mixVoiceAVX2;
+		resolveMix = resolveMixAVX2;
+	}
+#endif
+
+	memset(voices, 0, sizeof(voices));
+
+	Mix_SetPostMix(mixAudio, NULL);
+
+	return TRUE;
+}
+
+void closeMixer(void)
+{
+	Mix_SetPostMix(NULL, NULL);
+}
+
+// Send a command to the mixer.
+// Called by the game thread only. The command is dropped when the ring is full.
+int sendMixerCommand(MixerCommand *command)
+{
+	int head;
+
+	head = SDL_AtomicGet(&commandHead);
+
+	if (head - SDL_AtomicGet(&commandTail) == MIXER_RING_SIZE)
+	{
+		return FALSE;
+	}
+
+	commands[head & (MIXER_RING_SIZE - 1)] = *command;
+
+	// Publish the command after it is written
+	SDL_AtomicSet(&commandHead, head + 1);
+
+	return TRUE;
+}
+
+// Play a sound.
+// The sound is panned with a constant power from its horizontal position x,
+// and its volume is at most MAX_SOUND_BOOST.
+void playMixerSound(int id, Sound *sound, int x, float volume)
+{
+	MixerCommand command;
+	float pan, gain;
+
+	pan = MIN(MAX((float)x / SCREEN_WIDTH, 0), 1) * M_PI / 2;
+	gain = MIN(volume, MAX_SOUND_BOOST) * (1 << MIXER_GAIN_SHIFT);
+
+	command.type = MIXER_PLAY;
+	command.voice = CH_ANY;
+	command.sound = id;
+	command.maxVoices = sound->maxVoices;
+	command.priority = sound->priority;
+	command.samples = (Sint16 *)sound->chunk->abuf;
+	command.frames = sound->chunk->alen / (2 * sizeof(Sint16));
+	command.left = MIN(cos(pan) * gain, 32767);
+	command.right = MIN(sin(pan) * gain, 32767);
+
+	sendMixerCommand(&command);
+}
+
+// Stop a voice, or every voice for CH_ANY.
+void stopMixerSound(int channel)
+{
+	MixerCommand command;
+
+	memset(&command, 0, sizeof(MixerCommand));
+	command.type = MIXER_STOP;
+	command.voice = channel;
+
+	sendMixerCommand(&command);
+}
+
+// Apply the commands sent since the last callback.
+static void processCommands(void)
+{
+	MixerCommand *command;
+	Voice *voice;
+	int head, tail, i;
+
+	head = SDL_AtomicGet(&commandHead);
+
+	for (tail = SDL_AtomicGet(&commandTail) ; tail != head ; tail++)
+	{
+		command = &commands[tail & (MIXER_RING_SIZE - 1)];
+
+		if (command->type == MIXER_STOP)
+		{
+			for (i = 0 ; i < MAX_VOICES ; i++)
+			{
+				if (command->voice == CH_ANY || command->voice == i)
+				{
+					voices[i].samples = NULL;
+				}
+			}
+
+			continue;
+		}
+
+		voice = findVoice(command);
+
+		if (voice != NULL)
+		{
+			voice->samples = command->samples;
+			voice->frames = command->frames;
+			voice->position = 0;
+			voice->sound = command->sound;
+			voice->priority = command->priority;
+			voice->left = command->left;
+			voice->right = command->right;
+		}
+	}
+
+	SDL_AtomicSet(&commandTail, tail);
+}
+
+// Find a voice to play a sound.
+// When the sound already plays on its maximum number of voices, restart its oldest voice.
+// Otherwise take a free voice, or steal the oldest voice of the lowest priority sound,
+// if it isn't higher than the priority of the new sound. Return NULL to drop the sound.
+static Voice *findVoice(MixerCommand *command)
+{
+	Voice *v, *oldest, *free, *victim;
+	int i, playing;
+
+	oldest = NULL;
+	free = NULL;
+	victim = NULL;
+	playing = 0;
+
+	for (i = 0 ; i < MAX_VOICES ; i++)
+	{
+		v = &voices[i];
+
+		if (v->samples == NULL)
+		{
+			free = (free == NULL) ? v : free;
+		}
+		else if (v->sound == command->sound)
+		{
+			playing++;
+
+			if (oldest == NULL || v->position > oldest->position)
+			{
+				oldest = v;
+			}
+		}
+		else if (v->priority <= command->priority
+			 && (victim == NULL || v->priority < victim->priority
+			     || (v->priority == victim->priority && v->position > victim->position)))
+		{
+			victim = v;
+		}
+	}
+
+	if (playing >= command->maxVoices)
+	{
+		return oldest;
+	}
+
+	return (free != NULL) ? free : victim;
+}
+
+// Mix the voices.
+// Called by SDL Mixer on the audio thread with the music already in the stream.
+// The voices are accumulated in 32 bits, then added to the stream at once.
+static void mixAudio(void *data, Uint8 *stream, int len)
+{
+	Sint16 *out;
+	Voice *v;
+	int i, frames, block, n, active;
+
+	processCommands();
+
+	out = (Sint16 *)stream;
+	frames = len / (2 * sizeof(Sint16));
+
+	while (frames > 0)
+	{
+		block = MIN(frames, MAX_MIXER_SAMPLES);
+		active = FALSE;
+
+		memset(accumulator, 0, block * 2 * sizeof(Sint32));
+
+		for (i = 0 ; i < MAX_VOICES ; i++)
+		{
+			v = &voices[i];
+
+			if (v->samples != NULL)
+			{
+				n = MIN((Uint32)block, v->frames - v->position);
+
+				mixVoice(accumulator, v->samples + v->position * 2, n * 2, v->left, v->right);
+
+				v->position += n;
+				active = TRUE;
+
+				if (v->position >= v->frames)
+				{
+					v->samples = NULL;
+				}
+			}
+		}
+
+		if (active)
+		{
+			resolveMix(out, accumulator, block * 2);
+		}
+
+		out += block * 2;
+		frames -= block;
+	}
+}
+
+static void mixVoiceScalar(Sint32 *acc, const Sint16 *src, int n, Sint16 left, Sint16 right)
+{
+	int i;
+
+	for (i = 0 ; i + 1 < n ; i += 2)
+	{
+		acc[i] += (src[i] * left) >> MIXER_GAIN_SHIFT;
+		acc[i + 1] += (src[i + 1] * right) >> MIXER_GAIN_SHIFT;
+	}
+}
+
+static void resolveMixScalar(Sint16 *dst, const Sint32 *acc, int n)
+{
+	int i;
+
+	for (i = 0 ; i < n ; i++)
+	{
+		dst[i] = MIN(MAX(dst[i] + acc[i], -32768), 32767);
+	}
+}
+
+#ifdef __SSE2__
+
+// SSE2 kernels work on 4 stereo frames.
+// The 32 bits products are rebuilt from their low and high 16 bits halves.
+
+static void mixVoiceSSE2(Sint32 *acc, const Sint16 *src, int n, Sint16 left, Sint16 right)
+{
+	__m128i g, s, lo, hi, p0, p1;
+	int i;
+
+	g = _mm_set_epi16(right, left, right, left, right, left, right, left);
+
+	for (i = 0 ; i + 8 <= n ; i += 8)
+	{
+		s = _mm_loadu_si128((const __m128i *)(src + i));
+
+		lo = _mm_mullo_epi16(s, g);
+		hi = _mm_mulhi_epi16(s, g);
+
+		p0 = _mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), MIXER_GAIN_SHIFT);
+		p1 = _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), MIXER_GAIN_SHIFT);
+
+		_mm_storeu_si128((__m128i *)(acc + i), _mm_add_epi32(_mm_loadu_si128((__m128i *)(acc + i)), p0));
+		_mm_storeu_si128((__m128i *)(acc + i + 4), _mm_add_epi32(_mm_loadu_si128((__m128i *)(acc + i + 4)), p1));
+	}
+
+	mixVoiceScalar(acc + i, src + i, n - i, left, right);
+}
+
+static void resolveMixSSE2(Sint16 *dst, const Sint32 *acc, int n)
+{
+	__m128i a0, a1, d;
+	int i;
+
+	for (i = 0 ; i + 8 <= n ; i += 8)
+	{
+		d = _mm_loadu_si128((__m128i *)(dst + i));
+
+		// Sign extend the output samples to add them in 32 bits
+		a0 = _mm_add_epi32(_mm_loadu_si128((const __m128i *)(acc + i)), _mm_srai_epi32(_mm_unpacklo_epi16(d, d), 16));
+		a1 = _mm_add_epi32(_mm_loadu_si128((const __m128i *)(acc + i + 4)), _mm_srai_epi32(_mm_unpackhi_epi16(d, d), 16));
+
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(a0, a1));
+	}
+
+	resolveMixScalar(dst + i, acc + i, n - i);
+}
+
+#endif
+
+#ifdef MIXER_AVX2
+
+// AVX2 kernels work like the SSE2 ones on 8 stereo frames. Unpack and pack
+// instructions work inside 128 bits lanes, so the samples order is restored
+// with a lane permutation.
+
+__attribute__((target("avx2")))
+static void mixVoiceAVX2(Sint32 *acc, const Sint16 *src, int n, Sint16 left, Sint16 right)
+{
+	__m256i g, s, lo, hi, p0, p1;
+	int i;
+
+	g = _mm256_set1_epi32(((Uint16)right << 16) | (Uint16)left);
+
+	for (i = 0 ; i + 16 <= n ; i += 16)
+	{
+		s = _mm256_loadu_si256((const __m256i *)(src + i));
+
+		lo = _mm256_mullo_epi16(s, g);
+		hi = _mm256_mulhi_epi16(s, g);
+
+		// Lane 0 holds samples 0-7 and lane 1 samples 8-15: reorder the products
+		p0 = _mm256_srai_epi32(_mm256_unpacklo_epi16(lo, hi), MIXER_GAIN_SHIFT);
+		p1 = _mm256_srai_epi32(_mm256_unpackhi_epi16(lo, hi), MIXER_GAIN_SHIFT);
+
+		_mm256_storeu_si256((__m256i *)(acc + i), _mm256_add_epi32(_mm256_loadu_si256((__m256i *)(acc + i)), _mm256_permute2x128_si256(p0, p1, 0x20)));
+		_mm256_storeu_si256((__m256i *)(acc + i + 8), _mm256_add_epi32(_mm256_loadu_si256((__m256i *)(acc + i + 8)), _mm256_permute2x128_si256(p0, p1, 0x31)));
+	}
+
+	_mm256_zeroupper();
+
+	mixVoiceScalar(acc + i, src + i, n - i, left, right);
+}
+
+__attribute__((target("avx2")))
+static void resolveMixAVX2(Sint16 *dst, const Sint32 *acc, int n)
+{
+	__m256i a0, a1;
+	int i;
+
+	for (i = 0 ; i + 16 <= n ; i += 16)
+	{
+		a0 = _mm256_add_epi32(_mm256_loadu_si256((const __m256i *)(acc + i)), _mm256_cvtepi16_epi32(_mm_loadu_si128((__m128i *)(dst + i))));
+		a1 = _mm256_add_epi32(_mm256_loadu_si256((const __m256i *)(acc + i + 8)), _mm256_cvtepi16_epi32(_mm_loadu_si128((__m128i *)(dst + i + 8))));
+
+		// Packing works per lane: restore the samples order
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_permute4x64_epi64(_mm256_packs_epi32(a0, a1), _MM_SHUFFLE(3, 1, 2, 0)));
+	}
+
+	_mm256_zeroupper();
+
+	resolveMixScalar(dst + i, acc + i, n - i);
+}
+
+#endif
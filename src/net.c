@@ -0,0 +1,626 @@
+/*
+    Copyright (C) 2021 Vincent Radé
+    Copyright (C) 2015-2018 Parallel Realities
+
+    Nature Invaders is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Nature Invaders is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Nature Invaders. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include "net.h"
+
+static void endNet(void);
+static void flushPackets(void);
+static void netLogic(void);
+static int openSocket(int port);
+static int readPacket(Snapshot *packet, Uint8 *data, int size);
+static void receivePackets(void);
+static void rollback(void);
+static void sendInputs(void);
+static void sendPacket(Snapshot *packet);
+static void sendWelcome(void);
+static void simulate(int f);
+static void startPacket(Snapshot *packet, Uint8 *data, int type);
+static void waitPeer(void);
+
+static int sock = -1;
+static struct sockaddr_in peer;
+static char *peerAddress;      // Address of the host to join, NULL on the host
+static int hostPort;
+static int local;              // Index of the local player
+static Uint32 seed;            // Random state the stage starts with
+static void (*stageLogic)(void);
+static Uint32 lastReceive;
+
+static int frame;              // Next frame to simulate
+static int remoteFrame;        // Frames which have their remote input
+static int remoteAck;          // Local inputs received by the remote side
+static int rollbackFrame;      // First frame to simulate again, -1 when none
+static int resimFrame;         // Next frame of the current rollback to simulate again, -1 when none
+static double tickTime;        // Moving average of the time to simulate a frame, in ms
+static double restoreTime;     // Moving average of the time a rollback takes beyond its frames
+static int localInputs[NET_INPUT_RING];
+static int remoteInputs[NET_INPUT_RING];
+static int usedInputs[NET_INPUT_RING];  // Remote input each frame was simulated with
+static Snapshot snapshots[NET_SNAPSHOTS];
+
+static NetPacket queue[NET_QUEUE_SIZE];
+static int queueHead;
+static int queueSize;
+
+static int rollbacks;
+static int rollbackFrames;
+static int maxRollback;
+static double resimTime;
+static double maxResimTime;
+static int stalls;
+
+static int rollbackDepth;      // Frames of the current rollback
+static double rollbackTime;    // Time spent on the current rollback, in ms
+static int rollbackSlices;     // Display frames the current rollback took
+
+// Host a network game on a UDP port.
+void hostGame(int port)
+{
+	app.netplay = TRUE;
+	hostPort = port;
+}
+
+// Join the network game of a host, given as address:port.
+void joinGame(char *address)
+{
+	app.netplay = TRUE;
+	peerAddress = address;
+}
+
+// Start the network game.
+// Wait for the other player, then both start the same stage: the host sends the
+// formation size, the stress flag and the random state to the player who joins.
+// The host plays the first player, on the left.
+void startNet(void)
+{
+	if (!app.netplay)
+	{
+		return;
+	}
+
+	waitPeer();
+
+	app.numPlayers = MAX_PLAYERS;
+	local = (peerAddress == NULL) ? 0 : 1;
+
+	setRandomState(seed);
+
+	initStage();
+
+	stageLogic = app.delegate.logic;
+	app.delegate.logic = netLogic;
+
+	frame = 0;
+	remoteFrame = 0;
+	remoteAck = 0;
+	rollbackFrame = -1;
+	resimFrame = -1;
+	tickTime = 0;
+	restoreTime = 0;
+	lastReceive = SDL_GetTicks();
+}
+
+// Stop the network game when the program quits.
+void closeNet(void)
+{
+	if (sock >= 0)
+	{
+		endNet();
+	}
+}
+
+// Play a frame of the network game.
+// Apply the remote inputs received. When one differs from the input predicted for
+// its frame, restore the snapshot of that frame and simulate the frames again, before
+// this one is drawn. Then simulate the next frame with the local input and the
+// predicted remote one, which is the last one received. Wait when the remote inputs
+// are too far behind to roll back: a rollback must simulate its frames again within
+// NET_ROLLBACK_BUDGET, so when the frames take long, as on the stress stage, fewer
+// are simulated ahead. Simulate a second frame to catch up when the remote side is ahead.
+static void netLogic(void)
+{
+	int ticks, depth;
+
+	flushPackets();
+
+	receivePackets();
+
+	if (!SDL_TICKS_PASSED(SDL_GetTicks(), lastReceive + NET_TIMEOUT))
+	{
+		if (rollbackFrame >= 0 || resimFrame >= 0)
+		{
+			rollback();
+		}
+
+		depth = MAX(1, (int)((NET_ROLLBACK_BUDGET - restoreTime) / MAX(tickTime, NET_ROLLBACK_BUDGET / NET_MAX_ROLLBACK)));
+
+		for (ticks = 0; ticks < NET_MAX_TICKS && resimFrame < 0 && app.delegate.logic == netLogic; ticks++)
+		{
+			if (frame - remoteFrame >= depth)
+			{
+				stalls++;
+				break;
+			}
+
+			if (ticks > 0 && remoteFrame <= frame + 1)
+			{
+				break;
+			}
+
+			localInputs[frame % NET_INPUT_RING] = getKeyboardInput();
+
+			simulate(frame++);
+		}
+	}
+	else
+	{
+		printf("The other player left\n");
+
+		initHighscores();
+	}
+
+	if (app.delegate.logic != netLogic)
+	{
+		endNet();
+		return;
+	}
+
+	sendInputs();
+}
+
+// Simulate a frame with its inputs, after saving the state it starts from.
+// Average the time it takes, snapshot included.
+static void simulate(int f)
+{
+	Uint64 start;
+	double ms;
+	int i;
+
+	start = SDL_GetPerformanceCounter();
+
+	i = f % NET_INPUT_RING;
+
+	saveSnapshot(&snapshots[f % NET_SNAPSHOTS]);
+
+	if (f < remoteFrame)
+	{
+		usedInputs[i] = remoteInputs[i];
+	}
+	else
+	{
+		usedInputs[i] = (remoteFrame > 0) ? remoteInputs[(remoteFrame - 1) % NET_INPUT_RING] : 0;
+	}
+
+	app.inputs[local] = localInputs[i];
+	app.inputs[1 - local] = usedInputs[i];
+
+	stageLogic();
+
+	ms = (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+
+	tickTime += (ms - tickTime) / NET_TICK_AVERAGE;
+}
+
+// Restore the snapshot of the first mispredicted frame, and simulate the frames
+// again up to the current one, without sound. The frames left when the next one
+// would overrun NET_ROLLBACK_BUDGET are simulated again on the next display frames,
+// before any new frame.
+// Average the time a rollback takes beyond its frames, to size the next ones.
+// Report the depth of the rollback, the time spent simulating again, and the
+// display frames it took.
+static void rollback(void)
+{
+	Uint64 start;
+	double ms, last;
+	int ticks;
+
+	start = SDL_GetPerformanceCounter();
+
+	if (rollbackFrame >= 0)
+	{
+		loadSnapshot(&snapshots[rollbackFrame % NET_SNAPSHOTS]);
+
+		app.delegate.logic = netLogic;
+
+		if (resimFrame < 0)
+		{
+			rollbackDepth = 0;
+			rollbackTime = 0;
+			rollbackSlices = 0;
+		}
+
+		rollbackDepth += ((resimFrame < 0) ? frame : resimFrame) - rollbackFrame;
+		resimFrame = rollbackFrame;
+		rollbackFrame = -1;
+	}
+
+	app.rollback = TRUE;
+
+	last = 0;
+
+	for (ticks = 0; resimFrame < frame && app.delegate.logic == netLogic; ticks++)
+	{
+		ms = (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+
+		// The next frame takes about as long as the last one simulated again, and
+		// up to a quarter more
+		if (ticks > 0 && ms + MAX(tickTime, ms - last) * 1.25 > NET_ROLLBACK_BUDGET)
+		{
+			break;
+		}
+
+		last = ms;
+
+		simulate(resimFrame++);
+	}
+
+	app.rollback = FALSE;
+
+	ms = (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+
+	rollbackTime += ms;
+	rollbackSlices++;
+	maxResimTime = MAX(maxResimTime, ms);
+
+	if (resimFrame < frame && app.delegate.logic == netLogic)
+	{
+		return;
+	}
+
+	resimFrame = -1;
+
+	if (rollbacks == 0)
+	{
+		printf("frame,rollback_depth,resim_ms,frames\n");
+	}
+
+	printf("%d,%d,%.3f,%d\n", frame, rollbackDepth, rollbackTime, rollbackSlices);
+
+	// Restoring the snapshot, and the frames running slower on the restored state
+	restoreTime += (MAX(0, rollbackTime - rollbackDepth * tickTime) - restoreTime) / NET_TICK_AVERAGE;
+
+	rollbacks++;
+	rollbackFrames += rollbackDepth;
+	maxRollback = MAX(maxRollback, rollbackDepth);
+	resimTime += rollbackTime;
+}
+
+// Receive the packets of the other player.
+// The remote inputs are taken in frame order, the packets repeat the inputs
+// which aren't acknowledged, so a lost packet is covered by the next ones.
+static void receivePackets(void)
+{
+	Uint8 data[NET_MAX_PACKET];
+	struct sockaddr_in from;
+	socklen_t length;
+	Snapshot packet;
+	int size, ack, first, count, input, g, k;
+
+	length = sizeof(from);
+
+	while ((size = recvfrom(sock, data, NET_MAX_PACKET, 0, (struct sockaddr *)&from, &length)) > 0)
+	{
+		length = sizeof(from);
+
+		if (from.sin_addr.s_addr != peer.sin_addr.s_addr || from.sin_port != peer.sin_port)
+		{
+			continue;
+		}
+
+		lastReceive = SDL_GetTicks();
+
+		switch (readPacket(&packet, data, size))
+		{
+		case NET_HELLO:
+			// The welcome of the host was lost
+			if (peerAddress == NULL)
+			{
+				sendWelcome();
+			}
+			break;
+
+		case NET_INPUTS:
+			ack = readSnapshotInt(&packet, 4);
+			first = readSnapshotInt(&packet, 4);
+			count = readSnapshotRange(&packet, 1, 0, NET_MAX_PACKET_INPUTS);
+
+			remoteAck = MAX(remoteAck, MIN(ack, frame));
+
+			for (k = 0; k < count; k++)
+			{
+				g = first + k;
+				input = readSnapshotInt(&packet, 1) & 0xFF;
+
+				if (g != remoteFrame || g - frame >= NET_INPUT_RING - NET_MAX_ROLLBACK)
+				{
+					continue;
+				}
+
+				remoteInputs[g % NET_INPUT_RING] = input;
+				remoteFrame++;
+
+				// The frames of a rollback not simulated again yet get the input anyway
+				if (g < frame && usedInputs[g % NET_INPUT_RING] != input && rollbackFrame < 0
+				    && (resimFrame < 0 || g < resimFrame))
+				{
+					rollbackFrame = g;
+				}
+			}
+			break;
+
+		default:
+			break;
+		}
+	}
+}
+
+// Send the local inputs the remote side didn't acknowledge, from the oldest one,
+// with the number of remote inputs received.
+static void sendInputs(void)
+{
+	Uint8 data[NET_MAX_PACKET];
+	Snapshot packet;
+	int g, count;
+
+	count = MIN(frame - remoteAck, NET_MAX_PACKET_INPUTS);
+
+	startPacket(&packet, data, NET_INPUTS);
+	writeSnapshotInt(&packet, remoteFrame, 4);
+	writeSnapshotInt(&packet, remoteAck, 4);
+	writeSnapshotInt(&packet, count, 1);
+
+	for (g = remoteAck; g < remoteAck + count; g++)
+	{
+		writeSnapshotInt(&packet, localInputs[g % NET_INPUT_RING], 1);
+	}
+
+	sendPacket(&packet);
+}
+
+static void sendWelcome(void)
+{
+	Uint8 data[NET_MAX_PACKET];
+	Snapshot packet;
+
+	startPacket(&packet, data, NET_WELCOME);
+	writeSnapshotInt(&packet, app.formationRows, 1);
+	writeSnapshotInt(&packet, app.formationCols, 1);
+	writeSnapshotInt(&packet, app.stress, 1);
+	writeSnapshotInt(&packet, seed, 4);
+
+	sendPacket(&packet);
+}
+
+// Start a packet of the given type in a buffer of NET_MAX_PACKET bytes.
+// Packets start with NET_MAGIC and the snapshot version, so a game only talks to
+// builds which simulate the same state.
+static void startPacket(Snapshot *packet, Uint8 *data, int type)
+{
+	memset(packet, 0, sizeof(Snapshot));
+	packet->data = data;
+	packet->capacity = NET_MAX_PACKET;
+
+	writeSnapshot(packet, NET_MAGIC, 4);
+	writeSnapshotInt(packet, SNAPSHOT_VERSION, 4);
+	writeSnapshotInt(packet, type, 1);
+}
+
+// Read the start of a received packet, and return its type.
+// Return 0 when the packet doesn't start with NET_MAGIC and the snapshot version.
+static int readPacket(Snapshot *packet, Uint8 *data, int size)
+{
+	packet->data = data;
+	packet->size = size;
+	packet->position = 4;
+
+	if (size < 9 || memcmp(data, NET_MAGIC, 4) != 0 || readSnapshotInt(packet, 4) != SNAPSHOT_VERSION)
+	{
+		return 0;
+	}
+
+	return readSnapshotInt(packet, 1);
+}
+
+// Send a packet to the other player.
+// To test the rollbacks on one host, a part of the packets is dropped, and the
+// others are held back by the latency given on the command line.
+static void sendPacket(Snapshot *packet)
+{
+	NetPacket *p;
+
+	if (app.netLoss > 0 && rand() % 100 < app.netLoss)
+	{
+		return;
+	}
+
+	if (app.netLatency <= 0)
+	{
+		sendto(sock, packet->data, packet->size, 0, (struct sockaddr *)&peer, sizeof(peer));
+		return;
+	}
+
+	if (queueSize == NET_QUEUE_SIZE)
+	{
+		return;
+	}
+
+	p = &queue[(queueHead + queueSize++) % NET_QUEUE_SIZE];
+	p->time = SDL_GetTicks() + app.netLatency;
+	p->size = packet->size;
+	memcpy(p->data, packet->data, packet->size);
+}
+
+// Send the packets held back whose latency is over.
+static void flushPackets(void)
+{
+	NetPacket *p;
+
+	while (queueSize > 0 && SDL_TICKS_PASSED(SDL_GetTicks(), queue[queueHead].time))
+	{
+		p = &queue[queueHead];
+
+		sendto(sock, p->data, p->size, 0, (struct sockaddr *)&peer, sizeof(peer));
+
+		queueHead = (queueHead + 1) % NET_QUEUE_SIZE;
+		queueSize--;
+	}
+}
+
+// Wait for the other player.
+// The host waits for a hello and answers with the settings of the game. The
+// player who joins sends a hello every 100 ms until the welcome arrives.
+static void waitPeer(void)
+{
+	Uint8 data[NET_MAX_PACKET], helloData[NET_MAX_PACKET];
+	struct addrinfo hints, *address;
+	struct sockaddr_in from;
+	socklen_t length;
+	Snapshot packet, hello;
+	Uint32 deadline, nextHello;
+	char host[MAX_NAME_LENGTH], *colon;
+	int size, type;
+
+	memset(&peer, 0, sizeof(peer));
+
+	if (peerAddress != NULL)
+	{
+		STRNCPY(host, peerAddress, MAX_NAME_LENGTH);
+		colon = strrchr(host, ':');
+
+		if (colon == NULL)
+		{
+			printf("Give the address of the host as address:port\n");
+			exit(1);
+		}
+
+		*colon = '\0';
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_DGRAM;
+
+		if (getaddrinfo(host, colon + 1, &hints, &address) != 0)
+		{
+			printf("Couldn't find the host %s\n", peerAddress);
+			exit(1);
+		}
+
+		memcpy(&peer, address->ai_addr, sizeof(peer));
+		freeaddrinfo(address);
+	}
+
+	sock = openSocket((peerAddress == NULL) ? hostPort : 0);
+
+	if (peerAddress == NULL)
+	{
+		printf("Waiting for the other player on port %d\n", hostPort);
+	}
+	else
+	{
+		printf("Joining %s\n", peerAddress);
+	}
+
+	startPacket(&hello, helloData, NET_HELLO);
+
+	deadline = SDL_GetTicks() + NET_TIMEOUT;
+	nextHello = 0;
+
+	while (!SDL_TICKS_PASSED(SDL_GetTicks(), deadline))
+	{
+		doInput();
+
+		if (peerAddress != NULL && SDL_TICKS_PASSED(SDL_GetTicks(), nextHello))
+		{
+			sendto(sock, hello.data, hello.size, 0, (struct sockaddr *)&peer, sizeof(peer));
+			nextHello = SDL_GetTicks() + 100;
+		}
+
+		length = sizeof(from);
+		size = recvfrom(sock, data, NET_MAX_PACKET, 0, (struct sockaddr *)&from, &length);
+
+		if (size <= 0)
+		{
+			SDL_Delay(10);
+			continue;
+		}
+
+		type = readPacket(&packet, data, size);
+
+		if (peerAddress == NULL && type == NET_HELLO)
+		{
+			peer = from;
+			seed = SDL_GetPerformanceCounter() | 1;
+
+			sendWelcome();
+			return;
+		}
+
+		if (peerAddress != NULL && type == NET_WELCOME)
+		{
+			app.formationRows = readSnapshotRange(&packet, 1, 1, MAX_FORMATION_ROWS);
+			app.formationCols = readSnapshotRange(&packet, 1, 1, MAX_FORMATION_COLS);
+			app.stress = readSnapshotInt(&packet, 1);
+			seed = readSnapshotInt(&packet, 4);
+			return;
+		}
+	}
+
+	printf("The other player didn't come\n");
+	exit(1);
+}
+
+// Open a non-blocking UDP socket on a port, 0 for any port.
+static int openSocket(int port)
+{
+	struct sockaddr_in address;
+	int s;
+
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(port);
+
+	if (s < 0 || bind(s, (struct sockaddr *)&address, sizeof(address)) < 0)
+	{
+		printf("Couldn't open UDP port %d\n", port);
+		exit(1);
+	}
+
+	fcntl(s, F_SETFL, O_NONBLOCK);
+
+	return s;
+}
+
+// End the network game, and report its rollbacks.
+// The game goes on for the local player alone.
+static void endNet(void)
+{
+	printf("%d frames, %d rollbacks (%.1f%% of frames), %.1f frames deep on average, %d at most, "
+	       "simulated again in %.3f ms on average, %.3f ms at most in a frame, %d frames waiting for the other player\n",
+	       frame, rollbacks, frame > 0 ? 100.0 * rollbacks / frame : 0, rollbacks > 0 ? (double)rollbackFrames / rollbacks : 0,
+	       maxRollback, rollbacks > 0 ? resimTime / rollbacks : 0, maxResimTime, stalls);
+
+	close(sock);
+	sock = -1;
+
+	app.netplay = FALSE;
+	app.numPlayers = 1;
+}
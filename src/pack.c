@@ -0,0 +1,150 @@
+/*
+    Copyright (C) 2021 Vincent Radé
+    Copyright (C) 2015-2018 Parallel Realities
+
+    Nature Invaders is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Nature Invaders is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Nature Invaders. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include "pack.h"
+
+static int comparePackEntry(const void *a, const void *b);
+
+static Uint8 *pack;
+static size_t packSize;
+static PackHeader *header;
+static PackEntry *entries;
+
+void closePack(void)
+{
+	if (pack != NULL)
+	{
+		munmap(pack, packSize);
+	}
+
+	pack = NULL;
+	header = NULL;
+	entries = NULL;
+}
+
+// Open the asset pack.
+// Map the pack file in memory, then check its header and its table of contents.
+// Assets are created later directly from the mapped memory, without decoding.
+// When there is no valid pack, assets are loaded from their files.
+int openPack(char *filename)
+{
+	struct stat st;
+	void *data;
+	int fd, i;
+
+	fd = open(filename, O_RDONLY);
+
+	if (fd < 0)
+	{
+		SDL_LogMessage(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO, "No asset pack %s, loading asset files", filename);
+		return FALSE;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(PackHeader))
+	{
+		close(fd);
+		return FALSE;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (data == MAP_FAILED)
+	{
+		return FALSE;
+	}
+
+	// Every asset is read at startup, ask the kernel to read ahead the whole file
+	madvise(data, st.st_size, MADV_WILLNEED);
+
+	pack = data;
+	packSize = st.st_size;
+	header = data;
+	entries = (PackEntry *)(pack + sizeof(PackHeader));
+
+	if (memcmp(header->magic, PACK_MAGIC, sizeof(header->magic)) != 0
+	    || header->version != PACK_VERSION
+	    || sizeof(PackHeader) + (size_t)header->numEntries * sizeof(PackEntry) > packSize)
+	{
+		SDL_LogMessage(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_WARN, "Ignoring invalid asset pack %s", filename);
+		closePack();
+		return FALSE;
+	}
+
+	for (i = 0 ; i < header->numEntries ; i++)
+	{
+		if ((size_t)entries[i].offset + entries[i].size > packSize)
+		{
+			SDL_LogMessage(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_WARN, "Ignoring truncated asset pack %s", filename);
+			closePack();
+			return FALSE;
+		}
+	}
+
+	SDL_LogMessage(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO, "Mapped asset pack %s, %d assets", filename, header->numEntries);
+
+	return TRUE;
+}
+
+// Find an asset in the pack.
+// The table of contents is sorted by name, so it is searched by dichotomy.
+// Return NULL if there is no pack, or no asset of this type with this name.
+PackEntry *findPackEntry(char *name, int type)
+{
+	PackEntry key, *entry;
+
+	if (pack == NULL)
+	{
+		return NULL;
+	}
+
+	STRNCPY(key.name, name, MAX_PACK_NAME_LENGTH);
+
+	entry = bsearch(&key, entries, header->numEntries, sizeof(PackEntry), comparePackEntry);
+
+	return (entry != NULL && entry->type == type) ? entry : NULL;
+}
+
+// Find a sound in the pack.
+// Sounds are stored as PCM samples in the mixer format, they can be used
+// only if the mixer opened the audio device with the same format.
+PackEntry *findPackSound(char *name)
+{
+	int frequency, channels;
+	Uint16 format;
+
+	if (pack == NULL
+	    || !Mix_QuerySpec(&frequency, &format, &channels)
+	    || frequency != header->frequency || format != header->format || channels != header->channels)
+	{
+		return NULL;
+	}
+
+	return findPackEntry(name, PACK_SOUND);
+}
+
+void *getPackData(PackEntry *entry)
+{
+	return pack + entry->offset;
+}
+
+static int comparePackEntry(const void *a, const void *b)
+{
+	return strcmp(((PackEntry *)a)->name, ((PackEntry *)b)->name);
+}
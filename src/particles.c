@@ -0,0 +1,289 @@
+/*
+    Copyright (C) 2021 Vincent Radé
+    Copyright (C) 2015-2018 Parallel Realities
+
+    Nature Invaders is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Nature Invaders is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Nature Invaders. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include "particles.h"
+
+static void nextRandomScalar(Uint32 *dst);
+static void removeParticle(int i);
+static void uniformFloats(float *dst, int n, float base, float range);
+#ifdef __SSE2__
+static void uniformFloatsSSE2(float *dst, int n, float base, float range);
+#endif
+
+// Particles are stored as structure of arrays, so a burst writes each field
+// in a contiguous run, and the update loop reads only what it needs.
+static float px[MAX_PARTICLES];
+static float py[MAX_PARTICLES];
+static float pdx[MAX_PARTICLES];
+static float pdy[MAX_PARTICLES];
+static Uint32 pcolor[MAX_PARTICLES];
+static int plife[MAX_PARTICLES];
+static int numParticles;
+
+// Random numbers for the bursts.
+// Four independent xorshift generators, one per SIMD lane. The scalar and the
+// SSE2 kernels step them the same way, so they give the same numbers.
+static Uint32 lanes[PARTICLE_LANES];
+static float randoms[MAX_PARTICLES];
+
+// Fill 'n' floats with base + range * u, where u is uniform in [0, 1).
+static void (*fillUniform)(float *dst, int n, float base, float range);
+
+void initParticles(void)
+{
+	int i;
+
+	// Any non zero seed, different for every lane
+	for (i = 0 ; i < PARTICLE_LANES ; i++)
+	{
+		lanes[i] = 0x9E3779B9 * (i + 1);
+	}
+
+	fillUniform = uniformFloats;
+
+#ifdef __SSE2__
+	if (SDL_HasSSE2())
+	{
+		fillUniform = uniformFloatsSSE2;
+	}
+#endif
+
+	numParticles = 0;
+}
+
+// Emit a burst of particles.
+// Every random field is generated for the whole burst in one pass, written in
+// the particle storage, and only the colors are picked one by one from the palette.
+// The burst is cut when the storage is full.
+void addParticles(ParticleBurst *burst, int num)
+{
+	float *x, *y, *dx, *dy;
+	int i, n;
+
+	n = MIN(num, MAX_PARTICLES - numParticles);
+
+	if (n <= 0)
+	{
+		return;
+	}
+
+	x = &px[numParticles];
+	y = &py[numParticles];
+	dx = &pdx[numParticles];
+	dy = &pdy[numParticles];
+
+	fillUniform(x, n, burst->x - burst->spread, burst->spread * 2);
+	fillUniform(y, n, burst->y - burst->spread, burst->spread * 2);
+	fillUniform(dx, n, -burst->speed, burst->speed * 2);
+	fillUniform(dy, n, -burst->speed, burst->speed * 2);
+
+	fillUniform(randoms, n, burst->minLife, burst->maxLife - burst->minLife + 1);
+
+	for (i = 0 ; i < n ; i++)
+	{
+		plife[numParticles + i] = MAX(1, (int)randoms[i]);
+	}
+
+	fillUniform(randoms, n, 0, burst->numColors);
+
+	for (i = 0 ; i < n ; i++)
+	{
+		pcolor[numParticles + i] = burst->palette[(int)randoms[i]];
+	}
+
+	numParticles += n;
+}
+
+// Move the particles, and remove them when their life is over.
+void doParticles(void)
+{
+	int i;
+
+	for (i = 0 ; i < numParticles ; i++)
+	{
+		px[i] += pdx[i];
+		py[i] += pdy[i];
+
+		if (--plife[i] <= 0)
+		{
+			removeParticle(i--);
+		}
+	}
+}
+
+// Draw the particles.
+// The particles are added to the scene, their opacity fades with their life.
+void drawParticles(SDL_Texture *texture)
+{
+	Uint32 c;
+	int i;
+
+	SDL_SetRenderDrawBlendMode(app.renderer, SDL_BLENDMODE_ADD);
+	SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_ADD);
+
+	for (i = 0 ; i < numParticles ; i++)
+	{
+		c = pcolor[i];
+
+		SDL_SetTextureColorMod(texture, (c >> 16) & 0xFF, (c >> 8) & 0xFF, c & 0xFF);
+		SDL_SetTextureAlphaMod(texture, MIN(plife[i], 255));
+
+		blit(texture, px[i], py[i]);
+	}
+
+	SDL_SetRenderDrawBlendMode(app.renderer, SDL_BLENDMODE_NONE);
+}
+
+void clearParticles(void)
+{
+	numParticles = 0;
+}
+
+int getParticleCount(void)
+{
+	return numParticles;
+}
+
+// Save the particles and the state of their generators in a snapshot.
+void saveParticles(Snapshot *s)
+{
+	int i;
+
+	for (i = 0 ; i < PARTICLE_LANES ; i++)
+	{
+		writeSnapshotInt(s, lanes[i], 4);
+	}
+
+	writeSnapshotInt(s, numParticles, 4);
+
+	for (i = 0 ; i < numParticles ; i++)
+	{
+		writeSnapshotFloat(s, px[i]);
+		writeSnapshotFloat(s, py[i]);
+		writeSnapshotFloat(s, pdx[i]);
+		writeSnapshotFloat(s, pdy[i]);
+		writeSnapshotInt(s, pcolor[i], 3);
+		writeSnapshotInt(s, plife[i], 2);
+	}
+}
+
+void loadParticles(Snapshot *s)
+{
+	int i;
+
+	for (i = 0 ; i < PARTICLE_LANES ; i++)
+	{
+		lanes[i] = readSnapshotInt(s, 4);
+	}
+
+	numParticles = readSnapshotRange(s, 4, 0, MAX_PARTICLES);
+
+	for (i = 0 ; i < numParticles ; i++)
+	{
+		px[i] = readSnapshotFloat(s);
+		py[i] = readSnapshotFloat(s);
+		pdx[i] = readSnapshotFloat(s);
+		pdy[i] = readSnapshotFloat(s);
+		pcolor[i] = readSnapshotInt(s, 3) & 0xFFFFFF;
+		plife[i] = readSnapshotInt(s, 2);
+	}
+}
+
+// Remove a particle by moving the last one in its place.
+// The particles are added to the scene, so their order doesn't matter.
+static void removeParticle(int i)
+{
+	numParticles--;
+
+	px[i] = px[numParticles];
+	py[i] = py[numParticles];
+	pdx[i] = pdx[numParticles];
+	pdy[i] = pdy[numParticles];
+	pcolor[i] = pcolor[numParticles];
+	plife[i] = plife[numParticles];
+}
+
+// Step the four generators.
+static void nextRandomScalar(Uint32 *dst)
+{
+	int i;
+
+	for (i = 0 ; i < PARTICLE_LANES ; i++)
+	{
+		lanes[i] ^= lanes[i] << 13;
+		lanes[i] ^= lanes[i] >> 17;
+		lanes[i] ^= lanes[i] << 5;
+
+		dst[i] = lanes[i];
+	}
+}
+
+// The 24 upper bits of the random numbers are converted to floats exactly.
+static void uniformFloats(float *dst, int n, float base, float range)
+{
+	Uint32 r[PARTICLE_LANES];
+	int i, j;
+
+	for (i = 0 ; i < n ; i += PARTICLE_LANES)
+	{
+		nextRandomScalar(r);
+
+		for (j = 0 ; j < PARTICLE_LANES && i + j < n ; j++)
+		{
+			dst[i + j] = base + range * ((float)(int)(r[j] >> 8) * (1.0f / 16777216));
+		}
+	}
+}
+
+#ifdef __SSE2__
+static void uniformFloatsSSE2(float *dst, int n, float base, float range)
+{
+	__m128i s, t;
+	__m128 u, b, k;
+	float tail[PARTICLE_LANES];
+	int i;
+
+	s = _mm_loadu_si128((__m128i *)lanes);
+	b = _mm_set1_ps(base);
+	k = _mm_set1_ps(range);
+
+	for (i = 0 ; i < n ; i += PARTICLE_LANES)
+	{
+		s = _mm_xor_si128(s, _mm_slli_epi32(s, 13));
+		s = _mm_xor_si128(s, _mm_srli_epi32(s, 17));
+		s = _mm_xor_si128(s, _mm_slli_epi32(s, 5));
+
+		t = _mm_srli_epi32(s, 8);
+		u = _mm_mul_ps(_mm_cvtepi32_ps(t), _mm_set1_ps(1.0f / 16777216));
+		u = _mm_add_ps(b, _mm_mul_ps(k, u));
+
+		if (i + PARTICLE_LANES <= n)
+		{
+			_mm_storeu_ps(&dst[i], u);
+		}
+		else
+		{
+			_mm_storeu_ps(tail, u);
+			memcpy(&dst[i], tail, (n - i) * sizeof(float));
+		}
+	}
+
+	_mm_storeu_si128((__m128i *)lanes, s);
+}
+#endif
@@ -0,0 +1,33 @@
+/*
+    Copyright (C) 2021 Vincent Radé
+    Copyright (C) 2015-2018 Parallel Realities
+
+    Nature Invaders is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Nature Invaders is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Nature Invaders. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include "common.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+extern void blit(SDL_Texture *texture, int x, int y);
+extern float readSnapshotFloat(Snapshot *s);
+extern int readSnapshotInt(Snapshot *s, int bytes);
+extern int readSnapshotRange(Snapshot *s, int bytes, int min, int max);
+extern void writeSnapshotFloat(Snapshot *s, float value);
+extern void writeSnapshotInt(Snapshot *s, int value, int bytes);
+
+extern App app;
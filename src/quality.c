@@ -0,0 +1,167 @@
+/*
+    Copyright (C) 2021 Vincent Radé
+    Copyright (C) 2015-2018 Parallel Realities
+
+    Nature Invaders is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Nature Invaders is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Nature Invaders. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include "quality.h"
+
+static void resetWindow(void);
+
+// Cosmetic settings of each quality level, from the full quality.
+// Particles per explosion and debris lifetime are fractions of the full ones,
+// the background moves every 'scrollRate' frames, and the scene is composed
+// at a fraction of the internal resolution.
+static Quality levels[QUALITY_LEVELS] = {
+	{1,     1,    1, 1},
+	{0.5,   1,    1, 1},
+	{0.25,  0.5,  1, 1},
+	{0.25,  0.5,  2, 0.75},
+	{0.125, 0.25, 2, 0.5}
+};
+
+static double frameTimes[QUALITY_WINDOW];
+static double total;
+static int count;
+static int hold;
+static int headroom;
+static char decision[MAX_LINE_LENGTH];
+
+Quality *getQuality(void)
+{
+	return &levels[app.quality];
+}
+
+// Set the quality level.
+// Lowering the resolution needs the offscreen scene, which is created on first use.
+// The software framebuffer has a fixed resolution and keeps it.
+void setQuality(int level)
+{
+	app.quality = MIN(MAX(level, 0), QUALITY_LEVELS - 1);
+
+	app.sceneScale = (app.software) ? 1 : levels[app.quality].sceneScale;
+
+	if (app.sceneScale < 1)
+	{
+		initScene();
+	}
+
+	app.redraw = TRUE;
+}
+
+// Govern the quality from the frame time.
+// 'ms' is the time spent on the frame, without the wait for the next one.
+// When the average of the last frames is over the budget, lower the quality by
+// one level, then wait a second for the change to show in the frame time.
+// Raise it again only after three seconds well under the budget, so the quality
+// doesn't swing between two levels. Only cosmetic settings change.
+void updateQuality(double ms)
+{
+	double average, budget;
+	int level;
+
+	total += ms - frameTimes[count % QUALITY_WINDOW];
+	frameTimes[count++ % QUALITY_WINDOW] = ms;
+
+	if (count < QUALITY_WINDOW)
+	{
+		return;
+	}
+
+	// Refresh the overlay with the new average
+	if (app.overlay && count % QUALITY_WINDOW == 0)
+	{
+		app.redraw = TRUE;
+	}
+
+	if (app.fixedQuality)
+	{
+		return;
+	}
+
+	if (hold > 0)
+	{
+		hold--;
+		return;
+	}
+
+	average = total / QUALITY_WINDOW;
+	budget = 1000.0 / FPS;
+	level = app.quality;
+
+	if (average > budget * QUALITY_OVER)
+	{
+		headroom = 0;
+
+		if (level < QUALITY_LEVELS - 1)
+		{
+			level++;
+		}
+	}
+	else if (average < budget * QUALITY_UNDER)
+	{
+		if (++headroom >= QUALITY_RECOVER && level > 0)
+		{
+			level--;
+		}
+	}
+	else
+	{
+		headroom = 0;
+	}
+
+	if (level == app.quality)
+	{
+		return;
+	}
+
+	snprintf(decision, MAX_LINE_LENGTH, "%s TO %d AT %.1f MS", (level > app.quality) ? "DOWN" : "UP", level, average);
+
+	SDL_LogMessage(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO, "Quality %d -> %d, average frame time %.2f ms for a %.2f ms budget",
+		       app.quality, level, average, budget);
+
+	setQuality(level);
+
+	hold = QUALITY_HOLD;
+	headroom = 0;
+
+	resetWindow();
+}
+
+// Draw the quality level, the average frame time and the last decision over the scene.
+void drawQualityOverlay(void)
+{
+	if (!app.overlay)
+	{
+		return;
+	}
+
+	drawText(SCREEN_WIDTH - 10, 10, 255, 255, 0, TEXT_RIGHT, "Q%d%s %.1f MS", app.quality, (app.fixedQuality) ? " FIXED" : "",
+		 (count > 0) ? total / MIN(count, QUALITY_WINDOW) : 0.0);
+
+	if (decision[0] != '\0')
+	{
+		drawText(SCREEN_WIDTH - 10, 10 + GLYPH_HEIGHT, 255, 255, 0, TEXT_RIGHT, "%s", decision);
+	}
+}
+
+// Forget the frame times measured before a level change.
+static void resetWindow(void)
+{
+	memset(frameTimes, 0, sizeof(frameTimes));
+	total = 0;
+	count = 0;
+}
@@ -0,0 +1,282 @@
+/*
+    Copyright (C) 2021 Vincent Radé
+    Copyright (C) 2015-2018 Parallel Realities
+
+    Nature Invaders is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Nature Invaders is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Nature Invaders. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include "replay.h"
+
+static void dumpPositions(void);
+static void finishReplay(void);
+static void writeReplay(void);
+
+static Snapshot replay;   // Header, start snapshot and recorded frames
+static Snapshot start;    // State of the game when the replay starts
+static char *filename;
+static int recording;
+static int playing;
+static int frame;
+static int version;       // REPLAY_ version of the replay played back
+static int diverged;      // The state diverged from the replay played back
+static FILE *dumpFile;
+
+static char *hashNames[NUM_HASHES] = {"player", "formation", "bullets", "shields", "stage", "random"};
+
+// Record the first stage played in a replay file.
+void recordReplay(char *file)
+{
+	filename = file;
+	recording = TRUE;
+}
+
+// Open a replay file to play it back.
+// The formation size and the stress stage of the recording are used, so the stage
+// is prepared the same way. The replays of version 1 are played too. Return FALSE
+// when the file isn't a replay of a known version.
+int openReplay(char *file)
+{
+	FILE *fp;
+	long size;
+
+	fp = fopen(file, "rb");
+
+	if (fp == NULL)
+	{
+		return FALSE;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	replay.data = malloc(MAX(size, 1));
+	replay.capacity = size;
+	replay.size = fread(replay.data, 1, size, fp);
+	replay.position = 4;
+
+	fclose(fp);
+
+	version = (replay.size >= 8) ? readSnapshotInt(&replay, 4) : 0;
+
+	if (memcmp(replay.data, REPLAY_MAGIC, 4) != 0 || version < 1 || version > REPLAY_VERSION)
+	{
+		freeSnapshot(&replay);
+		return FALSE;
+	}
+
+	app.formationRows = readSnapshotRange(&replay, 1, 1, MAX_FORMATION_ROWS);
+	app.formationCols = readSnapshotRange(&replay, 1, 1, MAX_FORMATION_COLS);
+	app.stress = readSnapshotInt(&replay, 1);
+
+	start.size = readSnapshotRange(&replay, 4, 0, replay.size - replay.position);
+	start.data = malloc(MAX(start.size, 1));
+	start.capacity = start.size;
+	readSnapshot(&replay, start.data, start.size);
+
+	playing = TRUE;
+
+	return TRUE;
+}
+
+// Write the position of every entity, at the end of every frame of the replay
+// played back, in a CSV file. The files written by the fixed point build and by
+// the float one are compared with tools/replaycmp.
+void dumpReplay(char *file)
+{
+	dumpFile = fopen(file, "w");
+
+	if (dumpFile == NULL)
+	{
+		printf("Couldn't write %s\n", file);
+		exit(1);
+	}
+
+	fprintf(dumpFile, "frame,id,x,y,dx,dy\n");
+}
+
+// Start playing the replay back, from the state saved when it was recorded.
+void startReplay(void)
+{
+	if (playing && !loadSnapshot(&start))
+	{
+		printf("Replay snapshot has another version\n");
+		exit(1);
+	}
+}
+
+// Start recording when the stage starts.
+// The replay holds the formation size, the stress flag and a snapshot of the stage.
+// Network games aren't recorded, their frames are simulated again on rollbacks.
+void startRecording(void)
+{
+	if (!recording || replay.size > 0 || app.netplay)
+	{
+		return;
+	}
+
+	saveSnapshot(&start);
+
+	writeSnapshot(&replay, REPLAY_MAGIC, 4);
+	writeSnapshotInt(&replay, REPLAY_VERSION, 4);
+	writeSnapshotInt(&replay, app.formationRows, 1);
+	writeSnapshotInt(&replay, app.formationCols, 1);
+	writeSnapshotInt(&replay, app.stress, 1);
+	writeSnapshotInt(&replay, start.size, 4);
+	writeSnapshot(&replay, start.data, start.size);
+
+	frame = 0;
+}
+
+// Record the input of the stage tick, or play the recorded one.
+void replayInput(void)
+{
+	if (recording && replay.size > 0)
+	{
+		writeSnapshotInt(&replay, app.inputs[0], 1);
+	}
+	else if (playing)
+	{
+		if (replay.position == replay.size)
+		{
+			finishReplay();
+		}
+
+		app.inputs[0] = readSnapshotInt(&replay, 1) & 0xFF;
+	}
+}
+
+// Record the state hashes at the end of the stage tick, or check them against the recorded ones.
+// On the first frame where a part of the state differs, report the frame and
+// every part which differs, and quit with an error. When the positions are dumped,
+// the replay goes on to its end, to compare them with the tolerance.
+// Replays of version 1 with a snapshot of version 3 hashed the float positions
+// by their bits, so only the stage globals and the random state are checked.
+void replayHashes(void)
+{
+	Uint32 hashes[NUM_HASHES];
+	int i, floatHashes, reported;
+
+	if (!(recording && replay.size > 0) && !playing)
+	{
+		return;
+	}
+
+	getStateHashes(hashes);
+
+	floatHashes = playing && version == 1 && start.version == SNAPSHOT_FLOAT_VERSION;
+	reported = diverged;
+
+	for (i = 0 ; i < NUM_HASHES ; i++)
+	{
+		if (recording)
+		{
+			writeSnapshotInt(&replay, hashes[i], 4);
+		}
+		else if ((Uint32)readSnapshotInt(&replay, 4) != hashes[i] && !reported
+		         && (!floatHashes || i == HASH_STAGE || i == HASH_RANDOM))
+		{
+			printf("Replay diverged at frame %d in the %s\n", frame, hashNames[i]);
+			diverged = TRUE;
+		}
+	}
+
+	if (diverged && dumpFile == NULL)
+	{
+		exit(1);
+	}
+
+	dumpPositions();
+
+	frame++;
+}
+
+// Stop the replay when the stage ends.
+void endReplay(void)
+{
+	closeReplay();
+
+	if (playing)
+	{
+		finishReplay();
+	}
+}
+
+// Quit at the end of the replay played back.
+// A playback which reached the end without divergence succeeded.
+static void finishReplay(void)
+{
+	if (dumpFile != NULL)
+	{
+		fclose(dumpFile);
+	}
+
+	if (!diverged)
+	{
+		printf("Replay played %d frames without divergence\n", frame);
+	}
+
+	exit(diverged ? 1 : 0);
+}
+
+// Write the position and the velocity of every entity at the end of the frame, in pixels.
+static void dumpPositions(void)
+{
+	int n;
+
+	if (dumpFile == NULL)
+	{
+		return;
+	}
+
+	for (n = 0 ; n < world.size ; n++)
+	{
+		if (world.components[n] & COMPONENT_POSITION)
+		{
+			fprintf(dumpFile, "%d,%d,%.4f,%.4f,%.4f,%.4f\n", frame, getEntityId(n), FROM_PRECISE(world.x[n], world.fx[n]),
+			        FROM_PRECISE(world.y[n], world.fy[n]), FROM_VELOCITY(world.dx[n]), FROM_VELOCITY(world.dy[n]));
+		}
+	}
+}
+
+// Write the recording, once, when the stage ends or the game quits during the stage.
+void closeReplay(void)
+{
+	if (recording && replay.size > 0)
+	{
+		writeReplay();
+
+		recording = FALSE;
+	}
+}
+
+static void writeReplay(void)
+{
+	FILE *fp;
+
+	fp = fopen(filename, "wb");
+
+	if (fp == NULL || fwrite(replay.data, 1, replay.size, fp) != replay.size)
+	{
+		printf("Couldn't write replay %s\n", filename);
+	}
+
+	if (fp != NULL)
+	{
+		fclose(fp);
+	}
+
+	SDL_LogMessage(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO, "Recorded %d frames in %s", frame, filename);
+}
@@ -0,0 +1,248 @@
+/*
+    Copyright (C) 2021 Vincent Radé
+    Copyright (C) 2015-2018 Parallel Realities
+
+    Nature Invaders is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Nature Invaders is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Nature Invaders. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include "snapshot.h"
+
+static Uint8 *reserveSnapshot(Snapshot *s, int size);
+
+// Save the state of the game in a snapshot.
+// The snapshot holds a versioned header, then the stage, with its entities and
+// debris, and the particles. Pointers are saved as ids or indexes. The buffer of
+// the snapshot is kept, so saving again in the same snapshot doesn't allocate.
+void saveSnapshot(Snapshot *s)
+{
+	s->size = 0;
+
+	writeSnapshot(s, SNAPSHOT_MAGIC, 4);
+	writeSnapshotInt(s, SNAPSHOT_VERSION, 4);
+
+	saveStage(s);
+	saveParticles(s);
+}
+
+// Restore the state of the game from a snapshot, and play the stage.
+// Both the snapshots with float positions and with fixed point ones are restored,
+// rounded to the positions of this build. Return FALSE, without changing the game, when the
+// snapshot has another version.
+int loadSnapshot(Snapshot *s)
+{
+	s->position = 0;
+
+	if (s->size < 8 || memcmp(s->data, SNAPSHOT_MAGIC, 4) != 0)
+	{
+		return FALSE;
+	}
+
+	s->position = 4;
+	s->version = readSnapshotInt(s, 4);
+
+	if (s->version != SNAPSHOT_FIXED_VERSION && s->version != SNAPSHOT_FLOAT_VERSION)
+	{
+		return FALSE;
+	}
+
+	loadStage(s);
+	loadParticles(s);
+
+	return TRUE;
+}
+
+void freeSnapshot(Snapshot *s)
+{
+	free(s->data);
+
+	memset(s, 0, sizeof(Snapshot));
+}
+
+// Append bytes to a snapshot.
+void writeSnapshot(Snapshot *s, const void *data, int size)
+{
+	memcpy(reserveSnapshot(s, size), data, size);
+}
+
+// Append the 'bytes' low bytes of an integer, in little endian order.
+void writeSnapshotInt(Snapshot *s, int value, int bytes)
+{
+	Uint8 *b;
+	int i;
+
+	b = reserveSnapshot(s, bytes);
+
+	for (i = 0 ; i < bytes ; i++)
+	{
+		b[i] = (Uint32)value >> (i * 8);
+	}
+}
+
+void writeSnapshotFloat(Snapshot *s, float value)
+{
+	Uint32 bits;
+
+	memcpy(&bits, &value, 4);
+
+	writeSnapshotInt(s, bits, 4);
+}
+
+// Append a position or a velocity of an entity: 2 bytes in fixed point, or a
+// float in the float build, like in version 3.
+void writeSnapshotFixed(Snapshot *s, Fixed value)
+{
+#ifdef FLOAT_POSITIONS
+	writeSnapshotFloat(s, value);
+#else
+	writeSnapshotInt(s, value, 2);
+#endif
+}
+
+// Read bytes from a snapshot.
+// Reading past its end gives zeros, so a truncated snapshot never reads outside.
+void readSnapshot(Snapshot *s, void *data, int size)
+{
+	if (s->position + size > s->size)
+	{
+		memset(data, 0, size);
+		s->position = s->size;
+		return;
+	}
+
+	memcpy(data, s->data + s->position, size);
+	s->position += size;
+}
+
+// Read an integer of 'bytes' bytes, with its sign.
+int readSnapshotInt(Snapshot *s, int bytes)
+{
+	Uint8 *b;
+	Uint32 value;
+	int i;
+
+	if (s->position + bytes > s->size)
+	{
+		s->position = s->size;
+		return 0;
+	}
+
+	b = s->data + s->position;
+	s->position += bytes;
+
+	value = 0;
+
+	for (i = 0 ; i < bytes ; i++)
+	{
+		value |= (Uint32)b[i] << (i * 8);
+	}
+
+	// Extend the sign of the shorter integers
+	if (bytes < 4 && (b[bytes - 1] & 0x80))
+	{
+		value |= 0xFFFFFFFF << (bytes * 8);
+	}
+
+	return (int)value;
+}
+
+// Read an integer and keep it between 'min' and 'max', for the counts and the
+// indexes, so a damaged snapshot can't make the game read outside its arrays.
+int readSnapshotRange(Snapshot *s, int bytes, int min, int max)
+{
+	int value;
+
+	value = readSnapshotInt(s, bytes);
+
+	return MIN(MAX(value, min), max);
+}
+
+float readSnapshotFloat(Snapshot *s)
+{
+	Uint32 bits;
+	float value;
+
+	bits = readSnapshotInt(s, 4);
+	memcpy(&value, &bits, 4);
+
+	return value;
+}
+
+// Read a position of an entity, saved as a float by the snapshots of version 3,
+// and in FIXED_BITS fixed point by the later ones.
+Fixed readSnapshotFixed(Snapshot *s)
+{
+	if (s->version == SNAPSHOT_FLOAT_VERSION)
+	{
+		return TO_FIXED(readSnapshotFloat(s));
+	}
+
+#ifdef FLOAT_POSITIONS
+	return (float)readSnapshotInt(s, 2) / (1 << FIXED_BITS);
+#else
+	return readSnapshotInt(s, 2);
+#endif
+}
+
+// Read the fraction of a position, below the fixed point one, saved by the snapshots
+// of version 4. The float build has no fractions and skips it.
+Uint8 readSnapshotFraction(Snapshot *s)
+{
+	if (s->version == SNAPSHOT_FLOAT_VERSION)
+	{
+		return 0;
+	}
+
+#ifdef FLOAT_POSITIONS
+	readSnapshotInt(s, 1);
+
+	return 0;
+#else
+	return readSnapshotInt(s, 1) & 0xFF;
+#endif
+}
+
+// Read a velocity of an entity, saved as a float by the snapshots of version 3,
+// and in VELOCITY_BITS fixed point by the later ones.
+Fixed readSnapshotVelocity(Snapshot *s)
+{
+	if (s->version == SNAPSHOT_FLOAT_VERSION)
+	{
+		return TO_VELOCITY(readSnapshotFloat(s));
+	}
+
+#ifdef FLOAT_POSITIONS
+	return (float)readSnapshotInt(s, 2) / (1 << VELOCITY_BITS);
+#else
+	return readSnapshotInt(s, 2);
+#endif
+}
+
+// Make room for 'size' more bytes at the end of a snapshot, and return where they go.
+// The buffer doubles, so a snapshot saved again in the same buffer doesn't allocate.
+static Uint8 *reserveSnapshot(Snapshot *s, int size)
+{
+	Uint8 *data;
+
+	if (s->size + size > s->capacity)
+	{
+		s->capacity = MAX(s->size + size, s->capacity * 2);
+		s->data = realloc(s->data, s->capacity);
+	}
+
+	data = s->data + s->size;
+	s->size += size;
+
+	return data;
+}
@@ -0,0 +1,36 @@
+/*
+    Copyright (C) 2021 Vincent Radé
+    Copyright (C) 2015-2018 Parallel Realities
+
+    Nature Invaders is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Nature Invaders is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Nature Invaders. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include "common.h"
+
+extern void loadParticles(Snapshot *s);
+extern void loadStage(Snapshot *s);
+extern void readSnapshot(Snapshot *s, void *data, int size);
+extern Fixed readSnapshotFixed(Snapshot *s);
+extern Uint8 readSnapshotFraction(Snapshot *s);
+extern float readSnapshotFloat(Snapshot *s);
+extern int readSnapshotInt(Snapshot *s, int bytes);
+extern int readSnapshotRange(Snapshot *s, int bytes, int min, int max);
+extern Fixed readSnapshotVelocity(Snapshot *s);
+extern void saveParticles(Snapshot *s);
+extern void saveStage(Snapshot *s);
+extern void writeSnapshot(Snapshot *s, const void *data, int size);
+extern void writeSnapshotFixed(Snapshot *s, Fixed value);
+extern void writeSnapshotFloat(Snapshot *s, float value);
+extern void writeSnapshotInt(Snapshot *s, int value, int bytes);
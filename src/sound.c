@@ -19,22 +19,86 @@
 
 #include "sound.h"
 
-static void loadSounds(void);
+static int initAudio(void *data);
+static void setSound(int id, int channel, int maxVoices, int priority);
 
-static Mix_Chunk *sounds[SND_MAX];
+static Sound sounds[SND_MAX];
 static Mix_Music *music;
+static SDL_Thread *audioThread;
+static SDL_atomic_t audioReady;
+static SDL_sem *audioOpened;
+static int audioOpen;
+static int mixer;
 
+// Initialize sounds.
+// The title screen doesn't need the audio, so the audio device is opened and the
+// music is loaded on a background thread. The music starts when ready, and the
+// sounds are decoded by the loader once the device is open, see queueSounds().
 void initSounds(void)
 {
-	memset(sounds, 0, sizeof(Mix_Chunk*) * SND_MAX);
+	memset(sounds, 0, sizeof(Sound) * SND_MAX);
 	
 	music = NULL;
-	
-	loadSounds();
+
+	// Share the voices between the sounds.
+	// The player sounds beat the enemy ones, and enemy shots are the first to be stolen.
+	setSound(SND_PLAYER_FIRE, CH_PLAYER, 1, 2);
+	setSound(SND_ALIEN_FIRE, CH_ALIEN_FIRE, 3, 0);
+	setSound(SND_PLAYER_DIE, CH_PLAYER, 1, 3);
+	setSound(SND_ALIEN_DIE, CH_ANY, 4, 1);
+
+	audioOpened = SDL_CreateSemaphore(0);
+
+	audioThread = SDL_CreateThread(initAudio, "audio", NULL);
+
+	if (audioThread == NULL)
+	{
+		initAudio(NULL);
+	}
+}
+
+// Close the audio device before the sounds mapped from the asset pack are released.
+void destroySounds(void)
+{
+	if (audioThread != NULL)
+	{
+		SDL_WaitThread(audioThread, NULL);
+		audioThread = NULL;
+	}
+
+	if (SDL_AtomicGet(&audioReady))
+	{
+		closeMixer();
+		Mix_CloseAudio();
+		SDL_AtomicSet(&audioReady, FALSE);
+	}
+}
+
+// Queue the sounds in the loader, to decode them on its threads.
+// Queued after the title textures, so the loader threads waiting for the audio
+// device don't delay the title.
+void queueSounds(void)
+{
+	sounds[SND_PLAYER_FIRE].load = queueSound("sound/425209__velkstar__water-drop.wav");
+	sounds[SND_ALIEN_FIRE].load = queueSound("sound/468852__christianand__26-pestaneo-ruidoso.wav");
+	sounds[SND_PLAYER_DIE].load = queueSound("sound/541887__d4xx__pop-up-sound.ogg");
+	sounds[SND_ALIEN_DIE].load = queueSound("sound/396270__eflexmusic__exploding-car-with-fire-mixed.ogg");
+}
+
+// Wait until the audio thread has tried to open the audio device.
+// Return TRUE when it is open. Called by the loader threads decoding the sounds.
+int waitAudioDevice(void)
+{
+	SDL_SemWait(audioOpened);
+	SDL_SemPost(audioOpened);
+
+	return audioOpen;
 }
 
 void loadMusic(char *filename)
 {
+	PackEntry *entry;
+
 	if (music != NULL)
 	{
 		Mix_HaltMusic();
@@ -42,7 +106,17 @@ void loadMusic(char *filename)
 		music = NULL;
 	}
 
-	music = Mix_LoadMUS(filename);
+	// Stream the music from the asset pack memory, or from its file.
+	entry = findPackEntry(filename, PACK_MUSIC);
+
+	if (entry != NULL)
+	{
+		music = Mix_LoadMUS_RW(SDL_RWFromConstMem(getPackData(entry), entry->size), 1);
+	}
+	else
+	{
+		music = Mix_LoadMUS(filename);
+	}
 }
 
 void playMusic(int loop)
@@ -50,15 +124,131 @@ void playMusic(int loop)
 	Mix_PlayMusic(music, (loop) ? -1 : 0);
 }
 
-void playSound(int id, int channel)
+// Request a sound.
+// x is the horizontal position of its emitter. The requests are played at the end of the frame.
+// The frames simulated again by a network rollback were already heard.
+void playSound(int id, int x)
 {
-	Mix_PlayChannel(channel, sounds[id], 0);
+	if (app.rollback)
+	{
+		return;
+	}
+
+	sounds[id].requests++;
+	sounds[id].x += x;
+}
+
+// Play the sounds requested during the frame.
+// The requests of a same sound are merged into one voice, panned at their average
+// position, and louder as there are more requests. The mixer then limits the voices
+// of each sound and steals voices by priority, so its load stays bounded.
+// With the in-house mixer, the sounds are only sent to the audio thread, without lock.
+void flushSounds(void)
+{
+	Sound *s;
+	int i;
+
+	for (i = 0 ; i < SND_MAX ; i++)
+	{
+		s = &sounds[i];
+
+		if (s->requests == 0)
+		{
+			continue;
+		}
+
+		// Take the chunk once the loader has uploaded it
+		if (s->chunk == NULL && s->load != NULL && isLoaded(s->load))
+		{
+			s->chunk = s->load->sound;
+			s->load = NULL;
+		}
+
+		if (SDL_AtomicGet(&audioReady) && s->chunk != NULL)
+		{
+			if (mixer)
+			{
+				playMixerSound(i, s, s->x / s->requests, sqrt(s->requests));
+			}
+			else
+			{
+				Mix_PlayChannel(s->channel, s->chunk, 0);
+			}
+		}
+
+		s->requests = 0;
+		s->x = 0;
+	}
+}
+
+// Stop every sound.
+void stopSounds(void)
+{
+	if (!SDL_AtomicGet(&audioReady))
+	{
+		return;
+	}
+
+	if (mixer)
+	{
+		stopMixerSound(CH_ANY);
+	}
+	else
+	{
+		Mix_HaltChannel(-1);
+	}
+}
+
+static int initAudio(void *data)
+{
+	Uint64 start;
+
+	start = SDL_GetPerformanceCounter();
+
+	// Initialize audio
+	// Set up audio with SDL mixer, with the following settings
+	// Use CD quality frequency, default format, stereo, and the buffer size given on
+	// the command line, 1024 sample frames by default.
+	// See: https://www.libsdl.org/projects/SDL_mixer/docs/SDL_mixer_11.html
+	if (SDL_InitSubSystem(SDL_INIT_AUDIO) < 0 || Mix_OpenAudio(MIXER_FREQUENCY, MIX_DEFAULT_FORMAT, MIXER_CHANNELS, app.audioSamples) == -1)
+	{
+		SDL_LogMessage(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_WARN, "Couldn't initialize SDL Mixer, playing without sound");
+		SDL_SemPost(audioOpened);
+		return 0;
+	}
+
+	Mix_AllocateChannels(MAX_SND_CHANNELS);
+
+	// Mix the sounds in house, SDL Mixer only plays the music
+	mixer = initMixer();
+
+	if (!mixer)
+	{
+		SDL_LogMessage(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_WARN, "Audio device is not 16 bits stereo, sounds are played by SDL Mixer");
+	}
+
+	logStartupPhase("audio device", start);
+
+	// Let the loader threads decode the sounds
+	audioOpen = TRUE;
+	SDL_SemPost(audioOpened);
+
+	start = SDL_GetPerformanceCounter();
+
+	loadMusic("music/music.ogg");
+
+	logStartupPhase("music", start);
+
+	SDL_AtomicSet(&audioReady, TRUE);
+
+	playMusic(1);
+
+	return 0;
 }
 
-static void loadSounds(void)
+static void setSound(int id, int channel, int maxVoices, int priority)
 {
-	sounds[SND_PLAYER_FIRE] = Mix_LoadWAV("sound/425209__velkstar__water-drop.wav");
-	sounds[SND_ALIEN_FIRE] = Mix_LoadWAV("sound/468852__christianand__26-pestaneo-ruidoso.wav");
-	sounds[SND_PLAYER_DIE] = Mix_LoadWAV("sound/541887__d4xx__pop-up-sound.ogg");
-	sounds[SND_ALIEN_DIE] = Mix_LoadWAV("sound/396270__eflexmusic__exploding-car-with-fire-mixed.ogg");
+	sounds[id].channel = channel;
+	sounds[id].maxVoices = maxVoices;
+	sounds[id].priority = priority;
 }
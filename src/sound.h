@@ -20,3 +20,15 @@
 #include "common.h"
 
 #include "SDL2/SDL_mixer.h"
+
+extern void closeMixer(void);
+extern PackEntry *findPackEntry(char *name, int type);
+extern void *getPackData(PackEntry *entry);
+extern int initMixer(void);
+extern int isLoaded(Load *load);
+extern void logStartupPhase(char *name, Uint64 start);
+extern void playMixerSound(int id, Sound *sound, int x, float volume);
+extern Load *queueSound(char *filename);
+extern void stopMixerSound(int channel);
+
+extern App app;
@@ -19,37 +19,49 @@
 
 #include "stage.h"
 
-static void addDebris(Entity *e);
+static void addDebris(int id);
 static void addExplosions(int x, int y, int num);
-static void assignEnemyPoints(Entity* e, int row);
-static void assignEnemyTextrure(Entity* e, int row);
-static int bulletHitEnemy(Entity *b);
-static int bulletHitPlayer(Entity *b);
+static void assignEnemyPoints(int n, int row);
+static void assignEnemyTextrure(int n, int row);
+static void addContact(Collider *a, Collider *b, void *data);
+static void applyContact(Contact *c);
+static int checkEntity(int id);
 static void clipEnemies(void);
-static void clipPlayer(void);
+static void clipPlayers(void);
+static int compareContacts(const void *a, const void *b);
 static void destroyEnemies(void);
 static void doBullets(void);
 static void doDebris(void);
 static void doEnemies(void);
-static void doExplosions(void);
-static void doPlayer(void);
+static int countPlayers(void);
+static void doPlayers(void);
 static void draw(void);
 static void drawBullets(void);
 static void drawDebris(void);
 static void drawEnemies(void);
-static void drawExplosions(void);
 static void drawHud(void);
-static void drawPlayer(void);
-static void fireBullet(void);
-static void fireEnemyBullet(Entity *e);
+static void drawPlayers(void);
+static void drawShields(void);
+static void enterStage(void);
+static int enemyBand(int row);
+static void fireBullet(int player);
+static void fillPools(void);
+static int fireEnemyBullet(int enemy);
+static void fireSpread(int enemy);
+static int getTextures(SDL_Texture **textures);
+static float hitTime(int bullet, int target, float dx, float dy);
 static void initEnemies(void);
-static void initPlayer(void);
+static void initPlayers(void);
+static void initShields(void);
 static void logic(void);
+static void moveColliders(void);
 static void moveEnemies(void);
+static Debris *newDebris(void);
 static void resetStage(void);
 static void shootPlayer(void);
 
-static Entity *player;
+static int players[MAX_PLAYERS];
+static Layer formationLayer;
 static SDL_Texture *bulletTexture;
 static SDL_Texture *enemyBulletTexture;
 static SDL_Texture *enemyLargeTexture;
@@ -58,6 +70,13 @@ static SDL_Texture *enemySmallTexture;
 static SDL_Texture *explosionTexture;
 static SDL_Texture *playerTexture;
 static int enemyStepTimer;
+static int enemiesHit;
+static int spreadPhase;
+static int prepared;
+static Debris *freeDebris;
+static Contact *contacts;
+static int numContacts;
+static int maxContacts;
 
 int enemyCurrentStep;     // Current horizontal position of enemies 
 int enemyDestroyed;       // Use to trigger the state when all enemy are destroyed : TRUE or FALSE 
@@ -67,27 +86,85 @@ int enemyMoveDown;        // Define the down move of enemies : TRUE or FALSE
 int enemyTotalNumber;     // Total enemy number
 int stageResetTimer;      // Timer to reset the game 
 
+// Prepare the game stage ahead of time.
+// Called every frame of the title and highscore screens. It uploads the sounds decoded
+// since the startup, then queues the stage textures on the loader threads and fills
+// the entity pools. Once the textures are uploaded, the formation layer is created. Starting a stage then does no blocking work.
+// The enemies are shrunk once when the formation doesn't fit in its area at full size.
+void prepareStage(void)
+{
+        float f;
+        int w, h;
+
+        if (!prepared && pumpLoader(0))
+        {
+                queueTexture("gfx/bullet.png");
+                queueTexture("gfx/enemyBullet.png");
+                queueTexture("gfx/explosion.png");
+                queueTexture("gfx/largeEnemy.png");
+                queueTexture("gfx/mediumEnemy.png");
+                queueTexture("gfx/player.png");
+                queueTexture("gfx/smallEnemy.png");
+
+                startLoader();
+
+                fillPools();
+
+                prepared = TRUE;
+        }
+
+        if (prepared && formationLayer.w == 0 && pumpLoader(0))
+        {
+                bulletTexture = loadTexture("gfx/bullet.png");
+                enemyBulletTexture = loadTexture("gfx/enemyBullet.png");
+                enemyLargeTexture = loadTexture("gfx/largeEnemy.png");
+                enemyMediumTexture = loadTexture("gfx/mediumEnemy.png");
+                enemySmallTexture = loadTexture("gfx/smallEnemy.png");
+                playerTexture = loadTexture("gfx/player.png");
+                explosionTexture = loadTexture("gfx/explosion.png");
+
+                getTextureSize(enemySmallTexture, &w, &h);
+
+                f = MIN(FORMATION_WIDTH / (app.formationCols * (w + w / 8.0)), FORMATION_HEIGHT / (app.formationRows * (h + h / 8.0)));
+
+                if (f < 1)
+                {
+                        enemyLargeTexture = loadScaledTexture("gfx/largeEnemy.png", MAX(1, w * f), MAX(1, h * f));
+                        enemyMediumTexture = loadScaledTexture("gfx/mediumEnemy.png", MAX(1, w * f), MAX(1, h * f));
+                        enemySmallTexture = loadScaledTexture("gfx/smallEnemy.png", MAX(1, w * f), MAX(1, h * f));
+
+                        getTextureSize(enemySmallTexture, &w, &h);
+                }
+
+                // The formation layer holds every enemy, it is moved with them
+                // and only the cell of a destroyed enemy is cleared.
+                initLayer(&formationLayer, HORIZONTAL_POSITION, VERTICAL_POSITION,
+                          app.formationCols * (w + w / 8), app.formationRows * (h + h / 8));
+        }
+}
+
 // Initialize the game stage.
-// by loading textures, initialize entities (player and enemies), and initialize gloabl variables.
+// by creating the entities (player, enemies and shields) in the world, and initializing global variables.
 void initStage(void)
 {
-        app.delegate.logic = logic;
-	app.delegate.draw = draw;
+        enterStage();
 
-	bulletTexture = loadTexture("gfx/bullet.png");
-        enemyBulletTexture = loadTexture("gfx/enemyBullet.png");
-	enemyLargeTexture = loadTexture("gfx/largeEnemy.png");
-	enemyMediumTexture = loadTexture("gfx/mediumEnemy.png");
-        enemySmallTexture = loadTexture("gfx/smallEnemy.png");
-        playerTexture = loadTexture("gfx/player.png");
-        explosionTexture = loadTexture("gfx/explosion.png");
-	
 	memset(app.keyboard, 0 , sizeof(int) * MAX_KEYBOARD_KEYS);
 
+        stopSounds();
+
         resetStage();
 
-	initPlayer();
+        stage.rows = app.formationRows;
+        stage.cols = app.formationCols;
+
+	initPlayers();
 	initEnemies();
+        initShields();
+
+        formationLayer.x = HORIZONTAL_POSITION;
+        formationLayer.y = VERTICAL_POSITION;
+        formationLayer.dirty = TRUE;
         
 	enemyStepTimer = FPS;
         
@@ -98,353 +175,895 @@ void initStage(void)
 
         enemyCurrentStep = 0;
         enemyDestroyedNumber = 0;
-        enemyTotalNumber = ENEMY_ROW * ENEMY_COL;
+        enemyTotalNumber = stage.rows * stage.cols;
+        stage.numEnemies = enemyTotalNumber;
 
         stageResetTimer = FPS * 3;
+
+        startRecording();
 }
 
-// Reset the stage to initial state.
-// by freeing entities, bullets, explosion, debris from the memory,
-// resetting the stage object to zero, and initializing liked lists.
-static void resetStage()
+// Get the hashes of the parts of the stage state, at the end of a tick.
+// The entities are hashed as they change, the stage globals and the random state
+// are hashed here. The particles and the debris only look, they aren't hashed.
+void getStateHashes(Uint32 *hashes)
+{
+        int globals[] = {enemyCurrentStep, enemyDestroyed, enemyDestroyedNumber, enemyDirection, enemyMoveDown,
+                         enemyStepTimer, stageResetTimer, players[0], players[1], stage.score, stage.numBullets, stage.numEnemies};
+        Uint32 h;
+        int i;
+
+        memcpy(hashes, world.hashes, sizeof(world.hashes));
+
+        h = 0;
+
+        for (i = 0; i < sizeof(globals) / sizeof(int); i++)
+        {
+                h = mixHash(h ^ globals[i]) + i;
+        }
+
+        hashes[HASH_STAGE] = h;
+        hashes[HASH_RANDOM] = getRandomState();
+}
+
+// Save the stage in a snapshot.
+// The globals, the timers and the state of the random generator are saved with the
+// stage, then the entities and the debris. Textures are saved as their index in
+// the table of stage textures.
+void saveStage(Snapshot *s)
 {
-        Entity *e;
-        Explosion *ex;
+        SDL_Texture *textures[MAX_STAGE_TEXTURES];
         Debris *d;
-        
-        int i, j;
+        int i, j, n, numTextures;
+
+        numTextures = getTextures(textures);
+
+        writeSnapshotInt(s, enemyCurrentStep, 4);
+        writeSnapshotInt(s, enemyDestroyed, 1);
+        writeSnapshotInt(s, enemyDestroyedNumber, 4);
+        writeSnapshotInt(s, enemyDirection, 1);
+        writeSnapshotInt(s, enemyMoveDown, 1);
+        writeSnapshotInt(s, enemyTotalNumber, 4);
+        writeSnapshotInt(s, stageResetTimer, 4);
+        writeSnapshotInt(s, enemyStepTimer, 4);
+        writeSnapshotInt(s, enemiesHit, 4);
+        writeSnapshotInt(s, spreadPhase, 4);
+
+        for (i = 0; i < MAX_PLAYERS; i++)
+        {
+                writeSnapshotInt(s, players[i], 4);
+        }
 
-        free(player);
+        writeSnapshotInt(s, formationLayer.x, 4);
+        writeSnapshotInt(s, formationLayer.y, 4);
+        writeSnapshotInt(s, getRandomState(), 4);
 
-        for (i = 0; i < ENEMY_ROW; i++)
-	{
-                for (j = 0; j < ENEMY_COL; j++)
+        writeSnapshotInt(s, stage.rows, 4);
+        writeSnapshotInt(s, stage.cols, 4);
+
+        for (i = 0; i < stage.rows; i++)
+        {
+                for (j = 0; j < stage.cols; j++)
                 {
-                        free(stage.enemies[i][j]);
+                        writeSnapshotInt(s, stage.enemies[i][j], 4);
                 }
         }
 
-        while (stage.bulletHead.next)
+        writeSnapshotInt(s, stage.numShieldBlocks, 4);
+
+        for (i = 0; i < stage.numShieldBlocks; i++)
         {
-                e = stage.bulletHead.next;
-                stage.bulletHead.next = e->next;
-                free(e);
+                writeSnapshotInt(s, stage.shields[i], 4);
         }
 
-        while (stage.explosionHead.next)
+        writeSnapshotInt(s, stage.numBullets, 4);
+        writeSnapshotInt(s, stage.numEnemies, 4);
+        writeSnapshotInt(s, stage.score, 4);
+
+        saveWorld(s, textures, numTextures);
+
+        n = 0;
+
+        for (d = stage.debrisHead.next ; d != NULL ; d = d->next)
         {
-                ex = stage.explosionHead.next;
-                stage.explosionHead.next = ex->next;
-                free(ex);
+                n++;
         }
 
-        while (stage.debrisHead.next)
-	{
-		d = stage.debrisHead.next;
-		stage.debrisHead.next = d->next;
-		free(d);
-	}
+        writeSnapshotInt(s, n, 4);
+
+        for (d = stage.debrisHead.next ; d != NULL ; d = d->next)
+        {
+                writeSnapshotFloat(s, d->x);
+                writeSnapshotFloat(s, d->y);
+                writeSnapshotFloat(s, d->dx);
+                writeSnapshotFloat(s, d->dy);
+                writeSnapshotInt(s, d->rect.x, 2);
+                writeSnapshotInt(s, d->rect.y, 2);
+                writeSnapshotInt(s, d->rect.w, 2);
+                writeSnapshotInt(s, d->rect.h, 2);
+                writeSnapshotInt(s, getTextureIndex(d->texture, textures, numTextures), 1);
+                writeSnapshotInt(s, d->life, 2);
+        }
+}
+
+// Restore the stage from a snapshot, and play it.
+// The stage is reset first, so its entities, colliders and debris are given back,
+// then the saved ones are created again with the same ids.
+void loadStage(Snapshot *s)
+{
+        SDL_Texture *textures[MAX_STAGE_TEXTURES];
+        Debris *d;
+        int i, j, n, numTextures;
+
+        enterStage();
+
+        resetStage();
+
+        numTextures = getTextures(textures);
+
+        enemyCurrentStep = readSnapshotInt(s, 4);
+        enemyDestroyed = readSnapshotInt(s, 1);
+        enemyDestroyedNumber = readSnapshotInt(s, 4);
+        enemyDirection = readSnapshotInt(s, 1);
+        enemyMoveDown = readSnapshotInt(s, 1);
+        enemyTotalNumber = readSnapshotInt(s, 4);
+        stageResetTimer = readSnapshotInt(s, 4);
+        enemyStepTimer = readSnapshotInt(s, 4);
+        enemiesHit = readSnapshotInt(s, 4);
+        spreadPhase = readSnapshotInt(s, 4);
+
+        for (i = 0; i < MAX_PLAYERS; i++)
+        {
+                players[i] = readSnapshotInt(s, 4);
+        }
+
+        formationLayer.x = readSnapshotInt(s, 4);
+        formationLayer.y = readSnapshotInt(s, 4);
+        formationLayer.dirty = TRUE;
+        setRandomState(readSnapshotInt(s, 4));
+
+        stage.rows = readSnapshotRange(s, 4, 1, MAX_FORMATION_ROWS);
+        stage.cols = readSnapshotRange(s, 4, 1, MAX_FORMATION_COLS);
+
+        stage.enemies = malloc(stage.rows * sizeof(int *));
+        stage.enemies[0] = calloc(stage.rows * stage.cols, sizeof(int));
+        stage.columnBottoms = malloc(stage.cols * sizeof(int));
+
+        for (i = 0; i < stage.rows; i++)
+        {
+                stage.enemies[i] = stage.enemies[0] + i * stage.cols;
+
+                for (j = 0; j < stage.cols; j++)
+                {
+                        stage.enemies[i][j] = readSnapshotInt(s, 4);
+                }
+        }
+
+        stage.numShieldBlocks = readSnapshotRange(s, 4, 0, MAX_SHIELD_BLOCKS);
+
+        for (i = 0; i < stage.numShieldBlocks; i++)
+        {
+                stage.shields[i] = readSnapshotInt(s, 4);
+        }
+
+        // Counted again once the world is loaded
+        readSnapshotInt(s, 4);
+        readSnapshotInt(s, 4);
+        stage.score = readSnapshotInt(s, 4);
+
+        loadWorld(s, textures, numTextures);
+
+        // The ids are checked against the world, so a damaged snapshot can't point
+        // outside of it. Players and enemies that aren't alive are gone, shield
+        // blocks that aren't are left out.
+        for (i = 0; i < MAX_PLAYERS; i++)
+        {
+                players[i] = checkEntity(players[i]);
+        }
+
+        n = 0;
+
+        for (i = 0; i < stage.numShieldBlocks; i++)
+        {
+                if (checkEntity(stage.shields[i]) != 0)
+                {
+                        stage.shields[n++] = stage.shields[i];
+                }
+        }
+
+        stage.numShieldBlocks = n;
+
+        // The counters are found again from the world, and the bottom enemy of each
+        // column from the matrix
+        stage.numBullets = 0;
+
+        for (i = 0; i < world.size; i++)
+        {
+                stage.numBullets += (world.components[i] & COMPONENT_VELOCITY) != 0;
+        }
+
+        stage.numEnemies = 0;
+
+        for (j = 0; j < stage.cols; j++)
+        {
+                stage.columnBottoms[j] = -1;
+
+                for (i = 0; i < stage.rows; i++)
+                {
+                        stage.enemies[i][j] = checkEntity(stage.enemies[i][j]);
+
+                        if (stage.enemies[i][j] != 0)
+                        {
+                                stage.columnBottoms[j] = i;
+                                stage.numEnemies++;
+                        }
+                }
+        }
+
+        n = readSnapshotRange(s, 4, 0, s->size);
+
+        for (i = 0; i < n; i++)
+        {
+                d = newDebris();
+                stage.debrisTail->next = d;
+                stage.debrisTail = d;
+
+                d->x = readSnapshotFloat(s);
+                d->y = readSnapshotFloat(s);
+                d->dx = readSnapshotFloat(s);
+                d->dy = readSnapshotFloat(s);
+                d->rect.x = readSnapshotInt(s, 2);
+                d->rect.y = readSnapshotInt(s, 2);
+                d->rect.w = readSnapshotInt(s, 2);
+                d->rect.h = readSnapshotInt(s, 2);
+                d->texture = textures[readSnapshotRange(s, 1, 0, numTextures - 1)];
+                d->life = readSnapshotRange(s, 2, 1, FPS * 2);
+        }
+}
+
+// Check an entity id read from a snapshot.
+// Return the id when its entity is alive in the world, otherwise 0.
+static int checkEntity(int id)
+{
+        return isEntityAlive(id) ? id : 0;
+}
+
+// Enter the stage.
+// Set the stage delegates, and finish the preparation when the stage starts before it is done.
+// The keys held stay down, so a stage restored while playing keeps its input.
+static void enterStage(void)
+{
+        app.delegate.logic = logic;
+	app.delegate.draw = draw;
+
+        app.attract = FALSE;
+
+        prepareStage();
+
+        while (formationLayer.w == 0)
+        {
+                pumpLoader(1000 / FPS);
+                prepareStage();
+        }
+}
+
+// Fill a table with the stage textures, so a texture is saved as its index.
+// The first entry is for entities without texture.
+static int getTextures(SDL_Texture **textures)
+{
+        textures[0] = NULL;
+        textures[1] = bulletTexture;
+        textures[2] = enemyBulletTexture;
+        textures[3] = enemyLargeTexture;
+        textures[4] = enemyMediumTexture;
+        textures[5] = enemySmallTexture;
+        textures[6] = explosionTexture;
+        textures[7] = playerTexture;
+
+        return MAX_STAGE_TEXTURES;
+}
+
+// Reset the stage to initial state.
+// by destroying the entities, returning debris to their pool, clearing the particles,
+// resetting the stage object to zero, and initializing liked lists.
+// The entities and the debris are given back at once, without walking them.
+static void resetStage()
+{
+        if (stage.enemies != NULL)
+        {
+                free(stage.enemies[0]);
+                free(stage.enemies);
+                free(stage.columnBottoms);
+        }
+
+        clearParticles();
+
+        if (stage.debrisHead.next)
+        {
+                stage.debrisTail->next = freeDebris;
+                freeDebris = stage.debrisHead.next;
+        }
         
+        // The entities destroyed at once still have colliders
+        clearWorld();
+        clearColliders();
+
+        memset(players, 0, sizeof(players));
+
         memset(&stage, 0, sizeof(Stage));
-        stage.bulletTail = &stage.bulletHead;
-        stage.explosionTail = &stage.explosionHead;
         stage.debrisTail = &stage.debrisHead;
 
         stage.score = 0;
 }
 
-// Initialize player entity.
-// Allocate memory space, assign position on the screen, query texture parameters, and
-// initialize entity properties.
-static void initPlayer()
+// Initialize players entity.
+// For each player, create the entity in the world, assign position on the screen, query texture parameters, and
+// initialize its components. The second player starts on the right.
+static void initPlayers()
 {
-	player = malloc(sizeof(Entity));
-	memset(player, 0, sizeof(Entity));
+        int i, n;
 
-	player->x = 100;
-	player->y = 800;
-	player->texture = playerTexture;
-	SDL_QueryTexture(player->texture, NULL, NULL, &player->w, &player->h);
+        for (i = 0; i < app.numPlayers; i++)
+        {
+	        players[i] = createEntity(COMPONENT_POSITION | COMPONENT_SPRITE | COMPONENT_HEALTH | COMPONENT_WEAPON | COMPONENT_COLLIDER);
+                n = ENTITY_INDEX(players[i]);
+
+	        world.texture[n] = playerTexture;
+	        getTextureSize(world.texture[n], &world.w[n], &world.h[n]);
+	        world.x[n] = TO_FIXED((i == 0) ? 100 : SCREEN_WIDTH - 100 - world.w[n]);
+	        world.y[n] = TO_FIXED(800);
 
-	player->health = 1;
-	player->side = SIDE_PLAYER;
+	        world.health[n] = 1;
+                // The players can't be hit on the stress stage, so it never ends
+                world.collider[n] = addCollider(COLLIDE_PLAYER, app.stress ? 0 : COLLIDE_ENEMY_BULLET, players[i]);
+        }
 }
 
 // Initialize enemies entity.
-// For each enemies, allocate memory space, assign texture, querying texture parameters,
-// assigne position on the screen, assign speed, and initializing entity properties.
+// Allocate the enemies matrix for the formation size, as one dense array of entity ids
+// with a pointer to each row. For each enemies, create the entity, assign texture, querying texture parameters,
+// assigne position on the screen, and initializing its components.
 static void initEnemies()
 {
-        int i, j;
+        int i, j, n, id;
+
+        stage.enemies = malloc(stage.rows * sizeof(int *));
+        stage.enemies[0] = calloc(stage.rows * stage.cols, sizeof(int));
+        stage.columnBottoms = malloc(stage.cols * sizeof(int));
+
+        for (i = 1; i < stage.rows; i++)
+        {
+                stage.enemies[i] = stage.enemies[0] + i * stage.cols;
+        }
+
+        for (j = 0; j < stage.cols; j++)
+        {
+                stage.columnBottoms[j] = stage.rows - 1;
+        }
 	
-	for (i = 0; i < ENEMY_ROW; i++)
+	for (i = 0; i < stage.rows; i++)
 	{
-                for (j = 0; j < ENEMY_COL; j++)
+                for (j = 0; j < stage.cols; j++)
                 {        
-                        Entity *e;
+                        id = createEntity(COMPONENT_POSITION | COMPONENT_SPRITE | COMPONENT_HEALTH | COMPONENT_WEAPON | COMPONENT_SCORE | COMPONENT_COLLIDER);
+                        n = ENTITY_INDEX(id);
+                        stage.enemies[i][j] = id;
 
-                        e = malloc(sizeof(Entity));
-                        memset(e, 0, sizeof(Entity));
-                        stage.enemies[i][j] = e;
-
-                        assignEnemyTextrure(e, i);
+                        assignEnemyTextrure(n, i);
                         
-                        SDL_QueryTexture(e->texture, NULL, NULL, &e->w, &e->h);
+                        getTextureSize(world.texture[n], &world.w[n], &world.h[n]);
                         
-                        e->x = HORIZONTAL_POSITION + (e->w + (e->w / 8)) * j;
-                        e->y = VERTICAL_POSITION + (e->h + (e->h / 8)) * i;
-
-                        e->dx = e->w / 8;
-                        e->dy = e->h / 8;
+                        world.x[n] = TO_FIXED(HORIZONTAL_POSITION + (world.w[n] + (world.w[n] / 8)) * j);
+                        world.y[n] = TO_FIXED(VERTICAL_POSITION + (world.h[n] + (world.h[n] / 8)) * i);
 		
-                        e->health = 1;
-                        e->side = SIDE_ENEMY;
-                        e->reload = FPS * (1 + (rand() % 10));
+                        world.health[n] = 1;
+                        world.collider[n] = addCollider(COLLIDE_ENEMY, COLLIDE_PLAYER_BULLET, id);
+
+                        moveCollider(world.collider[n], FROM_FIXED(world.x[n]), FROM_FIXED(world.y[n]), world.w[n], world.h[n]);
+                        world.reload[n] = FPS * (1 + getRandom(10));
+
+                        assignEnemyPoints(n, i);
 
-                        assignEnemyPoints(e, i);
+                        hashEntity(id, HASH_FORMATION);
                 }
         }	
 }
 
+// Initialize shields.
+// Build the shields between the enemies and the player with square blocks,
+// without the top corners and with an arch at the bottom. Every block is a
+// collider destroyed by the first bullet which hits it.
+static void initShields(void)
+{
+        int i, r, c, x, n, id;
+
+        for (i = 0; i < NUM_SHIELDS; i++)
+        {
+                x = SCREEN_WIDTH * (2 * i + 1) / (2 * NUM_SHIELDS) - SHIELD_COLS * SHIELD_BLOCK_SIZE / 2;
+
+                for (r = 0; r < SHIELD_ROWS; r++)
+                {
+                        for (c = 0; c < SHIELD_COLS; c++)
+                        {
+                                if ((r == 0 && (c == 0 || c == SHIELD_COLS - 1))
+                                    || (r >= SHIELD_ROWS - 2 && c >= 2 && c < SHIELD_COLS - 2))
+                                {
+                                        continue;
+                                }
+
+                                id = createEntity(COMPONENT_POSITION | COMPONENT_SPRITE | COMPONENT_HEALTH | COMPONENT_COLLIDER);
+                                n = ENTITY_INDEX(id);
+                                stage.shields[stage.numShieldBlocks++] = id;
+
+                                world.x[n] = TO_FIXED(x + c * SHIELD_BLOCK_SIZE);
+                                world.y[n] = TO_FIXED(SHIELD_Y + r * SHIELD_BLOCK_SIZE);
+                                world.w[n] = SHIELD_BLOCK_SIZE;
+                                world.h[n] = SHIELD_BLOCK_SIZE;
+
+                                world.health[n] = 1;
+                                world.collider[n] = addCollider(COLLIDE_SHIELD, COLLIDE_BULLETS, id);
+
+                                moveCollider(world.collider[n], FROM_FIXED(world.x[n]), FROM_FIXED(world.y[n]), world.w[n], world.h[n]);
+                                hashEntity(id, HASH_SHIELDS);
+                        }
+                }
+        }
+}
+
 // Assign texture to enemy according to a row number.
-// From the top
+// From the top of the default formation
 // row 1   - small enemy texture,
 // row 2/3 - medium enemy texture, and
 // row 4/5 - large enemy texture.
-static void assignEnemyTextrure(Entity* e, int row)
+static void assignEnemyTextrure(int n, int row)
 {
+        row = enemyBand(row);
+
         if (row < 1)
         {
-                e->texture = enemySmallTexture;
+                world.texture[n] = enemySmallTexture;
         }
         else if (row < 3)
         {
-                e->texture = enemyMediumTexture;
+                world.texture[n] = enemyMediumTexture;
         }
         else
         {
-                e->texture = enemyLargeTexture;
+                world.texture[n] = enemyLargeTexture;
         }
 }
 
 // Assign points to enemy according to a row number.
-// From the top
+// From the top of the default formation
 // row 1   - 30 points for small enemy,
 // row 2/3 - 20 points for medium enemy, and
 // row 4/5 - 10 points for large enemy.
-static void assignEnemyPoints(Entity* e, int row)
+static void assignEnemyPoints(int n, int row)
 {
+        row = enemyBand(row);
+
         if (row == 1)
         {
-                e->points = 30;
+                world.points[n] = 30;
         }
         else if (row <= 3)
         {
-                e->points = 20;
+                world.points[n] = 20;
         }
         else
         {
-                e->points = 10;
+                world.points[n] = 10;
         }
 }
 
+// Map a row of the formation to the row of the default formation at the same height,
+// so larger formations keep the same bands of enemies.
+static int enemyBand(int row)
+{
+        return row * ENEMY_ROW / stage.rows;
+}
+
 // Apply stage logic.
 static void logic(void)
 {
+        // The stage is drawn every frame
+        app.redraw = TRUE;
+
+        // The network game sets the inputs of both players itself
+        if (!app.netplay)
+        {
+                app.inputs[0] = getKeyboardInput();
+        }
+
+        replayInput();
+
         doBackground();
         
-	doPlayer();
+	doPlayers();
 
 	doEnemies();
 
 	doBullets();
 
-        doExplosions();
+        doParticles();
 
         doDebris();
 
 	clipEnemies();
 	
-	clipPlayer();
+	clipPlayers();
+
+        replayHashes();
         
         // Reset the game stage.
-        // When the player or all enemy are destroyed, wait for the reset time,
+        // When the players or all enemy are destroyed, wait for the reset time,
         // then add the highscore on the table and display the highscore table.
-        if ((player == NULL || enemyDestroyed == TRUE) && --stageResetTimer <= 0)
+        if ((countPlayers() == 0 || enemyDestroyed == TRUE) && --stageResetTimer <= 0)
         {
+                endReplay();
+
                 addHighscore(stage.score);
 
                 initHighscores();
         }
 }
 
-// Do player actions.
-// Reload bullets, move entity on the right or on the left according to user inputs,
-// fire bullet according to user input, destroyed player if its health is zero.
-static void doPlayer(void)
+// Do players actions.
+// For each player, reload bullets, move entity on the right or on the left according to its inputs,
+// fire bullet according to its inputs, destroyed player if its health is zero.
+static void doPlayers(void)
 {
-	if (player != NULL)
-	{                
-                player->dx = 0;
+        int i, n, dx;
+
+        for (i = 0; i < MAX_PLAYERS; i++)
+        {
+	        if (players[i] == 0)
+	        {
+                        continue;
+                }
+
+                n = ENTITY_INDEX(players[i]);
+                dx = 0;
                                 
-		if (player->reload > 0)
+		if (world.reload[n] > 0)
 		{
-			player->reload--;
+			world.reload[n]--;
 		}
 
-	      	if (app.keyboard[SDL_SCANCODE_LEFT])
+	      	if (app.inputs[i] & INPUT_LEFT)
 		{
-			player->dx = -PLAYER_SPEED;
+			dx = -PLAYER_SPEED;
 		}
 
-	      	if (app.keyboard[SDL_SCANCODE_RIGHT])
+	      	if (app.inputs[i] & INPUT_RIGHT)
 		{
-			player->dx = PLAYER_SPEED;
+			dx = PLAYER_SPEED;
 		}
 
-		if (app.keyboard[SDL_SCANCODE_LCTRL] && player->reload <= 0)
+		if ((app.inputs[i] & INPUT_FIRE) && world.reload[n] <= 0)
 		{
-                        playSound(SND_PLAYER_FIRE, CH_PLAYER);
+                        playSound(SND_PLAYER_FIRE, FROM_FIXED(world.x[n]) + world.w[n] / 2);
                         
-			fireBullet();
+			fireBullet(players[i]);
 		}
                 
-                player->x += player->dx;
-                player->y += player->dy;
+                world.x[n] += TO_FIXED(dx);
 
-                if (player->health == 0)
+                if (world.health[n] == 0)
 		{
-                        player = NULL;
+                        destroyEntity(players[i]);
+                        players[i] = 0;
                 }
 	}
 }
 
+// Count the players alive.
+static int countPlayers(void)
+{
+        int i, n;
+
+        n = 0;
+
+        for (i = 0; i < MAX_PLAYERS; i++)
+        {
+                n += (players[i] != 0);
+        }
+
+        return n;
+}
+
 // Fire player bullet.
-// Allocate memory space to the entity, add the entity to the bullet linked list,
+// Create a bullet entity, which is an entity with a velocity,
 // assign the player position to the entity, query texture parameters, and
-// initialize entity properties.
-static void fireBullet(void)
+// initialize its components.
+static void fireBullet(int player)
 {
-	Entity *bullet;
+	int bullet, n, p;
+
+        p = ENTITY_INDEX(player);
 
-	bullet = malloc(sizeof(Entity));
-	memset(bullet, 0, sizeof(Entity));
-	stage.bulletTail->next = bullet;
-	stage.bulletTail = bullet;
+	bullet = createEntity(COMPONENT_POSITION | COMPONENT_VELOCITY | COMPONENT_SPRITE | COMPONENT_HEALTH | COMPONENT_COLLIDER);
+        n = ENTITY_INDEX(bullet);
 
-	bullet->x = player->x;
-	bullet->y = player->y;
-	bullet->dy = -PLAYER_BULLET_SPEED;
+	world.x[n] = world.x[p];
+	world.y[n] = world.y[p];
+	world.dy[n] = TO_VELOCITY(-PLAYER_BULLET_SPEED);
 
-	bullet->texture = bulletTexture;
-	SDL_QueryTexture(bullet->texture, NULL, NULL, &bullet->w, &bullet->h);
+	world.texture[n] = bulletTexture;
+	getTextureSize(world.texture[n], &world.w[n], &world.h[n]);
 
-	bullet->y += (player->h / 2) - (bullet->h / 2);
+	world.y[n] += TO_FIXED((world.h[p] / 2) - (world.h[n] / 2));
 
-        bullet->health = 1;
-	bullet->side = SIDE_PLAYER;
-	player->reload = 20;
+        world.health[n] = 1;
+        world.collider[n] = addCollider(COLLIDE_PLAYER_BULLET, COLLIDE_ENEMY | COLLIDE_ENEMY_BULLET | COLLIDE_SHIELD, bullet);
+        stage.numBullets++;
+	world.reload[p] = 20;
 }
 
 // Do bullet actions.
-// For each bullet in the linked list, move it with the right speed,
-// check if the player is hit, check if an enemy is hit, and
-// check if the bullet go out the screen, then
-// remove the bullet from the list.
+// The bullets are the entities with a velocity, their components are read in the
+// order of the world arrays. Move every bullet, and give the broadphase the box it swept during the tick,
+// so fast bullets don't go through. The broadphase gives the pairs of colliders
+// which may touch, the narrow phase finds when they hit, and the hits are applied
+// in their order during the tick: a bullet hits the first thing on its way.
+// Then remove the bullets which hit something or went out the screen.
 static void doBullets(void)
 {
-	Entity *b, *prev;
+        float x, y, dx, dy;
+        int i, n;
+#ifndef FLOAT_POSITIONS
+        int fx, fy;
+#endif
 
-	prev = &stage.bulletHead;
-        
-	for (b = stage.bulletHead.next; b != NULL; b = b->next)
+	for (n = 0; n < world.size; n++)
 	{
-		b->x += b->dx;
-		b->y += b->dy;
+                if (world.components[n] & COMPONENT_VELOCITY)
+                {
+#ifdef FLOAT_POSITIONS
+		        world.x[n] += world.dx[n];
+		        world.y[n] += world.dy[n];
+#else
+                        // The fraction keeps the bits of the move below the position
+                        fx = world.fx[n] + world.dx[n];
+                        fy = world.fy[n] + world.dy[n];
+		        world.x[n] += fx >> FRACTION_BITS;
+		        world.y[n] += fy >> FRACTION_BITS;
+                        world.fx[n] = fx & ((1 << FRACTION_BITS) - 1);
+                        world.fy[n] = fy & ((1 << FRACTION_BITS) - 1);
+#endif
+
+                        x = FROM_PRECISE(world.x[n], world.fx[n]);
+                        y = FROM_PRECISE(world.y[n], world.fy[n]);
+                        dx = FROM_VELOCITY(world.dx[n]);
+                        dy = FROM_VELOCITY(world.dy[n]);
+
+                        moveCollider(world.collider[n], MIN(x - dx, x), MIN(y - dy, y), world.w[n] + fabsf(dx), world.h[n] + fabsf(dy));
+                }
+        }
 
-		if (bulletHitPlayer(b)
-                    || bulletHitEnemy(b)
-		    || b->x < -b->w || b->y < -b->h
-		    || b->x > SCREEN_WIDTH || b->y > SCREEN_HEIGHT)
-		{
-			if (b == stage.bulletTail)
-			{
-				stage.bulletTail = prev;
-			}
+        hashMovingEntities(HASH_BULLETS);
 
-			prev->next = b->next;
-			free(b);
-			b = prev;
-       		}
+        moveColliders();
 
-		prev = b;
+        numContacts = 0;
+
+        findColliderPairs(addContact, NULL);
+
+        if (numContacts > 1)
+        {
+                qsort(contacts, numContacts, sizeof(Contact), compareContacts);
+        }
+
+        for (i = 0; i < numContacts; i++)
+        {
+                applyContact(&contacts[i]);
+        }
+
+	for (n = 0; n < world.size; n++)
+	{
+		if ((world.components[n] & COMPONENT_VELOCITY)
+		    && (world.health[n] == 0
+		        || world.x[n] < -world.w[n] * FIXED_ONE || world.y[n] < -world.h[n] * FIXED_ONE
+		        || world.x[n] > SCREEN_WIDTH * FIXED_ONE || world.y[n] > SCREEN_HEIGHT * FIXED_ONE))
+		{
+			destroyEntity(getEntityId(n));
+			stage.numBullets--;
+       		}
 	}
 }
 
-// Do actions when the bullet hits the player.
-// Check if the player is still alive, and check if the bullet comes from an enemy, and
-// check if there is collision between the player and the bullet, then
-// update the health property of both player and bullet, add explosions, add debris, and
-// play a sound.
-static int bulletHitPlayer(Entity *b)
+// Give the broadphase the bounds of the players.
+// The enemies are only moved with the formation steps.
+static void moveColliders(void)
+{
+        int i, n;
+
+        for (i = 0; i < MAX_PLAYERS; i++)
+        {
+                if (players[i] != 0)
+                {
+                        n = ENTITY_INDEX(players[i]);
+
+                        moveCollider(world.collider[n], FROM_FIXED(world.x[n]), FROM_FIXED(world.y[n]), world.w[n], world.h[n]);
+                }
+        }
+}
+
+// Add a contact for a pair of colliders, when the narrow phase finds a hit.
+// One of them is always a bullet. Two bullets move during the tick, so one is swept
+// in the motion relative to the other.
+static void addContact(Collider *a, Collider *b, void *data)
+{
+        Contact *c;
+        float t;
+        int bullet, target, layer;
+
+        if (a->layer & COLLIDE_BULLETS)
+        {
+                bullet = a->owner;
+                target = b->owner;
+                layer = b->layer;
+        }
+        else
+        {
+                bullet = b->owner;
+                target = a->owner;
+                layer = a->layer;
+        }
+
+        if (layer & COLLIDE_BULLETS)
+        {
+                t = hitTime(bullet, target, FROM_VELOCITY(world.dx[ENTITY_INDEX(target)]), FROM_VELOCITY(world.dy[ENTITY_INDEX(target)]));
+        }
+        else
+        {
+                t = hitTime(bullet, target, 0, 0);
+        }
+
+        if (t < 0)
+        {
+                return;
+        }
+
+        if (numContacts == maxContacts)
+        {
+                maxContacts = MAX(maxContacts * 2, 64);
+                contacts = realloc(contacts, maxContacts * sizeof(Contact));
+        }
+
+        c = &contacts[numContacts++];
+        c->a = bullet;
+        c->b = target;
+        c->layer = layer;
+        c->t = t;
+}
+
+// Sort the contacts by hit time, then by entity, so ties are always applied in the same order.
+static int compareContacts(const void *a, const void *b)
 {
-        if (player != NULL
-            && b->side != SIDE_PLAYER
-            && collision(b->x, b->y, b->w, b->h, player->x, player->y, player->w, player->h))
+        const Contact *c1 = a;
+        const Contact *c2 = b;
+
+        if (c1->t != c2->t)
         {
-                b->health = 0;
-                player->health = 0;
+                return (c1->t < c2->t) ? -1 : 1;
+        }
+
+        if (c1->a != c2->a)
+        {
+                return (c1->a < c2->a) ? -1 : 1;
+        }
 
-                addExplosions(player->x, player->y, 32);
+        return (c1->b < c2->b) ? -1 : (c1->b > c2->b);
+}
+
+// Apply a hit, unless the bullet or its target was destroyed earlier in the tick.
+// Update the health property of both entities, then
+// for the player or an enemy add explosions, add debris, and play a sound, and
+// increase the global score with the enemy's points property.
+// Two bullets or a bullet and a shield block only make a small explosion.
+static void applyContact(Contact *c)
+{
+        int b, e;
+
+        b = ENTITY_INDEX(c->a);
+        e = ENTITY_INDEX(c->b);
+
+        if (world.health[b] == 0 || world.health[e] == 0)
+        {
+                return;
+        }
 
-                addDebris(player);
+        world.health[b] = 0;
+        world.health[e] = 0;
 
-                playSound(SND_PLAYER_DIE, CH_PLAYER);
+        switch (c->layer)
+        {
+        case COLLIDE_PLAYER:
+                addExplosions(FROM_FIXED(world.x[e]), FROM_FIXED(world.y[e]), 32);
+
+                addDebris(c->b);
+
+                playSound(SND_PLAYER_DIE, FROM_FIXED(world.x[e]) + world.w[e] / 2);
+                break;
+
+        case COLLIDE_ENEMY:
+                addExplosions(FROM_FIXED(world.x[e]), FROM_FIXED(world.y[e]), 32);
+
+                addDebris(c->b);
+
+                playSound(SND_ALIEN_DIE, FROM_FIXED(world.x[e]) + world.w[e] / 2);
                 
-                return 1;
+                stage.score += world.points[e];
+                enemiesHit++;
+
+                hashEntity(c->b, HASH_FORMATION);
+                break;
+
+        case COLLIDE_SHIELD:
+                removeCollider(world.collider[e]);
+                world.collider[e] = 0;
+
+                hashEntity(c->b, HASH_SHIELDS);
+
+                addExplosions(FROM_FIXED(world.x[e]), FROM_FIXED(world.y[e]), 4);
+                break;
+
+        default:
+                addExplosions(FROM_FIXED(world.x[e]), FROM_FIXED(world.y[e]), 8);
+                break;
         }
-	return 0;
 }
 
-// Do actions when a bullet hits a enemy.
-// Check if the bullet come from the player, then
-// for each enemy in the matrix, chech if the enemy is alive, and
-// check if there is a collision between the enemy and the bullet, then
-// update the health property of both enemy and bullet, add explosions, add debris,
-// play a sound, and increase the global score with the enemy's points property. 
-static int bulletHitEnemy(Entity *b)
+// Find when a bullet hits an entity during the tick.
+// The entity moves by (dx, dy) during the tick, so the bullet is swept in the
+// motion relative to it, from both previous positions. Then the collision masks
+// are tested a pixel apart while the bounds overlap, so the transparent corners of the
+// sprites don't hit. Both sprites are rounded to the nearest pixel, as truncating the
+// swept position would overlap the masks a pixel early at the ends of the sweep.
+// Return the fraction of the tick at the first hit, or -1.
+static float hitTime(int bullet, int target, float dx, float dy)
 {
-	Entity *e;
-        int i, j;
+        float t, enter, exit, steps, x, y, rx, ry, ex, ey;
+        Mask *bm, *em;
+        int i, b, e;
+
+        b = ENTITY_INDEX(bullet);
+        e = ENTITY_INDEX(target);
+
+        x = FROM_PRECISE(world.x[b], world.fx[b]) - FROM_VELOCITY(world.dx[b]);
+        y = FROM_PRECISE(world.y[b], world.fy[b]) - FROM_VELOCITY(world.dy[b]);
+        rx = FROM_VELOCITY(world.dx[b]) - dx;
+        ry = FROM_VELOCITY(world.dy[b]) - dy;
+        ex = FROM_PRECISE(world.x[e], world.fx[e]) - dx;
+        ey = FROM_PRECISE(world.y[e], world.fy[e]) - dy;
 
-        if (b->side != SIDE_ENEMY)
+        enter = sweepBox(x, y, world.w[b], world.h[b], rx, ry, ex, ey, world.w[e], world.h[e], &exit);
+
+        if (enter < 0)
         {
-                for (i = 0; i < ENEMY_ROW; i++)
-                {
-                        for (j = 0; j < ENEMY_COL; j++)
-                        {
-                                e = stage.enemies[i][j];
-                                
-                                if (e != NULL
-                                    && collision(b->x, b->y, b->w, b->h, e->x, e->y, e->w, e->h))
-                                {                                        
-                                        b->health = 0;
-                                        e->health = 0;
+                return -1;
+        }
 
-                                        addExplosions(e->x, e->y, 32);
+        bm = (world.texture[b] != NULL) ? getTextureMask(world.texture[b]) : NULL;
+        em = (world.texture[e] != NULL) ? getTextureMask(world.texture[e]) : NULL;
 
-                                        addDebris(e);
+        steps = MAX(fabs(rx), fabs(ry));
 
-                                        playSound(SND_ALIEN_DIE, CH_ANY);
-                                        
-                                        stage.score += e->points;
-                                        
-                                        return 1;
-                                }
-                        } // Next j
-                } // Next i
+        for (i = 0; ; i++)
+        {
+                t = (steps > 0) ? MIN(enter + i / steps, exit) : exit;
+
+                if (maskCollision(bm, lrintf(x + rx * t), lrintf(y + ry * t), em, lrintf(ex), lrintf(ey)))
+                {
+                        return t;
+                }
+
+                if (t >= exit)
+                {
+                        return -1;
+                }
         }
-	return 0;
 }
 
 // Do enemies actions.
@@ -458,29 +1077,49 @@ static void doEnemies(void)
 }
 
 // Shoot player.
-// for each enemy on the matrix, check if the enemy is alive,
+// for the lowest enemy alive of each column,
 // decrease the enemy's weapon reloading and chech if the weapon reloading is finish, then
 // fire a bullet, and play a sound.
+// On the stress stage, every enemy fires, and not only the lowest of each column.
 static void shootPlayer(void)
 {
-        int i, j;
-        
-        for (j = 0; j < ENEMY_COL; j++)
-        {        
-                for (i = ENEMY_ROW - 1; i >= 0; i--)
+        int i, j, n, id;
+
+        if (app.stress)
+        {
+                for (i = 0; i < stage.rows; i++)
                 {
-                        if (stage.enemies[i][j] != NULL)
+                        for (j = 0; j < stage.cols; j++)
                         {
-                                if (--stage.enemies[i][j]->reload <= 0)
+                                id = stage.enemies[i][j];
+
+                                if (id != 0 && --world.reload[ENTITY_INDEX(id)] <= 0)
                                 {
-                                        playSound(SND_ALIEN_FIRE, CH_ALIEN_FIRE);
-                                        
-                                        fireEnemyBullet(stage.enemies[i][j]);
+                                        n = ENTITY_INDEX(id);
+
+                                        playSound(SND_ALIEN_FIRE, FROM_FIXED(world.x[n]) + world.w[n] / 2);
+
+                                        fireSpread(id);
                                 }
-                                break;
                         }
-                        
-                } // Next i
+                }
+
+                return;
+        }
+        
+        // Only the lowest enemy of each column fires
+        for (j = 0; j < stage.cols; j++)
+        {        
+                i = stage.columnBottoms[j];
+
+                if (i >= 0 && --world.reload[ENTITY_INDEX(stage.enemies[i][j])] <= 0)
+                {
+                        n = ENTITY_INDEX(stage.enemies[i][j]);
+
+                        playSound(SND_ALIEN_FIRE, FROM_FIXED(world.x[n]) + world.w[n] / 2);
+                                        
+                        fireEnemyBullet(stage.enemies[i][j]);
+                }
         } // Next j
 }
 
@@ -488,32 +1127,38 @@ static void shootPlayer(void)
 // Move enemies together on the screen.
 // Every step time, move enemies from left to right, then move them down, and then
 // move them from right to left, next repeat these actions.
+// Every enemy has the size of the formation cells, and steps by an eighth of it.
+// The formation layer and the enemy colliders follow the enemies with the same step.
 static void moveEnemies(void)
 {
-        Entity *e;
-        int i, j;
+        int i, j, n, w, h, dx, dy;
         
 	if (--enemyStepTimer <= 0)
 	{
-                for (i = 0; i < ENEMY_ROW; i++)
+                getTextureSize(enemySmallTexture, &w, &h);
+
+                dx = enemyMoveDown ? 0 : enemyDirection * MAX(1, w / 8);
+                dy = enemyMoveDown ? MAX(1, h / 8) : 0;
+
+                for (i = 0; i < stage.rows; i++)
                 {        
-                        for (j = 0; j < ENEMY_COL; j++)
+                        for (j = 0; j < stage.cols; j++)
                         {
-                                e = stage.enemies[i][j];
-                                
-                                if (e != NULL)
+                                if (stage.enemies[i][j] != 0)
                                 {                                
-                                        if (enemyMoveDown)
-                                        {
-                                                e->y += e->dy;
-                                        }
-                                        else
-                                        {
-                                                e->x += enemyDirection * e->dx;
-                                        }
+                                        n = ENTITY_INDEX(stage.enemies[i][j]);
+
+                                        world.x[n] += TO_FIXED(dx);
+                                        world.y[n] += TO_FIXED(dy);
+
+                                        moveCollider(world.collider[n], FROM_FIXED(world.x[n]), FROM_FIXED(world.y[n]), world.w[n], world.h[n]);
+                                        hashEntity(stage.enemies[i][j], HASH_FORMATION);
                                 }
                         } // Next j
                 } // Next i
+
+                formationLayer.x += dx;
+                formationLayer.y += dy;
                 
 		if(enemyMoveDown == TRUE)
 		{
@@ -534,21 +1179,44 @@ static void moveEnemies(void)
 // increase the number of enemy destroyed in order to be able to detect
 // when all enemies are destroyed.
 // When all enemies are destroyed signal it to reset the game.
+// The matrix is only checked after an enemy was hit, and the lowest enemy
+// of the column is found again when it is destroyed.
 static void destroyEnemies(void)
 {
-        Entity *e;
-        int i, j;
+        SDL_Rect r;
+        int i, j, n;
+
+        if (enemiesHit == 0)
+        {
+                return;
+        }
+
+        enemiesHit = 0;
         
-        for (i = 0; i < ENEMY_ROW; i++)
+        for (i = 0; i < stage.rows; i++)
         {        
-                for (j = 0; j < ENEMY_COL; j++)
+                for (j = 0; j < stage.cols; j++)
                 {
-                        e = stage.enemies[i][j];
+                        n = ENTITY_INDEX(stage.enemies[i][j]);
                         
-                        if (e != NULL && e->health == 0)
+                        if (stage.enemies[i][j] != 0 && world.health[n] == 0)
                         {
-                                stage.enemies[i][j] = NULL;
+                                r.x = FROM_FIXED(world.x[n]);
+                                r.y = FROM_FIXED(world.y[n]);
+                                r.w = world.w[n];
+                                r.h = world.h[n];
+
+                                clearLayer(&formationLayer, &r);
+
+                                destroyEntity(stage.enemies[i][j]);
+                                stage.enemies[i][j] = 0;
+                                stage.numEnemies--;
                                 enemyDestroyedNumber++;
+
+                                while (stage.columnBottoms[j] >= 0 && stage.enemies[stage.columnBottoms[j]][j] == 0)
+                                {
+                                        stage.columnBottoms[j]--;
+                                }
                         }
                 } // Next j
         } // Next i
@@ -560,33 +1228,60 @@ static void destroyEnemies(void)
 }
 
 // Fire enemy bullet.
-// Allocate memory space to the entity, add the entity to the bullet linked list,
+// Create a bullet entity, which is an entity with a velocity,
 // assign the enemy position to the entity, query texture parameters,
-// initialize entity properties, and reload enemy's weapon.
-static void fireEnemyBullet(Entity *e)
+// initialize its components, and reload enemy's weapon. Return the bullet id.
+static int fireEnemyBullet(int enemy)
 {
-        Entity *bullet;
+        int bullet, n, e;
+
+        e = ENTITY_INDEX(enemy);
 
-        bullet = malloc(sizeof(Entity));
-        memset(bullet, 0, sizeof(Entity));
-        stage.bulletTail->next = bullet;
-        stage.bulletTail = bullet;
+        bullet = createEntity(COMPONENT_POSITION | COMPONENT_VELOCITY | COMPONENT_SPRITE | COMPONENT_HEALTH | COMPONENT_COLLIDER);
+        n = ENTITY_INDEX(bullet);
 
-        bullet->x = e->x;
-        bullet->y = e->y;
+        world.x[n] = world.x[e];
+        world.y[n] = world.y[e];
         
-        bullet->texture = enemyBulletTexture;
-        SDL_QueryTexture(bullet->texture, NULL, NULL, &bullet->w, &bullet->h);
+        world.texture[n] = enemyBulletTexture;
+        getTextureSize(world.texture[n], &world.w[n], &world.h[n]);
 
-        bullet->x += (e->w / 2) - (bullet->w / 2);
-        bullet->y += (e->h / 2) - (bullet->h / 2);
+        world.x[n] += TO_FIXED((world.w[e] / 2) - (world.w[n] / 2));
+        world.y[n] += TO_FIXED((world.h[e] / 2) - (world.h[n] / 2));
         
-        bullet->dy = ENEMY_BULLET_SPEED;
+        world.dy[n] = TO_VELOCITY(ENEMY_BULLET_SPEED);
 
-        bullet->side = e->side;
-        bullet->health = 1;
+        world.health[n] = 1;
+        world.collider[n] = addCollider(COLLIDE_ENEMY_BULLET, (app.stress ? 0 : COLLIDE_PLAYER) | COLLIDE_PLAYER_BULLET | COLLIDE_SHIELD, bullet);
+        stage.numBullets++;
         
-        e->reload = (rand() % FPS * 10);
+        world.reload[e] = (getRandom(FPS) * 10);
+
+        return bullet;
+}
+
+// Fire a fan of bullets, on the stress stage.
+// The fan turns a quarter of the angle between its bullets every time, so the
+// bullets fill the screen instead of following the same lines.
+static void fireSpread(int enemy)
+{
+        float step, angle;
+        int i, n;
+
+        step = 2.0 * STRESS_ANGLE / STRESS_SPREAD;
+
+        for (i = 0; i < STRESS_SPREAD; i++)
+        {
+                angle = (-STRESS_ANGLE + step * (i + (spreadPhase % 4) / 4.0)) * M_PI / 180;
+
+                n = ENTITY_INDEX(fireEnemyBullet(enemy));
+                world.dx[n] = TO_VELOCITY(ENEMY_BULLET_SPEED * sin(angle));
+                world.dy[n] = TO_VELOCITY(ENEMY_BULLET_SPEED * cos(angle));
+        }
+
+        spreadPhase++;
+
+        world.reload[ENTITY_INDEX(enemy)] = STRESS_RELOAD;
 }
 
 // Clip enemy movements.
@@ -602,53 +1297,34 @@ static void clipEnemies(void)
         }
 }
 
-// Clip player movements.
-// Keep player inside the screen.
-static void clipPlayer(void)
+// Clip players movements.
+// Keep players inside the screen.
+static void clipPlayers(void)
 {
-	if (player != NULL)
-	{
-		if (player->x < HORIZONTAL_POSITION)
+        int i, n;
+
+        for (i = 0; i < MAX_PLAYERS; i++)
+        {
+	        if (players[i] == 0)
+	        {
+                        continue;
+                }
+
+                n = ENTITY_INDEX(players[i]);
+
+		if (world.x[n] < TO_FIXED(HORIZONTAL_POSITION))
 		{
-			player->x = HORIZONTAL_POSITION;
+			world.x[n] = TO_FIXED(HORIZONTAL_POSITION);
 		}
 		
-		if (player->x > SCREEN_WIDTH - HORIZONTAL_POSITION - player->w)
+		if (world.x[n] > TO_FIXED(SCREEN_WIDTH - HORIZONTAL_POSITION - world.w[n]))
 		{
-			player->x = SCREEN_WIDTH - HORIZONTAL_POSITION - player->w;
+			world.x[n] = TO_FIXED(SCREEN_WIDTH - HORIZONTAL_POSITION - world.w[n]);
 		}
-	}
-}
-
-// Do explosions actions.
-// For each explosion, move it and destroy it after a while.
-static void doExplosions(void)
-{
-        Explosion *ex, *prev;
-
-        prev = &stage.explosionHead;
-
-        for (ex = stage.explosionHead.next; ex != NULL; ex = ex->next)
-        {
-                ex->x += ex->dx;
-                ex->y += ex->dy;
-
-                // Decrease opacity and delete explosion.
-                // Decrease the explosion's opacity and delete it when it is not visible. 
-                if (--ex->a <= 0)
-                {
-                        if (ex == stage.explosionTail)
-                        {
-                                stage.explosionTail = prev;
-                        }
 
-                        prev->next = ex->next;
-                        free(ex);
-                        ex = prev;
-                }
-
-                prev = ex;
-        }
+                // The players are hashed every tick, once their positions are final
+                hashEntity(players[i], HASH_PLAYER);
+	}
 }
 
 // Do debris actions.
@@ -677,7 +1353,8 @@ static void doDebris(void)
 			}
 			
 			prev->next = d->next;
-			free(d);
+			d->next = freeDebris;
+			freeDebris = d;
 			d = prev;
 		}
 		
@@ -686,51 +1363,23 @@ static void doDebris(void)
 }
 
 // Add an explosion.
-// An explosion is composed of 'num' number of explosion elements.
-// For each explosion element, allocate memory, add the element to the linked list,
-// assign its position and its speed with a random variation, and assign its color.
+// An explosion is a burst of 'num' particles around the position, less when the
+// quality is lowered, in red, orange, yellow and white.
 static void addExplosions(int x, int y, int num)
 {
-        Explosion *ex;
-        int i;
-
-        for (i = 0; i < num; i++)
-        {
-                ex = malloc(sizeof(Explosion));
-                memset(ex, 0, sizeof(Explosion));
-                stage.explosionTail->next = ex;
-                stage.explosionTail = ex;
-
-                ex->x = x + (rand() % 32) - (rand() % 32);
-                ex->y = y + (rand() % 32) - (rand() % 32);
-                
-                ex->dx = (rand() % 10) - (rand() % 10);
-                ex->dy = (rand() % 10) - (rand() % 10);
-                ex->dx /= 10;
-                ex->dy /= 10;
-
-                switch (rand() % 4)
-                {
-                case 0:
-                        ex->r = 255;
-                        break;
-                case 1:
-                        ex->r = 255;
-                        ex->g = 128;
-                        break;
-                case 2:
-                        ex->r = 255;
-                        ex->g = 255;
-                        break;
-                default:
-                        ex->r = 255;
-                        ex->g = 255;
-                        ex->b = 255;
-                        break;
-                }
-
-                ex->a = rand() % FPS * 3;
-        }
+        static Uint32 colors[] = {0xFF0000, 0xFF8000, 0xFFFF00, 0xFFFFFF};
+        ParticleBurst burst;
+
+        burst.x = x;
+        burst.y = y;
+        burst.spread = 31;
+        burst.speed = 0.9;
+        burst.minLife = 1;
+        burst.maxLife = FPS * 3;
+        burst.palette = colors;
+        burst.numColors = 4;
+
+        addParticles(&burst, MAX(1, num * getQuality()->particles));
 }
 
 // Add debris.
@@ -738,32 +1387,33 @@ static void addExplosions(int x, int y, int num)
 // For each debris' part, allocate memory, add it to the linked list,
 // assign its position according to the entity, assign its speed with a random variation,
 // assign its properties, and assign a part of the entity to the debris.
-static void addDebris(Entity *e)
+static void addDebris(int id)
 {
 	Debris *d;
-	int x, y, w, h;
+	int x, y, w, h, e;
 	
-	w = e->w / 2;
-	h = e->h / 2;
+        e = ENTITY_INDEX(id);
+
+	w = world.w[e] / 2;
+	h = world.h[e] / 2;
 	
 	for (y = 0 ; y <= h ; y += h)
 	{
 		for (x = 0 ; x <= w ; x += w)
 		{
-			d = malloc(sizeof(Debris));
-			memset(d, 0, sizeof(Debris));
+			d = newDebris();
 			stage.debrisTail->next = d;
 			stage.debrisTail = d;
 			
-			d->x = e->x + e->w / 2;
-			d->y = e->y + e->h / 2;
+			d->x = FROM_FIXED(world.x[e]) + world.w[e] / 2;
+			d->y = FROM_FIXED(world.y[e]) + world.h[e] / 2;
                         
-			d->dx = (rand() % 5) - (rand() % 5);
-			d->dy = -(5 + (rand() % 12));
+			d->dx = getCosmeticRandom(5) - getCosmeticRandom(5);
+			d->dy = -(5 + getCosmeticRandom(12));
 
-                        d->texture = e->texture;
+                        d->texture = world.texture[e];
                         
-			d->life = FPS * 2;
+			d->life = MAX(1, FPS * 2 * getQuality()->debrisLife);
 			
 			d->rect.x = x;
 			d->rect.y = y;
@@ -777,54 +1427,125 @@ static void draw(void)
 {
         drawBackground();
         
-	drawPlayer();
+	drawPlayers();
 
         drawEnemies();
 
+        drawShields();
+
         drawDebris();
 
-        drawExplosions();
+        drawParticles(explosionTexture);
 
 	drawBullets();
 
         drawHud();
 }
 
-static void drawPlayer(void)
+static void drawPlayers(void)
 {
-	if (player != NULL)
+        int i, n;
+
+        for (i = 0; i < MAX_PLAYERS; i++)
         {
-                blit(player->texture, player->x, player->y);
+	        if (players[i] != 0)
+                {
+                        n = ENTITY_INDEX(players[i]);
+
+                        blit(world.texture[n], FROM_FIXED(world.x[n]), FROM_FIXED(world.y[n]));
+                }
         }
 }
 
+// Draw enemies.
+// Compose the formation layer when its content is lost, then
+// draw the whole formation with a single copy.
 static void drawEnemies(void)
 {
-	Entity *e;
-        int i, j;
-        
-        for (i = 0; i < ENEMY_ROW; i++)
-        {        
-                for (j = 0; j < ENEMY_COL; j++)
-                {
-                        e = stage.enemies[i][j];
-                        
-                        if (e != NULL)
+        int i, j, n;
+
+        if (beginLayer(&formationLayer))
+        {
+                for (i = 0; i < stage.rows; i++)
+                {        
+                        for (j = 0; j < stage.cols; j++)
                         {
-                                blit(e->texture, e->x, e->y);
-                        }       
+                                if (stage.enemies[i][j] != 0)
+                                {
+                                        n = ENTITY_INDEX(stage.enemies[i][j]);
+
+                                        blit(world.texture[n], FROM_FIXED(world.x[n]), FROM_FIXED(world.y[n]));
+                                }       
+                        }
                 }
+
+                endLayer();
         }
+
+        drawLayer(&formationLayer);
 }
 
+// Draw the shield blocks which are still up.
+static void drawShields(void)
+{
+        SDL_Rect r;
+        int i, n;
+
+        for (i = 0; i < stage.numShieldBlocks; i++)
+        {
+                n = ENTITY_INDEX(stage.shields[i]);
+
+                if (world.health[n] > 0)
+                {
+                        r.x = FROM_FIXED(world.x[n]);
+                        r.y = FROM_FIXED(world.y[n]);
+                        r.w = world.w[n];
+                        r.h = world.h[n];
+
+                        fillRect(&r, 60, 160, 60);
+                }
+        }
+}
+
+// Draw bullets.
+// The player bullets are gathered from the start of the positions, the enemy ones
+// from the end, and each kind is drawn with a single batch.
 static void drawBullets(void)
 {
-	Entity *b;
+        static SDL_FPoint *points;
+        static int capacity;
+        int i, n, m;
+
+        if (stage.numBullets > capacity)
+        {
+                capacity = MAX(stage.numBullets, capacity * 2);
+                points = realloc(points, capacity * sizeof(SDL_FPoint));
+        }
 
-	for (b = stage.bulletHead.next; b != NULL; b = b->next)
+        n = 0;
+        m = capacity;
+
+	for (i = 0; i < world.size; i++)
 	{
-		blit(b->texture, b->x, b->y);
+                if (!(world.components[i] & COMPONENT_VELOCITY))
+                {
+                        continue;
+                }
+
+                if (world.texture[i] == bulletTexture)
+                {
+                        points[n].x = FROM_FIXED(world.x[i]);
+                        points[n++].y = FROM_FIXED(world.y[i]);
+                }
+                else
+                {
+                        points[--m].x = FROM_FIXED(world.x[i]);
+                        points[m].y = FROM_FIXED(world.y[i]);
+                }
 	}
+
+        blitSprites(bulletTexture, points, n);
+        blitSprites(enemyBulletTexture, &points[m], capacity - m);
 }
 
 static void drawDebris(void)
@@ -837,25 +1558,6 @@ static void drawDebris(void)
 	}
 }
 
-static void drawExplosions(void)
-{
-        Explosion *ex;
-
-        // Manage blend color renderer for explosions
-        SDL_SetRenderDrawBlendMode(app.renderer, SDL_BLENDMODE_ADD);
-        SDL_SetTextureBlendMode(explosionTexture, SDL_BLENDMODE_ADD);
-
-        for (ex = stage.explosionHead.next; ex != NULL; ex = ex->next)
-        {
-                SDL_SetTextureColorMod(explosionTexture, ex->r, ex->g, ex->b);
-                SDL_SetTextureAlphaMod(explosionTexture, ex->a);
-
-                blit(explosionTexture, ex->x, ex->y);
-        }
-
-        SDL_SetRenderDrawBlendMode(app.renderer, SDL_BLENDMODE_NONE);
-}
-
 static void drawHud(void)
 {
         drawText(100, 10, 255, 255, 255, TEXT_CENTER, "SCORE<1>");
@@ -875,3 +1577,39 @@ static void drawHud(void)
                 
 	}	
 }
+
+// Fill the pools.
+// Reserve the world entities and allocate the debris of a typical stage at once,
+// so none is allocated while playing. The pools still grow when they are empty.
+// The stress stage holds tens of thousands of bullets.
+static void fillPools(void)
+{
+        Debris *debris;
+        int i;
+
+        initWorld(app.stress ? STRESS_POOL_SIZE : ENTITY_POOL_SIZE);
+
+        debris = calloc(DEBRIS_POOL_SIZE, sizeof(Debris));
+
+        for (i = 0; i < DEBRIS_POOL_SIZE; i++)
+        {
+                debris[i].next = freeDebris;
+                freeDebris = &debris[i];
+        }
+}
+
+static Debris *newDebris(void)
+{
+        Debris *d;
+
+        if (freeDebris == NULL)
+        {
+                return calloc(1, sizeof(Debris));
+        }
+
+        d = freeDebris;
+        freeDebris = d->next;
+        memset(d, 0, sizeof(Debris));
+
+        return d;
+}
@@ -19,17 +19,69 @@
 
 #include "common.h"
 
+extern int addCollider(int layer, int mask, int owner);
 extern void addHighscore(int score);
+extern void addParticles(ParticleBurst *burst, int num);
+extern int beginLayer(Layer *layer);
 extern void blit(SDL_Texture *texture, int x, int y);
 extern void blitRect(SDL_Texture *texture, SDL_Rect *src, int x, int y);
-extern int collision(int x1, int y1, int w1, int h1, int x2, int y2, int w2, int h2);
+extern void blitSprites(SDL_Texture *texture, SDL_FPoint *points, int n);
+extern void clearColliders(void);
+extern void clearLayer(Layer *layer, SDL_Rect *rect);
+extern void clearParticles(void);
+extern void clearWorld(void);
+extern int createEntity(int components);
+extern void destroyEntity(int id);
 extern void doBackground(void);
+extern void doParticles(void);
 extern void drawBackground(void);
+extern void drawLayer(Layer *layer);
+extern void drawParticles(SDL_Texture *texture);
 extern void drawText(int x, int y, int r, int g, int b, int align, char *format, ...);
+extern void endLayer(void);
+extern void endReplay(void);
+extern void fillRect(SDL_Rect *rect, int r, int g, int b);
+extern int findColliderPairs(void (*pair)(Collider *a, Collider *b, void *data), void *data);
+extern int getCosmeticRandom(int n);
+extern int getEntityId(int n);
+extern int getKeyboardInput(void);
+extern Quality *getQuality(void);
+extern int getRandom(int n);
+extern Uint32 getRandomState(void);
+extern int getTextureIndex(SDL_Texture *texture, SDL_Texture **textures, int numTextures);
+extern Mask *getTextureMask(SDL_Texture *texture);
+extern void getTextureSize(SDL_Texture *texture, int *w, int *h);
+extern void hashEntity(int id, int group);
+extern void hashMovingEntities(int group);
 extern void initHighscores(void);
+extern void initLayer(Layer *layer, int x, int y, int w, int h);
+extern void initWorld(int capacity);
+extern int isEntityAlive(int id);
+extern SDL_Texture *loadScaledTexture(char *filename, int w, int h);
 extern SDL_Texture *loadTexture(char *filename);
-extern void playSound(int id, int channel);
+extern void loadWorld(Snapshot *s, SDL_Texture **textures, int numTextures);
+extern int maskCollision(Mask *m1, int x1, int y1, Mask *m2, int x2, int y2);
+extern Uint32 mixHash(Uint32 h);
+extern void moveCollider(int id, float x, float y, float w, float h);
+extern void playSound(int id, int x);
+extern int pumpLoader(Uint32 timeout);
+extern Load *queueTexture(char *filename);
+extern float readSnapshotFloat(Snapshot *s);
+extern int readSnapshotInt(Snapshot *s, int bytes);
+extern int readSnapshotRange(Snapshot *s, int bytes, int min, int max);
+extern void removeCollider(int id);
+extern void replayHashes(void);
+extern void replayInput(void);
+extern void saveWorld(Snapshot *s, SDL_Texture **textures, int numTextures);
+extern void setRandomState(Uint32 state);
+extern void startLoader(void);
+extern void startRecording(void);
+extern void stopSounds(void);
+extern float sweepBox(float x, float y, float w, float h, float dx, float dy, float bx, float by, float bw, float bh, float *exit);
+extern void writeSnapshotFloat(Snapshot *s, float value);
+extern void writeSnapshotInt(Snapshot *s, int value, int bytes);
 
 extern App app;
 extern Highscores highscores;
 extern Stage stage;
+extern World world;
@@ -18,14 +18,36 @@
 */
 
 typedef struct App App;
+typedef struct Boxes Boxes;
+typedef struct Collider Collider;
+typedef struct Contact Contact;
 typedef struct Debris Debris;
 typedef struct Delegate Delegate;
-typedef struct Entity Entity;
-typedef struct Explosion Explosion;
 typedef struct Highscore Highscore;
 typedef struct Highscores Highscores;
+typedef struct Layer Layer;
+typedef struct Load Load;
+typedef struct Mask Mask;
+typedef struct MixerCommand MixerCommand;
+typedef struct NetPacket NetPacket;
+typedef struct PackEntry PackEntry;
+typedef struct PackHeader PackHeader;
+typedef struct ParticleBurst ParticleBurst;
+typedef struct Quality Quality;
+typedef struct Sound Sound;
+typedef struct Snapshot Snapshot;
 typedef struct Stage Stage;
 typedef struct Texture Texture;
+typedef struct TileSlot TileSlot;
+typedef struct Voice Voice;
+typedef struct World World;
+
+// Position or velocity of an entity, see FIXED_BITS and VELOCITY_BITS
+#ifdef FLOAT_POSITIONS
+typedef float Fixed;
+#else
+typedef Sint16 Fixed;
+#endif
 
 // Logic and Draw methods are called in the main game loop and
 // connect to alternatively to the following views: title, highscores or stage. 
@@ -37,6 +59,11 @@ struct Delegate {
 struct Texture {
 	char name[MAX_NAME_LENGTH];
 	SDL_Texture *texture;
+	int w;                // Width of the image, in screen coordinates
+	int h;                // Height of the image, in screen coordinates
+	SDL_Surface *surface; // ARGB8888 pixels used by the software framebuffer
+	int opaque;           // TRUE when every pixel of the surface is opaque
+	Mask *mask;           // Collision mask, NULL when the sprite collides by its bounds
 	Texture *next;
 };
 
@@ -47,31 +74,161 @@ struct App {
 	int keyboard[MAX_KEYBOARD_KEYS];
 	Texture textureHead, *textureTail;
         char inputText[MAX_LINE_LENGTH];
+        int layerGeneration; // Increased when the render targets are lost, to compose layers again
+        int redraw;          // TRUE when the visual state changed and the screen must be drawn again
+        int attract;         // TRUE on title and highscore screens, when nobody is playing
+        int attractScrollRate; // Frames between two background steps on attract screens, 1 by default
+        int software;        // TRUE when drawing headless in the software framebuffer
+        SDL_Surface *framebuffer;
+        float renderScale;   // Internal resolution, as a fraction of the screen size
+        int sceneFilter;     // SDL_ScaleModeNearest or SDL_ScaleModeLinear to upscale the scene
+        SDL_Texture *scene;  // Offscreen target when the internal resolution is lower
+        Uint64 startTime;    // Performance counter when the program started
+        int audioSamples;    // Audio buffer size, in sample frames
+        int quality;         // Quality level, 0 is the full quality
+        int fixedQuality;    // TRUE when the quality level is given on the command line
+        float sceneScale;    // Fraction of the internal resolution the scene is composed at
+        int overlay;         // TRUE to show the debug overlay
+        int stress;          // TRUE to play the bullet stress stage and print its timings
+        int noDraw;          // TRUE to run the logic only, without drawing
+        int formationRows;   // Rows of the enemy formation
+        int formationCols;   // Columns of the enemy formation
+        int numPlayers;      // Players of the stage, 2 in a network game
+        int inputs[MAX_PLAYERS]; // INPUT_ bits of each player for the stage tick
+        int netplay;         // TRUE in a network game
+        int rollback;        // TRUE while the network game simulates frames again
+        int netLatency;      // Milliseconds the network packets are delayed by, to test the rollbacks
+        int netLoss;         // Percentage of the network packets dropped
 };
 
-// Entity defines the player, an enemy or bullets.
-struct Entity {
-	float x;       // Horizontal position on the screen
-	float y;       // Vertical position on the screen
-	int w;         // Width of the texture
-	int h;         // Height of the texture
-	float dx;      // Horizontal speed
-	float dy;      // Vertical speed
-	int health;    // Health of the entity, when it is 0 the enetity is removed
-	int reload;    // Weapon reloading
-	int side;      // PLAYER_SIDE or ENEMY_SIDE
-        int points;    // Enemy points add to score when there are destroy, not used for player
-	SDL_Texture *texture;
-        Entity *next; // Next element of the linked list 
+// Layer caches the static part of a screen in a render target texture.
+// The layer is composed again only when it is dirty, otherwise it is drawn with a single copy.
+struct Layer {
+	int x;                // Horizontal position of the layer on the screen
+	int y;                // Vertical position of the layer on the screen
+	int w;                // Width of the layer
+	int h;                // Height of the layer
+	int dirty;            // TRUE when the layer content must be composed again
+	int generation;       // App layer generation of the layer content
+	SDL_Texture *texture; // Render target holding the layer content
+	SDL_Surface *surface; // Layer content when drawing in the software framebuffer
+};
+
+// TileSlot is a place for a background tile in the tiles texture.
+struct TileSlot {
+	int tile;             // Tile held by the slot, -1 when the slot is free
+	int lastUsed;         // Last frame the tile was drawn, to reuse the least recently used slot
+};
+
+// Quality holds the cosmetic settings of a quality level, lowered when frames are too long.
+struct Quality {
+	float particles;      // Fraction of the particles of an explosion
+	float debrisLife;     // Fraction of the debris lifetime
+	int scrollRate;       // Frames between background moves
+	float sceneScale;     // Fraction of the internal resolution used to compose the scene
+};
+
+// Load is a texture or a sound decoded on a loader thread, then uploaded on the render thread.
+struct Load {
+	char filename[MAX_PACK_NAME_LENGTH];
+	int type;                 // LOAD_TEXTURE or LOAD_SOUND
+	SDL_atomic_t state;       // LOAD_QUEUED, LOAD_DECODED, LOAD_READY or LOAD_FAILED
+	SDL_Surface *surface;     // Decoded ARGB8888 pixels of a texture
+	int w;                    // Width of the image, in screen coordinates
+	int h;                    // Height of the image, in screen coordinates
+	int opaque;               // TRUE when every pixel of the image is opaque
+	Mask *mask;               // Collision mask
+	Uint8 *samples;           // Decoded samples of a sound, in the mixer format
+	Uint32 length;            // Size of the samples, in bytes
+	int packed;               // TRUE when the samples are mapped from the asset pack
+	SDL_Texture *texture;     // Texture handle, once ready
+	struct Mix_Chunk *sound;  // Sound handle, once ready
+};
+
+// Boxes is a packed array of bounding boxes, tested against a box at once.
+struct Boxes {
+	float *x;                 // Left of each box, on the screen
+	float *y;                 // Top of each box, on the screen
+	float *w;                 // Width of each box
+	float *h;                 // Height of each box
+	Uint32 *hits;             // Bitmask of the boxes hit by the last findCollisions()
+	int count;                // Number of boxes
+	int capacity;             // Number of boxes allocated, a multiple of 64
+};
+
+// Collider is an entry of the broadphase, with its bounds for the current tick.
+struct Collider {
+	float x;                  // Left of the bounds, on the screen
+	float y;                  // Top of the bounds, on the screen
+	float w;                  // Width of the bounds, negative until the collider is moved
+	float h;                  // Height of the bounds
+	int layer;                // COLLIDE_ bit of the collider
+	int mask;                 // COLLIDE_ bits of the layers it collides with
+	int owner;                // Entity id of the collider, 0 once removed
+	int next;                 // Next free collider id
+};
+
+// Contact is a hit found by the narrow phase, applied in the order of the hits.
+struct Contact {
+	int a;                    // Entity id of the bullet
+	int b;                    // Entity id of what the bullet hits
+	int layer;                // COLLIDE_ bit of the target
+	float t;                  // Fraction of the tick when they hit
+};
+
+// Mask is the 1 bit collision mask of a sprite, in screen coordinates.
+struct Mask {
+	int w;                    // Width in pixels
+	int h;                    // Height in pixels
+	int words;                // 64 bits words per row
+	Uint64 *rows;             // Rows of 'words' words, the leftmost pixel in the lowest bit
 };
 
-struct Explosion {
-        float x;         // Horizontal position on the screen
-        float y;         // Vertical position on the screen
-        float dx;        // Horizontal speed
-        float dy;        // Vertical speed
-        int r, g, b, a;  // Color red, green, blue, alpha
-        Explosion *next; // Next element of the linked list 
+// Sound is a sound effect, how it shares the mixer voices, and its requests in the current frame.
+struct Sound {
+	struct Mix_Chunk *chunk;
+	Load *load;        // Load of the chunk, until it is ready
+	int channel;       // SDL Mixer channel, when the sounds are not mixed in house
+	int maxVoices;     // Maximum number of voices playing the sound at once
+	int priority;      // Voices of lower priority sounds are stolen first
+	int requests;      // Number of requests in the frame, merged into one voice
+	int x;             // Sum of the horizontal positions of the requests
+};
+
+// MixerCommand is sent by the game thread to the mixer on the audio thread.
+struct MixerCommand {
+	int type;          // MIXER_PLAY or MIXER_STOP
+	int voice;         // Voice to stop; CH_ANY for every voice
+	int sound;         // Sound to play
+	int maxVoices;     // Maximum number of voices playing the sound at once
+	int priority;      // Priority of the sound to steal voices
+	Sint16 *samples;   // Interleaved stereo samples of the sound to play
+	Uint32 frames;     // Number of stereo frames of the sound
+	Sint16 left;       // Left gain, 1.0 is 1 << MIXER_GAIN_SHIFT
+	Sint16 right;      // Right gain, 1.0 is 1 << MIXER_GAIN_SHIFT
+};
+
+// Voice is a sound playing in the mixer, owned by the audio thread.
+struct Voice {
+	Sint16 *samples;   // Interleaved stereo samples, NULL when the voice is free
+	Uint32 frames;     // Number of stereo frames of the sound
+	Uint32 position;   // Next frame to mix
+	int sound;         // Sound playing
+	int priority;      // Priority of the sound
+	Sint16 left;       // Left gain, 1.0 is 1 << MIXER_GAIN_SHIFT
+	Sint16 right;      // Right gain, 1.0 is 1 << MIXER_GAIN_SHIFT
+};
+
+// ParticleBurst describes the particles emitted at once by an explosion.
+struct ParticleBurst {
+        float x;         // Horizontal position of the center on the screen
+        float y;         // Vertical position of the center on the screen
+        float spread;    // Particles start up to 'spread' away from the center, on each axis
+        float speed;     // Maximum speed, on each axis
+        int minLife;     // Lifetime range in frames, the opacity of a particle is its life
+        int maxLife;
+        Uint32 *palette; // 0xRRGGBB colors picked at random
+        int numColors;
 };
 
 struct Debris {
@@ -85,14 +242,82 @@ struct Debris {
         Debris *next;   // Next element of the linked list 
 };
 
+// World holds the components of the entities: the player, the enemies, the bullets
+// and the shield blocks. Each component is an array indexed by the entity index,
+// so a system only reads the components it needs. An entity id is its index with the
+// generation of the index above ENTITY_INDEX_BITS, so the id of a destroyed entity
+// doesn't match the entity which reuses its index. The arrays read every tick by the
+// bullets are the smallest: the components take a byte, the position and velocity
+// 8 bytes in fixed point, and the fractions of the position 2 bytes, so a bullet moves
+// reading 11 bytes.
+struct World {
+	int capacity;          // Size of the component arrays
+	int size;              // One past the highest index in use
+	int *generations;      // Generation of each index, increased when its entity is destroyed
+	Uint8 *components;     // COMPONENT_ bits of each entity, 0 when the index is free
+	Fixed *x;              // Position, on the screen, in FIXED_BITS fixed point
+	Fixed *y;
+	Uint8 *fx;             // Fraction of the position, below FIXED_BITS, in VELOCITY_BITS fixed point
+	Uint8 *fy;
+	Fixed *dx;             // Velocity, per tick, in VELOCITY_BITS fixed point
+	Fixed *dy;
+	SDL_Texture **texture; // Sprite, NULL for a plain block
+	int *w;                // Sprite size, on the screen
+	int *h;
+	int *health;           // Health, the entity is removed when it is 0
+	int *reload;           // Weapon reloading
+	int *points;           // Score given when the entity is destroyed
+	int *collider;         // Collider id in the broadphase, 0 when it was removed
+	Uint32 *hash;          // Hash of the components, 0 when the entity isn't hashed
+	Uint32 *hashBase;      // Hash of the components but the position
+	int *hashGroup;        // HASH_ part of the state the entity belongs to
+	Uint32 hashes[NUM_HASHES]; // Hashes of the entities of each part, combined with XOR
+};
+
+// Snapshot holds the state of the game serialized in a compact binary blob,
+// with the numbers in little endian order.
+struct Snapshot {
+	Uint8 *data;           // Serialized state
+	int size;              // Bytes of serialized state
+	int capacity;          // Bytes allocated for the state
+	int position;          // Read position while restoring
+	int version;           // SNAPSHOT_ version of the state being restored
+};
+
 struct Stage {
-	Entity bulletHead, *bulletTail;          // Bullet linked list
-        Explosion explosionHead, *explosionTail; // Explosion linked list
         Debris debrisHead, *debrisTail;          // Debris linked list
-        Entity* enemies[ENEMY_ROW][ENEMY_COL];   // Enemies matrix
+        int **enemies;                           // Enemies matrix of entity ids, 0 once destroyed, rows of a dense array
+        int *columnBottoms;                      // Row of the lowest enemy alive in each column, -1 when empty
+        int rows;                                // Rows of the enemies matrix
+        int cols;                                // Columns of the enemies matrix
+        int shields[MAX_SHIELD_BLOCKS];          // Entity ids of the shield blocks
+        int numShieldBlocks;                     // Number of shield blocks
+        int numBullets;                          // Number of live bullets
+        int numEnemies;                          // Number of enemies alive
         int score;                               // Current game score
 };
 
+// The asset pack starts with a header, followed by the table of contents sorted by name,
+// then the data of each entry aligned on PACK_ALIGN bytes.
+struct PackHeader {
+	char magic[4];      // PACK_MAGIC
+	Uint32 version;     // PACK_VERSION
+	Uint32 numEntries;  // Number of entries in the table of contents
+	Uint32 frequency;   // Mixer frequency of the sounds
+	Uint32 format;      // Mixer sample format of the sounds
+	Uint32 channels;    // Mixer channels of the sounds
+};
+
+struct PackEntry {
+	char name[MAX_PACK_NAME_LENGTH]; // File name of the asset, as loaded by the game
+	Uint32 type;                     // PACK_IMAGE, PACK_SOUND or PACK_MUSIC
+	Uint32 offset;                   // Offset of the data from the start of the pack
+	Uint32 size;                     // Size of the data in bytes
+	Uint32 w;                        // Width of an image, its ARGB8888 pixels are not padded
+	Uint32 h;                        // Height of an image
+	Uint32 opaque;                   // TRUE when every pixel of an image is opaque
+};
+
 struct Highscore {
         char name[MAX_SCORE_NAME_LENGTH]; // Name of the user who realised the highscore
 	int recent;                       // Define if the highscore is new to add it to the table
@@ -102,3 +327,10 @@ struct Highscore {
 struct Highscores {
 	Highscore highscore[NUM_HIGHSCORES]; // Highscore array
 };
+
+// NetPacket is a network packet held back by the artificial latency.
+struct NetPacket {
+	Uint32 time;                // Ticks when the packet is sent
+	int size;
+	Uint8 data[NET_MAX_PACKET];
+};
@@ -23,18 +23,34 @@ static void logic(void);
 static void draw(void);
 static void drawLogo(void);
 
+static Layer titleLayer;
 static SDL_Texture *titleTexture;
+static int blink;
 static int reveal = 0;
+static int titleHeight;
+static int titleWidth;
 static int timeout;
 
 void initTitle(void)
 {
 	app.delegate.logic = logic;
 	app.delegate.draw = draw;
+
+        app.attract = TRUE;
+        app.redraw = TRUE;
 	
 	memset(app.keyboard, 0, sizeof(int) * MAX_KEYBOARD_KEYS);
 	
 	titleTexture = loadTexture("gfx/title.png");
+	getTextureSize(titleTexture, &titleWidth, &titleHeight);
+
+        // The title layer holds the logo and the blinking text
+        if (titleLayer.w == 0)
+        {
+                initLayer(&titleLayer, 0, 100, SCREEN_WIDTH, 600 + GLYPH_HEIGHT - 100);
+        }
+
+        titleLayer.dirty = TRUE;
 	
 	timeout = FPS * 5;
 }
@@ -43,10 +59,18 @@ static void logic(void)
 {
 	doBackground();
 
+        prepareStage();
+
         // Apply a discovery graphic effect on the logo 
 	if (reveal < SCREEN_HEIGHT)
 	{
 		reveal++;
+
+                // The logo changes until it is entirely revealed
+                if (reveal <= titleHeight)
+                {
+                        titleLayer.dirty = TRUE;
+                }
 	}
 
         // Display alternatively highscore and title screens
@@ -55,6 +79,18 @@ static void logic(void)
 		initHighscores();
 	}
 
+        // Swap the text blink phase every 20 frames
+        if ((timeout % 40 < 20) != blink)
+        {
+                blink = !blink;
+                titleLayer.dirty = TRUE;
+        }
+
+        if (titleLayer.dirty)
+        {
+                app.redraw = TRUE;
+        }
+
         // When user press 'Fire' start the game
 	if (app.keyboard[SDL_SCANCODE_LCTRL])
 	{
@@ -65,13 +101,21 @@ static void logic(void)
 static void draw(void)
 {
 	drawBackground();
-	
-	drawLogo();
-	
-	if (timeout % 40 < 20)
-	{
-		drawText(SCREEN_WIDTH / 2, 600, 255, 255, 255, TEXT_CENTER, "PRESS FIRE TO PLAY!");
-	}
+
+        // Compose the title layer only when the logo or the blink phase changed
+        if (beginLayer(&titleLayer))
+        {
+                drawLogo();
+
+                if (blink)
+                {
+                        drawText(SCREEN_WIDTH / 2, 600, 255, 255, 255, TEXT_CENTER, "PRESS FIRE TO PLAY!");
+                }
+
+                endLayer();
+        }
+
+        drawLayer(&titleLayer);
 }
 
 static void drawLogo(void)
@@ -81,9 +125,8 @@ static void drawLogo(void)
 	r.x = 0;
 	r.y = 0;
 	
-	SDL_QueryTexture(titleTexture, NULL, NULL, &r.w, &r.h);
-	
-	r.h = MIN(reveal, r.h);
+	r.w = titleWidth;
+	r.h = MIN(reveal, titleHeight);
 	
 	blitRect(titleTexture, &r, (SCREEN_WIDTH / 2) - (r.w / 2), 100);
 }
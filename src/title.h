@@ -19,12 +19,18 @@
 
 #include "common.h"
 
+extern int beginLayer(Layer *layer);
 extern void blitRect(SDL_Texture *texture, SDL_Rect *src, int x, int y);
 extern void doBackground(void);
 extern void drawBackground(void);
+extern void drawLayer(Layer *layer);
 extern void drawText(int x, int y, int r, int g, int b, int align, char *format, ...);
+extern void endLayer(void);
+extern void getTextureSize(SDL_Texture *texture, int *w, int *h);
 extern void initHighscores(void);
+extern void initLayer(Layer *layer, int x, int y, int w, int h);
 extern void initStage(void);
 extern SDL_Texture *loadTexture(char *filename);
+extern void prepareStage(void);
 
 extern App app;
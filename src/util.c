@@ -19,10 +19,81 @@
 
 #include "util.h"
 
-// Detect collision
-// Check if two rectangles define by their position (x, y) and their dimension (w, h)
-// are colliding each other.
-int collision(int x1, int y1, int w1, int h1, int x2, int y2, int w2, int h2)
+static Uint32 randomState = RANDOM_SEED;
+static Uint32 cosmeticState = RANDOM_SEED;
+
+// Log a startup phase.
+// Print how long the phase took since start, and when it ended since the program
+// started, to follow where the time to the first frame goes. Can be called from any thread.
+void logStartupPhase(char *name, Uint64 start)
+{
+	Uint64 now;
+	double ms;
+
+	now = SDL_GetPerformanceCounter();
+	ms = SDL_GetPerformanceFrequency() / 1000.0;
+
+	SDL_LogMessage(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO, "Startup %-16s %8.2f ms, at %8.2f ms", name, (now - start) / ms, (now - app.startTime) / ms);
+}
+
+// Return a random number in [0, n), for the game logic.
+// A xorshift generator, whose state is saved in the snapshots, so a restored
+// game goes on exactly as the original one.
+int getRandom(int n)
+{
+	randomState ^= randomState << 13;
+	randomState ^= randomState >> 17;
+	randomState ^= randomState << 5;
+
+	return randomState % n;
+}
+
+Uint32 getRandomState(void)
+{
+	return randomState;
+}
+
+void setRandomState(Uint32 state)
 {
-	return (MAX(x1, x2) < MIN(x1 + w1, x2 + w2)) && (MAX(y1, y2) < MIN(y1 + h1, y2 + h2));
+	randomState = (state != 0) ? state : RANDOM_SEED;
+}
+
+// Return a random number in [0, n), for the cosmetic effects.
+// A generator apart from the game logic one, and not saved in the snapshots, so the
+// effects, which the quality governor scales with the frame time, never change the game.
+int getCosmeticRandom(int n)
+{
+	cosmeticState ^= cosmeticState << 13;
+	cosmeticState ^= cosmeticState >> 17;
+	cosmeticState ^= cosmeticState << 5;
+
+	return cosmeticState % n;
+}
+
+// Index of a texture in a table of textures, 0 when it isn't there.
+int getTextureIndex(SDL_Texture *texture, SDL_Texture **textures, int numTextures)
+{
+	int i;
+
+	for (i = 0 ; i < numTextures ; i++)
+	{
+		if (textures[i] == texture)
+		{
+			return i;
+		}
+	}
+
+	return 0;
+}
+
+// Mix the bits of a hash, so every bit of the value changes about half of them.
+Uint32 mixHash(Uint32 h)
+{
+	h ^= h >> 16;
+	h *= 0x85EBCA6B;
+	h ^= h >> 13;
+	h *= 0xC2B2AE35;
+	h ^= h >> 16;
+
+	return h;
 }
@@ -18,3 +18,5 @@
 */
 
 #include "common.h"
+
+extern App app;
@@ -0,0 +1,412 @@
+/*
+    Copyright (C) 2021 Vincent Radé
+    Copyright (C) 2015-2018 Parallel Realities
+
+    Nature Invaders is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Nature Invaders is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Nature Invaders. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include "world.h"
+
+static void growWorld(int capacity);
+static Uint32 hashComponents(int n);
+static Uint32 hashPosition(int n, Uint32 h);
+
+static int *freeIndexes;
+static int numFree;
+
+// Reserve the component arrays for 'capacity' entities, so none is allocated
+// while playing. The world still grows when it is full.
+void initWorld(int capacity)
+{
+	if (capacity > world.capacity)
+	{
+		growWorld(capacity);
+	}
+}
+
+// Id of the living entity at an index, for the systems which walk the arrays.
+int getEntityId(int n)
+{
+	return (world.generations[n] << ENTITY_INDEX_BITS) | n;
+}
+
+// Create an entity with the given COMPONENT_ bits, and return its id, which is never 0.
+// The last index freed is used first, while its components are still in the cache.
+// The components start at 0.
+int createEntity(int components)
+{
+	int n;
+
+	if (numFree > 0)
+	{
+		n = freeIndexes[--numFree];
+	}
+	else
+	{
+		if (world.size == world.capacity)
+		{
+			growWorld(MAX(world.capacity * 2, ENTITY_POOL_SIZE));
+		}
+
+		n = world.size++;
+	}
+
+	world.components[n] = components;
+	world.x[n] = 0;
+	world.y[n] = 0;
+	world.fx[n] = 0;
+	world.fy[n] = 0;
+	world.dx[n] = 0;
+	world.dy[n] = 0;
+	world.texture[n] = NULL;
+	world.w[n] = 0;
+	world.h[n] = 0;
+	world.health[n] = 0;
+	world.reload[n] = 0;
+	world.points[n] = 0;
+	world.collider[n] = 0;
+	world.hash[n] = 0;
+	world.hashGroup[n] = 0;
+
+	return getEntityId(n);
+}
+
+// TRUE when the id is the one of a living entity.
+int isEntityAlive(int id)
+{
+	int n;
+
+	n = ENTITY_INDEX(id);
+
+	return id != 0 && n < world.size && world.components[n] != 0
+	       && world.generations[n] == id >> ENTITY_INDEX_BITS;
+}
+
+// Destroy an entity, and remove its collider.
+// Ids of entities already destroyed are ignored.
+void destroyEntity(int id)
+{
+	int n;
+
+	if (!isEntityAlive(id))
+	{
+		return;
+	}
+
+	n = ENTITY_INDEX(id);
+
+	if (world.collider[n] != 0)
+	{
+		removeCollider(world.collider[n]);
+	}
+
+	world.hashes[world.hashGroup[n]] ^= world.hash[n];
+
+	world.components[n] = 0;
+	world.generations[n] = world.generations[n] % MAX_ENTITY_GENERATION + 1;
+
+	freeIndexes[numFree++] = n;
+}
+
+// Destroy every entity at once.
+// The colliders are not removed, they are cleared with the broadphase.
+void clearWorld(void)
+{
+	int n;
+
+	for (n = 0 ; n < world.size ; n++)
+	{
+		if (world.components[n] != 0)
+		{
+			world.components[n] = 0;
+			world.generations[n] = world.generations[n] % MAX_ENTITY_GENERATION + 1;
+		}
+	}
+
+	world.size = 0;
+	numFree = 0;
+
+	memset(world.hashes, 0, sizeof(world.hashes));
+}
+
+// Hash an entity again after its components changed, in the 'group' part of the state.
+// Only the entities which changed are hashed, and their hashes are combined with XOR,
+// so the old hash of the entity is taken out and the new one put in, whatever the order.
+// The reload timers count down every tick, so they are left out: a timer which
+// diverges shows when the weapon fires, in the bullets and the random state.
+void hashEntity(int id, int group)
+{
+	int n;
+
+	n = ENTITY_INDEX(id);
+
+	world.hashes[world.hashGroup[n]] ^= world.hash[n];
+
+	world.hashBase[n] = hashComponents(n);
+	world.hash[n] = hashPosition(n, world.hashBase[n]);
+	world.hashGroup[n] = group;
+
+	world.hashes[group] ^= world.hash[n];
+}
+
+// Hash again the positions of the entities with a velocity, in the 'group' part of the state.
+// They move every tick, so only their positions are hashed with the hash of their
+// other components, the other changes are hashed by hashEntity. An entity which
+// isn't hashed yet is hashed whole. The changes of the hashes are combined first,
+// and put in the part of the state once.
+void hashMovingEntities(int group)
+{
+	Uint32 h, change;
+	int n;
+
+	change = 0;
+
+	for (n = 0 ; n < world.size ; n++)
+	{
+		if (world.components[n] & COMPONENT_VELOCITY)
+		{
+			if (world.hash[n] == 0 || world.hashGroup[n] != group)
+			{
+				hashEntity(getEntityId(n), group);
+				continue;
+			}
+
+			h = hashPosition(n, world.hashBase[n]);
+
+			change ^= world.hash[n] ^ h;
+			world.hash[n] = h;
+		}
+	}
+
+	world.hashes[group] ^= change;
+}
+
+// Save the entities in a snapshot.
+// Only the components an entity has are saved. A texture is saved as its index
+// in 'textures', and a collider as its layers, the broadphase is built again on load.
+void saveWorld(Snapshot *s, SDL_Texture **textures, int numTextures)
+{
+	Collider *c;
+	int n;
+
+	writeSnapshotInt(s, world.size, 4);
+	writeSnapshotInt(s, numFree, 4);
+
+	for (n = 0 ; n < numFree ; n++)
+	{
+		writeSnapshotInt(s, freeIndexes[n], 4);
+	}
+
+	for (n = 0 ; n < world.size ; n++)
+	{
+		writeSnapshotInt(s, world.generations[n], 2);
+		writeSnapshotInt(s, world.components[n], 1);
+		writeSnapshotInt(s, (world.hash[n] != 0) ? world.hashGroup[n] + 1 : 0, 1);
+
+		if (world.components[n] & COMPONENT_POSITION)
+		{
+			writeSnapshotFixed(s, world.x[n]);
+			writeSnapshotFixed(s, world.y[n]);
+#ifndef FLOAT_POSITIONS
+			writeSnapshotInt(s, world.fx[n], 1);
+			writeSnapshotInt(s, world.fy[n], 1);
+#endif
+		}
+
+		if (world.components[n] & COMPONENT_VELOCITY)
+		{
+			writeSnapshotFixed(s, world.dx[n]);
+			writeSnapshotFixed(s, world.dy[n]);
+		}
+
+		if (world.components[n] & COMPONENT_SPRITE)
+		{
+			writeSnapshotInt(s, getTextureIndex(world.texture[n], textures, numTextures), 1);
+			writeSnapshotInt(s, world.w[n], 2);
+			writeSnapshotInt(s, world.h[n], 2);
+		}
+
+		if (world.components[n] & COMPONENT_HEALTH)
+		{
+			writeSnapshotInt(s, world.health[n], 2);
+		}
+
+		if (world.components[n] & COMPONENT_WEAPON)
+		{
+			writeSnapshotInt(s, world.reload[n], 2);
+		}
+
+		if (world.components[n] & COMPONENT_SCORE)
+		{
+			writeSnapshotInt(s, world.points[n], 2);
+		}
+
+		if (world.components[n] & COMPONENT_COLLIDER)
+		{
+			c = (world.collider[n] != 0) ? getCollider(world.collider[n]) : NULL;
+
+			writeSnapshotInt(s, (c != NULL) ? c->layer : 0, 1);
+			writeSnapshotInt(s, (c != NULL) ? c->mask : 0, 1);
+		}
+	}
+}
+
+// Restore the entities from a snapshot, with the same ids.
+// The colliders are added again at the bounds of their entities, so the
+// broadphase must be cleared before.
+void loadWorld(Snapshot *s, SDL_Texture **textures, int numTextures)
+{
+	int n, size, layer, mask, group;
+
+	size = readSnapshotRange(s, 4, 0, 1 << ENTITY_INDEX_BITS);
+
+	if (size > world.capacity)
+	{
+		growWorld(size);
+	}
+
+	world.size = size;
+	numFree = readSnapshotRange(s, 4, 0, size);
+
+	for (n = 0 ; n < numFree ; n++)
+	{
+		freeIndexes[n] = readSnapshotRange(s, 4, 0, size - 1);
+	}
+
+	for (n = 0 ; n < world.size ; n++)
+	{
+		world.generations[n] = readSnapshotRange(s, 2, 1, MAX_ENTITY_GENERATION);
+		world.components[n] = readSnapshotInt(s, 1) & 0xFF;
+		group = readSnapshotRange(s, 1, 0, NUM_HASHES);
+
+		world.x[n] = (world.components[n] & COMPONENT_POSITION) ? readSnapshotFixed(s) : 0;
+		world.y[n] = (world.components[n] & COMPONENT_POSITION) ? readSnapshotFixed(s) : 0;
+		world.fx[n] = (world.components[n] & COMPONENT_POSITION) ? readSnapshotFraction(s) : 0;
+		world.fy[n] = (world.components[n] & COMPONENT_POSITION) ? readSnapshotFraction(s) : 0;
+		world.dx[n] = (world.components[n] & COMPONENT_VELOCITY) ? readSnapshotVelocity(s) : 0;
+		world.dy[n] = (world.components[n] & COMPONENT_VELOCITY) ? readSnapshotVelocity(s) : 0;
+		world.texture[n] = NULL;
+		world.w[n] = 0;
+		world.h[n] = 0;
+
+		if (world.components[n] & COMPONENT_SPRITE)
+		{
+			world.texture[n] = textures[readSnapshotRange(s, 1, 0, numTextures - 1)];
+			world.w[n] = readSnapshotRange(s, 2, 0, SCREEN_WIDTH);
+			world.h[n] = readSnapshotRange(s, 2, 0, SCREEN_HEIGHT);
+		}
+
+		world.health[n] = (world.components[n] & COMPONENT_HEALTH) ? readSnapshotInt(s, 2) : 0;
+		world.reload[n] = (world.components[n] & COMPONENT_WEAPON) ? readSnapshotInt(s, 2) : 0;
+		world.points[n] = (world.components[n] & COMPONENT_SCORE) ? readSnapshotInt(s, 2) : 0;
+		world.collider[n] = 0;
+
+		if (world.components[n] & COMPONENT_COLLIDER)
+		{
+			layer = readSnapshotInt(s, 1) & 0xFF;
+			mask = readSnapshotInt(s, 1) & 0xFF;
+
+			if (layer != 0)
+			{
+				world.collider[n] = addCollider(layer, mask, getEntityId(n));
+
+				moveCollider(world.collider[n], FROM_FIXED(world.x[n]), FROM_FIXED(world.y[n]), world.w[n], world.h[n]);
+			}
+		}
+
+		// The hashes are computed again from the restored components
+		world.hash[n] = 0;
+		world.hashGroup[n] = 0;
+
+		if (world.components[n] != 0 && group != 0)
+		{
+			hashEntity(getEntityId(n), group - 1);
+		}
+	}
+
+	// The indexes past the restored ones start again at the first generation, so
+	// the entities created there after a rollback get the same ids again
+	for (n = world.size ; n < world.capacity ; n++)
+	{
+		world.generations[n] = 1;
+		world.components[n] = 0;
+	}
+}
+
+// Grow the component arrays. The new indexes start at the first generation.
+static void growWorld(int capacity)
+{
+	int n;
+
+	world.generations = realloc(world.generations, capacity * sizeof(int));
+	world.components = realloc(world.components, capacity * sizeof(Uint8));
+	world.x = realloc(world.x, capacity * sizeof(Fixed));
+	world.y = realloc(world.y, capacity * sizeof(Fixed));
+	world.fx = realloc(world.fx, capacity * sizeof(Uint8));
+	world.fy = realloc(world.fy, capacity * sizeof(Uint8));
+	world.dx = realloc(world.dx, capacity * sizeof(Fixed));
+	world.dy = realloc(world.dy, capacity * sizeof(Fixed));
+	world.texture = realloc(world.texture, capacity * sizeof(SDL_Texture *));
+	world.w = realloc(world.w, capacity * sizeof(int));
+	world.h = realloc(world.h, capacity * sizeof(int));
+	world.health = realloc(world.health, capacity * sizeof(int));
+	world.reload = realloc(world.reload, capacity * sizeof(int));
+	world.points = realloc(world.points, capacity * sizeof(int));
+	world.collider = realloc(world.collider, capacity * sizeof(int));
+	world.hash = realloc(world.hash, capacity * sizeof(Uint32));
+	world.hashBase = realloc(world.hashBase, capacity * sizeof(Uint32));
+	world.hashGroup = realloc(world.hashGroup, capacity * sizeof(int));
+
+	freeIndexes = realloc(freeIndexes, capacity * sizeof(int));
+
+	for (n = world.capacity ; n < capacity ; n++)
+	{
+		world.generations[n] = 1;
+		world.components[n] = 0;
+	}
+
+	world.capacity = capacity;
+}
+
+// Hash the components of an entity, but its position.
+// The components are multiplied by different odd constants and added, so the
+// multiplications run side by side. It finds a divergence, it isn't meant to
+// resist collisions made on purpose.
+static Uint32 hashComponents(int n)
+{
+	return ((world.generations[n] << ENTITY_INDEX_BITS) | n) * 0x9E3779B1u
+	       + world.components[n] * 0x85EBCA77u
+	       + ((Uint32)VELOCITY_WORD(world.dx[n]) << 16 | VELOCITY_WORD(world.dy[n])) * 0x165667B1u
+	       + (world.w[n] << 16 | world.h[n]) * 0xFD7046C5u
+	       + world.health[n] * 0xB55A4F09u
+	       + world.points[n] * 0x7FEB352Du
+	       + (world.collider[n] != 0) * 0x846CA68Bu;
+}
+
+// Hash the position of an entity with the hash of its other components, and mix the sum.
+// Both fixed point coordinates fit in one word, the float ones are rounded to it, and
+// both fractions in another.
+static Uint32 hashPosition(int n, Uint32 h)
+{
+	h += ((Uint32)FIXED_WORD(world.x[n]) << 16 | FIXED_WORD(world.y[n])) * 0xC2B2AE3Du
+	     + (world.fx[n] << 8 | world.fy[n]) * 0x27D4EB2Fu;
+
+	h ^= h >> 15;
+	h *= 0x2C1B3C6Du;
+	h ^= h >> 12;
+
+	// Never 0, which marks an entity without hash
+	return h | 1;
+}
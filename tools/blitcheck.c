@@ -0,0 +1,265 @@
+/*
+    Copyright (C) 2021 Vincent Radé
+    Copyright (C) 2015-2018 Parallel Realities
+
+    Nature Invaders is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Nature Invaders is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Nature Invaders. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+// Framebuffer kernel check.
+// Composite random rows with every blend mode and color modulation through the
+// row kernels of the software framebuffer, and compare them with the generic
+// blitters of SDL. The SSE2 and AVX2 kernels must give the same pixels as the
+// portable ones, and each channel must be within BLIT_TOLERANCE of SDL, whose
+// rounding of the divisions by 255 changed between versions.
+// The kernels are static, so the framebuffer module is built in this tool.
+
+#include "../src/framebuffer.c"
+
+// Largest difference of a channel with the SDL blitters
+#define BLIT_TOLERANCE 1
+
+// Longest row checked, covering the vector bodies and the scalar tails
+#define MAX_ROW 67
+
+#define ROUNDS 20000
+
+typedef void (*Kernel)(Uint32 *dst, const Uint32 *src, int n, Uint32 mod);
+
+typedef struct {
+	char *name;
+	Kernel add, blend, premultiplied;
+} KernelSet;
+
+static int checkKernels(KernelSet *set);
+static int checkRow(char *name, char *mode, Kernel kernel, Kernel scalar, int mode2, Uint32 *src, Uint32 *dst, int n, Uint32 mod);
+static Uint32 randomPixel(void);
+static Uint32 reference(int mode, Uint32 s, Uint32 d, Uint32 mod);
+
+App app;
+
+static int maxDiff;
+static Uint32 seed = 1;
+
+int main(int argc, char *argv[])
+{
+	KernelSet sets[3];
+	int numSets, failures, i;
+
+	sets[0].name = "portable";
+	sets[0].add = addRowScalar;
+	sets[0].blend = blendRowScalar;
+	sets[0].premultiplied = premultipliedRowScalar;
+	numSets = 1;
+
+#ifdef __SSE2__
+	if (SDL_HasSSE2())
+	{
+		sets[numSets].name = "SSE2";
+		sets[numSets].add = addRowSSE2;
+		sets[numSets].blend = blendRowSSE2;
+		sets[numSets].premultiplied = premultipliedRowSSE2;
+		numSets++;
+	}
+#endif
+
+#ifdef FRAMEBUFFER_AVX2
+	if (SDL_HasAVX2())
+	{
+		sets[numSets].name = "AVX2";
+		sets[numSets].add = addRowAVX2;
+		sets[numSets].blend = blendRowAVX2;
+		sets[numSets].premultiplied = premultipliedRowAVX2;
+		numSets++;
+	}
+#endif
+
+	failures = 0;
+
+	for (i = 0 ; i < numSets ; i++)
+	{
+		failures += checkKernels(&sets[i]);
+	}
+
+	if (failures > 0)
+	{
+		printf("%d rows differ\n", failures);
+		return 1;
+	}
+
+	printf("%d rows checked with each of the %d kernel sets, the largest difference with the SDL blitters is %d\n",
+		ROUNDS * 3, numSets, maxDiff);
+
+	return 0;
+}
+
+// Check a set of kernels on random rows, and return the number of failed rows.
+static int checkKernels(KernelSet *set)
+{
+	Uint32 src[MAX_ROW + 1], dst[MAX_ROW + 1];
+	Uint32 mod;
+	int round, failures, n, offset, i;
+
+	failures = 0;
+
+	for (round = 0 ; round < ROUNDS ; round++)
+	{
+		// Unaligned rows of any length, with fully transparent and opaque pixels
+		// as often as translucent ones
+		n = round % MAX_ROW;
+		offset = round & 1;
+
+		for (i = 0 ; i < MAX_ROW + 1 ; i++)
+		{
+			src[i] = randomPixel();
+			dst[i] = randomPixel();
+		}
+
+		switch (round % 4)
+		{
+		case 0:
+			mod = 0xFFFFFFFF;
+			break;
+		case 1:
+			mod = 0xFF000000 | (randomPixel() & 0xFFFFFF);
+			break;
+		default:
+			mod = randomPixel() | 0x01000000;
+			break;
+		}
+
+		failures += checkRow(set->name, "additive", set->add, addRowScalar, BLEND_ADD, src + offset, dst + offset, n, mod);
+		failures += checkRow(set->name, "alpha", set->blend, blendRowScalar, BLEND_ALPHA, src + offset, dst + offset, n, mod);
+
+		// Premultiplied sources have no channel above their alpha
+		for (i = 0 ; i < MAX_ROW + 1 ; i++)
+		{
+			src[i] = (src[i] & 0xFF000000)
+				| MIN((src[i] >> 16) & 0xFF, src[i] >> 24) << 16
+				| MIN((src[i] >> 8) & 0xFF, src[i] >> 24) << 8
+				| MIN(src[i] & 0xFF, src[i] >> 24);
+		}
+
+		failures += checkRow(set->name, "premultiplied", set->premultiplied, premultipliedRowScalar, BLEND_PREMULTIPLIED, src + offset, dst + offset, n, 0xFFFFFFFF);
+	}
+
+	return failures;
+}
+
+// Composite a row with a kernel and with the portable one, and compare both with
+// the SDL blitters. Return 1 when the row differs.
+static int checkRow(char *name, char *mode, Kernel kernel, Kernel scalar, int mode2, Uint32 *src, Uint32 *dst, int n, Uint32 mod)
+{
+	Uint32 out[MAX_ROW], expected[MAX_ROW];
+	Uint32 sdl;
+	int i, c, diff;
+
+	memcpy(out, dst, n * 4);
+	memcpy(expected, dst, n * 4);
+
+	kernel(out, src, n, mod);
+	scalar(expected, src, n, mod);
+
+	for (i = 0 ; i < n ; i++)
+	{
+		if (out[i] != expected[i])
+		{
+			printf("%s %s: pixel %d of %d is %08X instead of %08X, source %08X on %08X with %08X\n",
+				name, mode, i, n, out[i], expected[i], src[i], dst[i], mod);
+			return 1;
+		}
+
+		sdl = reference(mode2, src[i], dst[i], mod);
+
+		for (c = 0 ; c < 32 ; c += 8)
+		{
+			diff = abs((int)((out[i] >> c) & 0xFF) - (int)((sdl >> c) & 0xFF));
+			maxDiff = MAX(maxDiff, diff);
+
+			if (diff > BLIT_TOLERANCE)
+			{
+				printf("%s %s: pixel %08X instead of %08X, source %08X on %08X with %08X\n",
+					name, mode, out[i], sdl, src[i], dst[i], mod);
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+// Blend a pixel like the generic blitters of SDL, which the SDL software renderer
+// uses for modulated sprites: the source is multiplied by the color modulation and
+// by its alpha, then
+// alpha          dstRGB = srcRGB + dstRGB * (1 - srcA), dstA = srcA + dstA * (1 - srcA)
+// additive       dstRGB = srcRGB + dstRGB, dstA = dstA
+// each step truncated to 8 bits. Premultiplied sources skip the multiplications.
+static Uint32 reference(int mode, Uint32 s, Uint32 d, Uint32 mod)
+{
+	Uint32 sc[4], dc[4], out;
+	int c;
+
+	for (c = 0 ; c < 4 ; c++)
+	{
+		sc[c] = (s >> (c * 8)) & 0xFF;
+		dc[c] = (d >> (c * 8)) & 0xFF;
+
+		if (mode != BLEND_PREMULTIPLIED)
+		{
+			sc[c] = sc[c] * ((mod >> (c * 8)) & 0xFF) / 255;
+		}
+	}
+
+	for (c = 0 ; c < 3 && mode != BLEND_PREMULTIPLIED ; c++)
+	{
+		sc[c] = sc[c] * sc[3] / 255;
+	}
+
+	out = 0;
+
+	for (c = 0 ; c < 4 ; c++)
+	{
+		if (mode == BLEND_ADD)
+		{
+			dc[c] = c == 3 ? dc[c] : MIN(255, sc[c] + dc[c]);
+		}
+		else
+		{
+			dc[c] = sc[c] + dc[c] * (255 - sc[3]) / 255;
+		}
+
+		out |= dc[c] << (c * 8);
+	}
+
+	return out;
+}
+
+// Random pixel, with a transparent or opaque alpha a quarter of the time each.
+static Uint32 randomPixel(void)
+{
+	Uint32 p;
+
+	seed = seed * 1664525 + 1013904223;
+	p = seed ^ (seed >> 16) * 0x45D9F3B;
+
+	switch (seed >> 30)
+	{
+	case 0:
+		return p & 0xFFFFFF;
+	case 1:
+		return p | 0xFF000000;
+	default:
+		return p;
+	}
+}
@@ -0,0 +1,247 @@
+/*
+    Copyright (C) 2021 Vincent Radé
+    Copyright (C) 2015-2018 Parallel Realities
+
+    Nature Invaders is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Nature Invaders is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Nature Invaders. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+// Asset pack builder.
+// Decode every asset given on the command line once, and write them in a pack
+// the game maps in memory at startup: images as ARGB8888 pixels, sounds as
+// PCM samples in the mixer format, and music as the original compressed file.
+
+#include "common.h"
+
+#include "SDL2/SDL_image.h"
+#include "SDL2/SDL_mixer.h"
+
+typedef struct {
+	PackEntry entry;
+	void *data;
+} Asset;
+
+static int compareAsset(const void *a, const void *b);
+static int loadAsset(char *filename, Asset *asset);
+static void *loadImage(char *filename, PackEntry *entry);
+static void *loadSound(char *filename, PackEntry *entry);
+
+int main(int argc, char *argv[])
+{
+	static Uint8 padding[PACK_ALIGN];
+	PackHeader header;
+	Asset *assets;
+	Uint32 offset, position;
+	Uint16 format;
+	FILE *fp;
+	int i, frequency, channels;
+
+	if (argc < 3)
+	{
+		fprintf(stderr, "Usage: %s <pack> <asset>...\n", argv[0]);
+		return 1;
+	}
+
+	// Open the audio device like the game does, to convert sounds to its format
+	if (SDL_Init(SDL_INIT_AUDIO) < 0 || Mix_OpenAudio(MIXER_FREQUENCY, MIX_DEFAULT_FORMAT, MIXER_CHANNELS, MIXER_SAMPLES) < 0)
+	{
+		fprintf(stderr, "Couldn't initialize SDL Mixer: %s\n", SDL_GetError());
+		return 1;
+	}
+
+	Mix_QuerySpec(&frequency, &format, &channels);
+
+	memset(&header, 0, sizeof(PackHeader));
+	memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+	header.version = PACK_VERSION;
+	header.numEntries = argc - 2;
+	header.frequency = frequency;
+	header.format = format;
+	header.channels = channels;
+
+	assets = calloc(header.numEntries, sizeof(Asset));
+
+	for (i = 0 ; i < header.numEntries ; i++)
+	{
+		if (!loadAsset(argv[i + 2], &assets[i]))
+		{
+			fprintf(stderr, "Couldn't load %s: %s\n", argv[i + 2], SDL_GetError());
+			return 1;
+		}
+	}
+
+	// Sort the table of contents by name, the game searches it by dichotomy
+	qsort(assets, header.numEntries, sizeof(Asset), compareAsset);
+
+	// Align every asset, so pixels and samples can be used in place
+	offset = sizeof(PackHeader) + header.numEntries * sizeof(PackEntry);
+
+	for (i = 0 ; i < header.numEntries ; i++)
+	{
+		offset = (offset + PACK_ALIGN - 1) & ~(PACK_ALIGN - 1);
+		assets[i].entry.offset = offset;
+		offset += assets[i].entry.size;
+	}
+
+	fp = fopen(argv[1], "wb");
+
+	if (fp == NULL)
+	{
+		fprintf(stderr, "Couldn't open %s\n", argv[1]);
+		return 1;
+	}
+
+	fwrite(&header, sizeof(PackHeader), 1, fp);
+
+	for (i = 0 ; i < header.numEntries ; i++)
+	{
+		fwrite(&assets[i].entry, sizeof(PackEntry), 1, fp);
+	}
+
+	position = sizeof(PackHeader) + header.numEntries * sizeof(PackEntry);
+
+	for (i = 0 ; i < header.numEntries ; i++)
+	{
+		fwrite(padding, 1, assets[i].entry.offset - position, fp);
+		fwrite(assets[i].data, 1, assets[i].entry.size, fp);
+		position = assets[i].entry.offset + assets[i].entry.size;
+
+		printf("%-64s %8u bytes\n", assets[i].entry.name, assets[i].entry.size);
+	}
+
+	fclose(fp);
+
+	printf("Wrote %s, %u assets, %u bytes\n", argv[1], header.numEntries, position);
+
+	Mix_CloseAudio();
+	SDL_Quit();
+
+	return 0;
+}
+
+// Load an asset.
+// The type of the asset comes from its directory, and its name is the path the game loads it from.
+static int loadAsset(char *filename, Asset *asset)
+{
+	PackEntry *entry;
+	size_t size;
+
+	entry = &asset->entry;
+
+	if (strlen(filename) >= MAX_PACK_NAME_LENGTH)
+	{
+		SDL_SetError("Name longer than %d characters", MAX_PACK_NAME_LENGTH - 1);
+		return FALSE;
+	}
+
+	STRNCPY(entry->name, filename, MAX_PACK_NAME_LENGTH);
+
+	if (strncmp(filename, "gfx/", 4) == 0)
+	{
+		entry->type = PACK_IMAGE;
+		asset->data = loadImage(filename, entry);
+	}
+	else if (strncmp(filename, "sound/", 6) == 0)
+	{
+		entry->type = PACK_SOUND;
+		asset->data = loadSound(filename, entry);
+	}
+	else if (strncmp(filename, "music/", 6) == 0)
+	{
+		entry->type = PACK_MUSIC;
+		asset->data = SDL_LoadFile(filename, &size);
+		entry->size = size;
+	}
+	else
+	{
+		SDL_SetError("Unknown asset type");
+		return FALSE;
+	}
+
+	return asset->data != NULL;
+}
+
+// Load an image.
+// Store the pixels in ARGB8888 without padding between rows, and record if the image is opaque.
+static void *loadImage(char *filename, PackEntry *entry)
+{
+	SDL_Surface *image, *surface;
+	Uint32 *pixels;
+	int i, y;
+
+	image = IMG_Load(filename);
+
+	if (image == NULL)
+	{
+		return NULL;
+	}
+
+	surface = SDL_ConvertSurfaceFormat(image, SDL_PIXELFORMAT_ARGB8888, 0);
+	SDL_FreeSurface(image);
+
+	if (surface == NULL)
+	{
+		return NULL;
+	}
+
+	entry->w = surface->w;
+	entry->h = surface->h;
+	entry->size = surface->w * surface->h * 4;
+	entry->opaque = TRUE;
+
+	pixels = malloc(entry->size);
+
+	for (y = 0 ; y < surface->h ; y++)
+	{
+		memcpy(pixels + y * surface->w, (Uint8 *)surface->pixels + y * surface->pitch, surface->w * 4);
+	}
+
+	SDL_FreeSurface(surface);
+
+	for (i = 0 ; i < entry->w * entry->h && entry->opaque ; i++)
+	{
+		entry->opaque = (pixels[i] >> 24) == SDL_ALPHA_OPAQUE;
+	}
+
+	return pixels;
+}
+
+// Load a sound.
+// Let SDL Mixer decode and convert the sound, and keep its samples.
+static void *loadSound(char *filename, PackEntry *entry)
+{
+	Mix_Chunk *chunk;
+	void *samples;
+
+	chunk = Mix_LoadWAV(filename);
+
+	if (chunk == NULL)
+	{
+		return NULL;
+	}
+
+	entry->size = chunk->alen;
+
+	samples = malloc(chunk->alen);
+	memcpy(samples, chunk->abuf, chunk->alen);
+
+	Mix_FreeChunk(chunk);
+
+	return samples;
+}
+
+static int compareAsset(const void *a, const void *b)
+{
+	return strcmp(((Asset *)a)->entry.name, ((Asset *)b)->entry.name);
+}
@@ -0,0 +1,279 @@
+/*
+    Copyright (C) 2021 Vincent Radé
+    Copyright (C) 2015-2018 Parallel Realities
+
+    Nature Invaders is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Nature Invaders is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Nature Invaders. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+// Replay position comparison.
+// Compare the positions dumped with -dump by two builds playing the same replay,
+// the float build as the reference and the fixed point one. The ids of the entities
+// differ once a bullet leaves a frame earlier in one build, so the entities are
+// matched by birth: the ones appearing on the same frame are paired by their
+// nearest position and velocity. Every frame, the position of an entity must be
+// within REPLAY_TOLERANCE of the reference, however long it lived. An entity which is gone from the other dump is compared with
+// the last position of its partner, moved on with its velocity, so a bullet which
+// leaves the screen or hits a shield a frame apart stays within the tolerance.
+
+#include "common.h"
+
+typedef struct {
+	int birth;       // Frame the entity appeared
+	int frame;       // Last frame the entity was seen
+	int partner;     // Track of the same entity in the other dump, -1 when none
+	float x, y, dx, dy;
+} Track;
+
+typedef struct {
+	FILE *fp;
+	int ids[1 << ENTITY_INDEX_BITS];    // Id of the entity at each index
+	int tracks[1 << ENTITY_INDEX_BITS]; // Track of the entity at each index
+	Track *track;
+	int numTracks, maxTracks;
+	int *seen;       // Tracks seen on the current frame
+	int numSeen, maxSeen;
+	int frame;       // Frame of the line read ahead, -1 at the end of the file
+	int id;
+	float x, y, dx, dy;
+} Dump;
+
+static void compareTrack(Track *t, Track *r, int frame);
+static void compareTracks(Dump *d, Dump *o, int frame);
+static void openDump(Dump *d, char *filename);
+static void pairBirths(Dump *a, int firstA, Dump *b, int firstB);
+static void readDump(Dump *d);
+static int readFrame(Dump *d, int frame);
+
+static Dump a, b;
+static int compared;
+static int moved;        // Positions compared with a partner moved on
+static int over;
+static int unpaired;
+static float maxError;
+static int maxFrame;
+static int maxAge;
+static int firstFailure = -1;
+
+int main(int argc, char *argv[])
+{
+	int frame, firstA, firstB, numFrames;
+
+	if (argc < 3)
+	{
+		fprintf(stderr, "Usage: %s <reference dump> <dump>\n", argv[0]);
+		return 1;
+	}
+
+	openDump(&a, argv[1]);
+	openDump(&b, argv[2]);
+
+	numFrames = 0;
+
+	while (a.frame >= 0 || b.frame >= 0)
+	{
+		frame = (a.frame < 0) ? b.frame : (b.frame < 0) ? a.frame : MIN(a.frame, b.frame);
+		numFrames++;
+
+		firstA = readFrame(&a, frame);
+		firstB = readFrame(&b, frame);
+
+		pairBirths(&a, firstA, &b, firstB);
+
+		compareTracks(&b, &a, frame);
+		compareTracks(&a, &b, frame);
+	}
+
+	printf("%d frames, %d positions compared, %d of them with the entity gone from the other dump, "
+	       "largest difference %.4f px (frame %d, %d frames old), %d over the tolerance, %d entities without partner\n",
+	       numFrames, compared, moved, maxError, maxFrame, maxAge, over, unpaired);
+
+	if (firstFailure >= 0)
+	{
+		printf("The dumps differ from frame %d\n", firstFailure);
+		return 1;
+	}
+
+	return 0;
+}
+
+// Compare the entities of a dump seen on a frame with their partners in the other
+// dump. The pairs seen in both are compared once, when 'd' is the second dump.
+static void compareTracks(Dump *d, Dump *o, int frame)
+{
+	Track *t, *r;
+	int i;
+
+	for (i = 0 ; i < d->numSeen ; i++)
+	{
+		t = &d->track[d->seen[i]];
+
+		if (t->partner < 0)
+		{
+			unpaired += (t->birth == frame);
+			firstFailure = (firstFailure < 0) ? frame : firstFailure;
+			continue;
+		}
+
+		r = &o->track[t->partner];
+
+		if (r->frame == frame && d == &b)
+		{
+			compareTrack(t, r, frame);
+		}
+		else if (r->frame != frame)
+		{
+			moved++;
+			compareTrack(t, r, frame);
+		}
+	}
+}
+
+// Compare the position of an entity with its partner, moved on with its velocity
+// from the last frame it was seen.
+static void compareTrack(Track *t, Track *r, int frame)
+{
+	float error;
+	int late;
+
+	late = frame - r->frame;
+	error = MAX(fabs(t->x - r->x - r->dx * late), fabs(t->y - r->y - r->dy * late));
+	compared++;
+
+	if (error > maxError)
+	{
+		maxError = error;
+		maxFrame = frame;
+		maxAge = frame - t->birth;
+	}
+
+	if (error > REPLAY_TOLERANCE)
+	{
+		over++;
+		firstFailure = (firstFailure < 0) ? frame : firstFailure;
+	}
+}
+
+// Read the entities of a frame, and return the first track of the entities
+// which appeared on this frame.
+static int readFrame(Dump *d, int frame)
+{
+	Track *t;
+	int n, first;
+
+	first = d->numTracks;
+	d->numSeen = 0;
+
+	for ( ; d->frame == frame ; readDump(d))
+	{
+		n = ENTITY_INDEX(d->id);
+
+		if (d->ids[n] != d->id)
+		{
+			if (d->numTracks == d->maxTracks)
+			{
+				d->maxTracks = MAX(d->maxTracks * 2, 1024);
+				d->track = realloc(d->track, d->maxTracks * sizeof(Track));
+			}
+
+			d->ids[n] = d->id;
+			d->tracks[n] = d->numTracks;
+
+			t = &d->track[d->numTracks++];
+			t->birth = frame;
+			t->partner = -1;
+		}
+
+		if (d->numSeen == d->maxSeen)
+		{
+			d->maxSeen = MAX(d->maxSeen * 2, 1024);
+			d->seen = realloc(d->seen, d->maxSeen * sizeof(int));
+		}
+
+		d->seen[d->numSeen++] = d->tracks[n];
+
+		t = &d->track[d->tracks[n]];
+		t->frame = frame;
+		t->x = d->x;
+		t->y = d->y;
+		t->dx = d->dx;
+		t->dy = d->dy;
+	}
+
+	return first;
+}
+
+// Pair the entities which appeared on the same frame in both dumps, each one
+// with the nearest by position and velocity.
+static void pairBirths(Dump *a, int firstA, Dump *b, int firstB)
+{
+	Track *t, *u;
+	float distance, nearest;
+	int i, j, k;
+
+	for (i = firstA ; i < a->numTracks ; i++)
+	{
+		t = &a->track[i];
+		k = -1;
+		nearest = 0;
+
+		for (j = firstB ; j < b->numTracks ; j++)
+		{
+			u = &b->track[j];
+
+			if (u->partner >= 0)
+			{
+				continue;
+			}
+
+			distance = fabs(t->x - u->x) + fabs(t->y - u->y) + fabs(t->dx - u->dx) + fabs(t->dy - u->dy);
+
+			if (k < 0 || distance < nearest)
+			{
+				k = j;
+				nearest = distance;
+			}
+		}
+
+		if (k >= 0)
+		{
+			t->partner = k;
+			b->track[k].partner = i;
+		}
+	}
+}
+
+static void openDump(Dump *d, char *filename)
+{
+	char line[MAX_LINE_LENGTH];
+
+	d->fp = fopen(filename, "r");
+
+	if (d->fp == NULL || fgets(line, sizeof(line), d->fp) == NULL || strncmp(line, "frame,id,x,y,dx,dy", 18) != 0)
+	{
+		fprintf(stderr, "Couldn't read the dump %s\n", filename);
+		exit(1);
+	}
+
+	readDump(d);
+}
+
+// Read the next line of a dump.
+static void readDump(Dump *d)
+{
+	if (fscanf(d->fp, "%d,%d,%f,%f,%f,%f", &d->frame, &d->id, &d->x, &d->y, &d->dx, &d->dy) != 6)
+	{
+		d->frame = -1;
+	}
+}